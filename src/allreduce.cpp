@@ -0,0 +1,251 @@
+#include "allreduce.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace gigagrad
+{
+
+static sockaddr_un SocketAddress(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
+        throw std::domain_error("Socket path is too long: " + path);
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+UnixSocketTransport::UnixSocketTransport(std::string path_prefix, size_t rank, size_t num_ranks)
+    : listen_path(path_prefix + "." + std::to_string(rank)),
+      rank(rank),
+      num_ranks(num_ranks)
+{
+    if(rank >= num_ranks)
+        throw std::domain_error("Rank must be less than the number of ranks");
+    if(num_ranks == 1)
+        return;
+
+    sockaddr_un listen_address = SocketAddress(this->listen_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0)
+        throw std::system_error(errno, std::generic_category());
+    unlink(this->listen_path.c_str());
+    if(bind(listen_fd, reinterpret_cast<sockaddr *>(&listen_address), sizeof(listen_address)) != 0
+       || listen(listen_fd, 1) != 0)
+    {
+        int error = errno;
+        close(listen_fd);
+        throw std::system_error(error, std::generic_category());
+    }
+
+    // Connections complete from the listen backlog, so every rank can connect to its next
+    // neighbor before accepting its previous one. The next rank may not be listening yet.
+    sockaddr_un next_address = SocketAddress(path_prefix + "." + std::to_string((rank + 1) % num_ranks));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    for(;;)
+    {
+        this->next_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(this->next_fd < 0)
+            break;
+        if(connect(this->next_fd, reinterpret_cast<sockaddr *>(&next_address), sizeof(next_address)) == 0)
+            break;
+        int error = errno;
+        close(this->next_fd);
+        this->next_fd = -1;
+        if((error != ENOENT && error != ECONNREFUSED) || std::chrono::steady_clock::now() > deadline)
+        {
+            errno = error;
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if(this->next_fd >= 0)
+        this->previous_fd = accept(listen_fd, nullptr, nullptr);
+    int error = errno;
+    close(listen_fd);
+    unlink(this->listen_path.c_str());
+    if(this->next_fd < 0 || this->previous_fd < 0)
+    {
+        if(this->next_fd >= 0)
+            close(this->next_fd);
+        throw std::system_error(error, std::generic_category());
+    }
+}
+
+UnixSocketTransport::~UnixSocketTransport()
+{
+    if(this->next_fd >= 0)
+        close(this->next_fd);
+    if(this->previous_fd >= 0)
+        close(this->previous_fd);
+}
+
+size_t UnixSocketTransport::Rank()
+{
+    return this->rank;
+}
+
+size_t UnixSocketTransport::NumRanks()
+{
+    return this->num_ranks;
+}
+
+void UnixSocketTransport::SendToNext(const void *data, size_t size_bytes)
+{
+    const char *bytes = static_cast<const char *>(data);
+    while(size_bytes > 0)
+    {
+        ssize_t sent = send(this->next_fd, bytes, size_bytes, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR)
+            continue;
+        if(sent < 0)
+            throw std::system_error(errno, std::generic_category());
+        bytes += sent;
+        size_bytes -= static_cast<size_t>(sent);
+    }
+}
+
+void UnixSocketTransport::ReceiveFromPrevious(void *data, size_t size_bytes)
+{
+    char *bytes = static_cast<char *>(data);
+    while(size_bytes > 0)
+    {
+        ssize_t received = recv(this->previous_fd, bytes, size_bytes, 0);
+        if(received < 0 && errno == EINTR)
+            continue;
+        if(received < 0)
+            throw std::system_error(errno, std::generic_category());
+        if(received == 0)
+            throw std::runtime_error("Previous rank closed the connection");
+        bytes += received;
+        size_bytes -= static_cast<size_t>(received);
+    }
+}
+
+void RingAllReduce(Transport &transport, float *data, size_t size_elts, size_t segment_elts)
+{
+    size_t num_ranks = transport.NumRanks();
+    size_t rank = transport.Rank();
+    if(num_ranks == 1)
+        return;
+    if(segment_elts == 0)
+        throw std::domain_error("Segments must not be empty");
+
+    // At step i, every rank sends chunk (rank - i) and receives chunk (rank - i - 1), which
+    // it sends on at step i + 1. During the first num_ranks - 1 steps received chunks are
+    // added to the local one, so afterwards every rank holds one fully reduced chunk. The
+    // remaining steps pass the reduced chunks around the ring.
+    size_t num_steps = 2 * (num_ranks - 1);
+    auto chunk_begin = [&](size_t chunk) { return chunk * size_elts / num_ranks; };
+    auto chunk_end = [&](size_t chunk) { return (chunk + 1) * size_elts / num_ranks; };
+    auto send_chunk = [&](size_t step) { return (rank + num_steps + num_ranks - step) % num_ranks; };
+    auto receive_chunk = [&](size_t step) { return (rank + num_steps + num_ranks - step - 1) % num_ranks; };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<size_t> segments_received(num_steps, 0);
+    size_t steps_sent = 0;
+    bool failed = false;
+
+    // The sender forwards every segment as soon as the previous step has reduced it
+    std::exception_ptr send_error;
+    std::thread sender([&]()
+    {
+        try
+        {
+            for(size_t step = 0; step < num_steps; step++)
+            {
+                size_t chunk = send_chunk(step);
+                size_t isegment = 0;
+                for(size_t begin = chunk_begin(chunk); begin < chunk_end(chunk); begin += segment_elts, isegment++)
+                {
+                    if(step > 0)
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [&] { return failed || segments_received[step - 1] > isegment; });
+                        if(failed)
+                            return;
+                    }
+                    size_t end = std::min(chunk_end(chunk), begin + segment_elts);
+                    transport.SendToNext(data + begin, (end - begin) * sizeof(float));
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                steps_sent++;
+                cv.notify_all();
+            }
+        }
+        catch(...)
+        {
+            send_error = std::current_exception();
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+            cv.notify_all();
+        }
+    });
+
+    try
+    {
+        std::vector<float> staging(segment_elts);
+        for(size_t step = 0; step < num_steps; step++)
+        {
+            bool reduce = step < num_ranks - 1;
+            if(!reduce)
+            {
+                // The chunk received now was sent num_ranks - 1 steps ago and must not be
+                // overwritten while the sender may still be reading it
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return failed || steps_sent > step + 1 - num_ranks; });
+                if(failed)
+                    break;
+            }
+
+            size_t chunk = receive_chunk(step);
+            for(size_t begin = chunk_begin(chunk); begin < chunk_end(chunk); begin += segment_elts)
+            {
+                size_t end = std::min(chunk_end(chunk), begin + segment_elts);
+                if(reduce)
+                {
+                    transport.ReceiveFromPrevious(staging.data(), (end - begin) * sizeof(float));
+                    for(size_t i = begin; i < end; i++)
+                        data[i] += staging[i - begin];
+                }
+                else
+                {
+                    transport.ReceiveFromPrevious(data + begin, (end - begin) * sizeof(float));
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                segments_received[step]++;
+                cv.notify_all();
+            }
+        }
+    }
+    catch(...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+            cv.notify_all();
+        }
+        sender.join();
+        throw;
+    }
+    sender.join();
+    if(send_error)
+        std::rethrow_exception(send_error);
+}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace gigagrad
+{
+
+// Connects the processes taking part in an all-reduce in a ring. Send and Receive may be called
+// concurrently from two different threads.
+struct Transport
+{
+    virtual ~Transport() = default;
+    virtual size_t Rank() = 0;
+    virtual size_t NumRanks() = 0;
+
+    // Sends to rank (Rank() + 1) % NumRanks()
+    virtual void SendToNext(const void *data, size_t size_bytes) = 0;
+
+    // Receives from rank (Rank() + NumRanks() - 1) % NumRanks()
+    virtual void ReceiveFromPrevious(void *data, size_t size_bytes) = 0;
+};
+
+// Transport between processes on one host. Rank r listens on the socket path_prefix.r, so all
+// ranks must be given the same prefix. The constructor blocks until both neighbors are connected.
+struct UnixSocketTransport : public Transport
+{
+    UnixSocketTransport(std::string path_prefix, size_t rank, size_t num_ranks);
+    virtual ~UnixSocketTransport();
+    virtual size_t Rank();
+    virtual size_t NumRanks();
+    virtual void SendToNext(const void *data, size_t size_bytes);
+    virtual void ReceiveFromPrevious(void *data, size_t size_bytes);
+
+    std::string listen_path;
+    size_t rank;
+    size_t num_ranks;
+    int next_fd = -1;
+    int previous_fd = -1;
+};
+
+// Sums data over all ranks in place with a ring all-reduce. Every chunk is sent in segments of
+// segment_elts, so reducing one segment overlaps with receiving the next, and a segment is
+// forwarded as soon as it has been reduced.
+void RingAllReduce(Transport &transport, float *data, size_t size_elts, size_t segment_elts = 16384);
+
+}
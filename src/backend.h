@@ -1,12 +1,19 @@
 #pragma once
 #include <cstddef>
+#include <future>
+#include <memory>
+#include <vector>
 
 namespace gigagrad
 {
+
+struct GraphNodeHandle;
+
 namespace codegen
 {
 
 struct Program;
+struct SteppedInput;
 
 struct Backend
 {
@@ -15,6 +22,38 @@ struct Backend
     virtual void *InitBuffers() = 0; // Returns output buffer
     virtual void *GetBuffer(size_t idx) = 0;
     virtual void Execute() = 0;
+
+    // Captures the currently bound input pointers and runs the program on a worker thread.
+    // Submissions execute in order, so inputs may be rebound for the next step immediately.
+    // Outputs and intermediates are shared with the steps queued after this one, so they are
+    // only valid after WaitForAsync(). A single value, like the loss, can be kept per step:
+    // *record is copied to *recorded right after the step, before the future is ready.
+    virtual std::future<void> ExecuteAsync(const float *record = nullptr, float *recorded = nullptr) = 0;
+
+    // Returns once every execution submitted with ExecuteAsync() has finished
+    virtual void WaitForAsync() = 0;
+
+    // Runs the program num_steps times in a single call, starting each SteppedInput at its
+    // base and advancing it after every step. *record is copied to records[i] after step i.
+    virtual void ExecuteSteps(
+        size_t num_steps,
+        const std::vector<SteppedInput> &inputs,
+        const float *record,
+        float *records) = 0;
+
+    // Runs only the functions of the given entry point of the program
+    virtual void ExecuteEntryPoint(size_t entry_point) = 0;
+
+    // Returns a backend that runs the same lowered program with its own intermediate buffers.
+    // Replicas may execute concurrently with each other.
+    virtual std::unique_ptr<Backend> CreateReplica() = 0;
+
+    // Reads tensor from data in this backend only, instead of from tensor.data()
+    virtual void BindInput(GraphNodeHandle tensor, void *data) = 0;
+
+    // Sets the size of the batch dimension for the following executions, between 1 and the
+    // maximum size of the graph's BatchDim. Waits for queued async executions first.
+    virtual void SetBatchSize(size_t batch_size) = 0;
 };
 
 }
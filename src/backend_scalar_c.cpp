@@ -1,11 +1,19 @@
 #include "backend_scalar_c.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
 #include <system_error>
 #include <cstdio>
 #include <cerrno>
 #include <cstdlib>
+#include <string>
+#include <thread>
 
 #include <dlfcn.h>
+#include <unistd.h>
 
 using namespace gigagrad;
 using namespace gigagrad::codegen;
@@ -15,23 +23,110 @@ struct LowerCtx
     const char *prefix;
     FILE *file;
     int indentation;
+    const Program &program;
+    const FunctionBuilder *fn = nullptr; // Function being lowered
+    const char *linkage = "static"; // Of kernels, which are shared between files when the program is split
 };
 
+static const char *CType(DataType dtype)
+{
+    switch(dtype)
+    {
+    case DataType::F32:
+        return "float";
+    case DataType::F16:
+        return "_Float16";
+    case DataType::BF16:
+        return "uint16_t";
+    case DataType::I8:
+        return "int8_t";
+    case DataType::U8:
+        return "uint8_t";
+    case DataType::I16:
+        return "int16_t";
+    case DataType::I32:
+        return "int32_t";
+    case DataType::I64:
+        return "int64_t";
+    default:
+        throw std::domain_error("Invalid data type");
+    }
+}
+
+static bool IsInteger(DataType dtype)
+{
+    return dtype == DataType::I8
+        || dtype == DataType::U8
+        || dtype == DataType::I16
+        || dtype == DataType::I32
+        || dtype == DataType::I64;
+}
+
+// Converts a float value to the value stored for it as dtype
+static std::string ToStored(DataType dtype, const std::string &value)
+{
+    switch(dtype)
+    {
+    case DataType::F32:
+        return value;
+    case DataType::F16:
+        return "(_Float16)" + value;
+    case DataType::BF16:
+        return "gigagrad_to_bf16(" + value + ")";
+    case DataType::I8:
+        return "gigagrad_to_i8(" + value + ")";
+    case DataType::U8:
+        return "gigagrad_to_u8(" + value + ")";
+    case DataType::I16:
+        return "gigagrad_to_i16(" + value + ")";
+    case DataType::I32:
+        return "gigagrad_to_i32(" + value + ")";
+    case DataType::I64:
+        return "gigagrad_to_i64(" + value + ")";
+    default:
+        throw std::domain_error("Invalid data type");
+    }
+}
+
+// Converts a value stored as dtype to float
+static std::string FromStored(DataType dtype, const std::string &value)
+{
+    if(dtype == DataType::F32)
+        return value;
+    if(dtype == DataType::BF16)
+        return "gigagrad_from_bf16(" + value + ")";
+    return "(float)" + value;
+}
+
+static DataType InputType(const LowerCtx &ctx, size_t input)
+{
+    return ctx.program.buffers[ctx.fn->inputs[input]].dtype;
+}
+
+static DataType OutputType(const LowerCtx &ctx, size_t output)
+{
+    size_t buffer = output == 0 ? ctx.fn->output_buffer : ctx.fn->aux_output_buffers[output - 1];
+    return ctx.program.buffers[buffer].dtype;
+}
+
 static void Lower_ScalarC(LowerCtx &ctx, const LoadIntImmediateInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*sint64_t v%zu = %" PRIi64 ";\n", ctx.indentation, " ", iinsn, i.value);
+    std::fprintf(ctx.file, "%*s%s v%zu = %" PRIi64 ";\n", ctx.indentation, " ", CType(i.dtype), iinsn, i.value);
 }
 
 static void Lower_ScalarC(LowerCtx &ctx, const IntArithmeticInsn &i, size_t iinsn)
 {
     std::fprintf(ctx.file,
-                 "%*sint64_t v%zu = v%zu %c v%zu;\n", ctx.indentation, " ", iinsn, i.x, (char)i.op, i.y);
+                 "%*s%s v%zu = v%zu %c v%zu;\n", ctx.indentation, " ", CType(i.dtype), iinsn, i.x, (char)i.op, i.y);
 }
 
 static void Lower_ScalarC(LowerCtx &ctx, const BeginLoopInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*sfor(int64_t v%zu = 0; v%zu < %zd; v%zu++)\n%*s{\n",
-                 ctx.indentation, " ", iinsn, iinsn, i.range, iinsn, ctx.indentation, " ");
+    std::string range = i.dynamic_range ? "v" + std::to_string(*i.dynamic_range)
+        : i.batched ? "batch"
+        : std::to_string(i.range);
+    std::fprintf(ctx.file, "%*sfor(int64_t v%zu = 0; v%zu < %s; v%zu++)\n%*s{\n",
+                 ctx.indentation, " ", iinsn, iinsn, range.c_str(), iinsn, ctx.indentation, " ");
     ctx.indentation += 4;
 }
 
@@ -43,13 +138,34 @@ static void Lower_ScalarC(LowerCtx &ctx, const EndLoopInsn &i, size_t iinsn)
 
 static void Lower_ScalarC(LowerCtx &ctx, const LoadInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*sfloat v%zu = i%zu[v%zu];\n",
-                 ctx.indentation, " ", iinsn, i.input, i.idx);
+    std::string value = "i" + std::to_string(i.input) + "[v" + std::to_string(i.idx) + "]";
+    std::fprintf(ctx.file, "%*sfloat v%zu = %s;\n",
+                 ctx.indentation, " ", iinsn, FromStored(InputType(ctx, i.input), value).c_str());
+}
+
+static void Lower_ScalarC(LowerCtx &ctx, const LoadIntInsn &i, size_t iinsn)
+{
+    if(!IsInteger(InputType(ctx, i.input)))
+        throw std::domain_error("Offsets and indices must be stored as integers");
+    std::fprintf(ctx.file, "%*s%s v%zu = i%zu[v%zu];\n",
+                 ctx.indentation, " ", CType(i.dtype), iinsn, i.input, i.idx);
+}
+
+static void Lower_ScalarC(LowerCtx &ctx, const DotInt8Insn &i, size_t iinsn)
+{
+    if(InputType(ctx, i.x_input) != DataType::I8 || InputType(ctx, i.y_input) != DataType::I8)
+        throw std::domain_error("Dot products must read int8 inputs");
+    std::fprintf(ctx.file, "%*sint32_t v%zu = gigagrad_dot_i8(i%zu + v%zu, i%zu + v%zu, %zd);\n",
+                 ctx.indentation, " ", iinsn, i.x_input, i.x_idx, i.y_input, i.y_idx, i.length);
 }
 
 static void Lower_ScalarC(LowerCtx &ctx, const StoreInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*soutput[v%zu] = v%zu;\n", ctx.indentation, " ", i.offset, i.value);
+    std::string value = ToStored(OutputType(ctx, i.output), "v" + std::to_string(i.value));
+    if(i.output == 0)
+        std::fprintf(ctx.file, "%*soutput[v%zu] = %s;\n", ctx.indentation, " ", i.offset, value.c_str());
+    else
+        std::fprintf(ctx.file, "%*soutput%zu[v%zu] = %s;\n", ctx.indentation, " ", i.output, i.offset, value.c_str());
 }
 
 static void Lower_ScalarC(LowerCtx &ctx, const LoadImmediateInsn &i, size_t iinsn)
@@ -59,6 +175,12 @@ static void Lower_ScalarC(LowerCtx &ctx, const LoadImmediateInsn &i, size_t iins
 
 static void Lower_ScalarC(LowerCtx &ctx, const UnaryInsn &i, size_t iinsn)
 {
+    if(i.type == UnaryOpType::CAST)
+    {
+        std::string rounded = FromStored(i.dtype, ToStored(i.dtype, "v" + std::to_string(i.x)));
+        std::fprintf(ctx.file, "%*sfloat v%zu = %s;\n", ctx.indentation, " ", iinsn, rounded.c_str());
+        return;
+    }
     auto op_str = i.type == UnaryOpType::EXP ? "exp"
         : i.type == UnaryOpType::LOG ? "log"
         : i.type == UnaryOpType::SIN ? "sin"
@@ -97,6 +219,11 @@ static void Lower_ScalarC(LowerCtx &ctx, const BinaryInsn &i, size_t iinsn)
     }
 }
 
+static void Lower_ScalarC(LowerCtx &ctx, const IntToFloatInsn &i, size_t iinsn)
+{
+    std::fprintf(ctx.file, "%*sfloat v%zu = (float)v%zu;\n", ctx.indentation, " ", iinsn, i.x);
+}
+
 static void Lower_ScalarC(LowerCtx &ctx, const AccumulateInsn &i, size_t iinsn)
 {
     if(i.type == ReduceOpType::MAX)
@@ -107,12 +234,22 @@ static void Lower_ScalarC(LowerCtx &ctx, const AccumulateInsn &i, size_t iinsn)
         std::fprintf(ctx.file, "%*sv%zu += v%zu;\n", ctx.indentation, " ", i.accumulator, i.x);
 }
 
-static void Lower_ScalarC(LowerCtx &ctx, const FunctionBuilder &fn, size_t ifn)
+static void GenerateSignature(LowerCtx &ctx, const FunctionBuilder &fn, size_t ifn)
 {
-    std::fprintf(ctx.file, "static void %s_%zu(\n", ctx.prefix, ifn);
+    ctx.fn = &fn;
+    std::fprintf(ctx.file, "%s void %s_%zu(\n", ctx.linkage, ctx.prefix, ifn);
     for(size_t i = 0; i < fn.inputs.size(); i++)
-        std::fprintf(ctx.file, "    const float *i%zu,\n", i);
-    std::fprintf(ctx.file, "    float *output)\n{\n");
+        std::fprintf(ctx.file, "    const %s *i%zu,\n", CType(InputType(ctx, i)), i);
+    std::fprintf(ctx.file, "    %s *output", CType(OutputType(ctx, 0)));
+    for(size_t i = 0; i < fn.aux_output_buffers.size(); i++)
+        std::fprintf(ctx.file, ",\n    %s *output%zu", CType(OutputType(ctx, i + 1)), i + 1);
+    std::fprintf(ctx.file, ",\n    int64_t batch)");
+}
+
+static void Lower_ScalarC(LowerCtx &ctx, const FunctionBuilder &fn, size_t ifn)
+{
+    GenerateSignature(ctx, fn, ifn);
+    std::fprintf(ctx.file, "\n{\n");
     ctx.indentation = 4;
     for(size_t i = 0; i < fn.insns.size(); i++)
     {
@@ -121,80 +258,463 @@ static void Lower_ScalarC(LowerCtx &ctx, const FunctionBuilder &fn, size_t ifn)
     std::fprintf(ctx.file, "}\n\n");
 }
 
-static void GenerateMain(const Program &program, LowerCtx &ctx)
+static void GenerateCalls(const Program &program, LowerCtx &ctx, size_t first_function, size_t end_function)
 {
-    std::fprintf(ctx.file, "void gigagrad_main(void **buffers)\n{\n");
-    std::fprintf(ctx.file, "#if __linux__\n");
-    std::fprintf(ctx.file, "    feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);\n");
-    std::fprintf(ctx.file, "#endif\n");
-    for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
+    for(size_t ifn = first_function; ifn < end_function; ifn++)
     {
         const FunctionBuilder &fn = program.functions[ifn];
         std::fprintf(ctx.file, "    %s_%zu(\n", ctx.prefix, ifn);
         for(size_t iinput = 0; iinput < fn.inputs.size(); iinput++)
-            std::fprintf(ctx.file, "        buffers[%zu],\n", fn.inputs[iinput]);
-        std::fprintf(ctx.file, "        buffers[%zu]);\n\n", fn.output_buffer);
+        {
+            size_t buffer = fn.inputs[iinput];
+            if(program.buffers[buffer].constant)
+                std::fprintf(ctx.file, "        constant%zu,\n", buffer);
+            else
+                std::fprintf(ctx.file, "        buffers[%zu],\n", buffer);
+        }
+        std::fprintf(ctx.file, "        buffers[%zu]", fn.output_buffer);
+        for(size_t aux : fn.aux_output_buffers)
+            std::fprintf(ctx.file, ",\n        buffers[%zu]", aux);
+        std::fprintf(ctx.file, ",\n        batch);\n\n");
     }
+}
+
+// Emits the values of constant buffers as static arrays, which the C compiler can see through
+static void GenerateConstants(const Program &program, LowerCtx &ctx)
+{
+    for(size_t ibuff = 0; ibuff < program.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = program.buffers[ibuff];
+        if(!desc.constant)
+            continue;
+        GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+        const float *data = tensor.data();
+        size_t num_elts = std::accumulate(tensor.shape().begin(), tensor.shape().end(), dim_t{1}, std::multiplies{});
+        std::fprintf(ctx.file, "static const %s constant%zu[%zu] =\n{", CType(desc.dtype), ibuff, desc.size_elts);
+        for(size_t i = 0; i < num_elts; i++)
+        {
+            if(i % 8 == 0)
+                std::fprintf(ctx.file, "\n   ");
+            if(desc.dtype == DataType::I8)
+                std::fprintf(ctx.file, " %d,", reinterpret_cast<const int8_t *>(data)[i]);
+            else if(std::isnan(data[i]))
+                std::fprintf(ctx.file, " NAN,");
+            else if(std::isinf(data[i]))
+                std::fprintf(ctx.file, " %sINFINITY,", data[i] < 0 ? "-" : "");
+            else
+                std::fprintf(ctx.file, " %af,", static_cast<double>(data[i]));
+        }
+        std::fprintf(ctx.file, "\n};\n\n");
+    }
+}
+
+static void GenerateRun(const Program &program, LowerCtx &ctx)
+{
+    std::fprintf(ctx.file, "static void gigagrad_run(void **buffers, int64_t batch)\n{\n");
+    GenerateCalls(program, ctx, 0, program.functions.size());
+    std::fprintf(ctx.file, "}\n\n");
+}
+
+// Emits the functions that the backend looks up after loading the program
+static void GenerateMain(const Program &program, LowerCtx &ctx)
+{
+    for(size_t ientry = 0; ientry < program.entry_points.size(); ientry++)
+    {
+        const EntryPoint &entry = program.entry_points[ientry];
+        std::fprintf(ctx.file, "void gigagrad_entry%zu(void **buffers, int64_t batch)\n{\n", ientry);
+        std::fprintf(ctx.file, "#if __linux__\n");
+        std::fprintf(ctx.file, "    feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);\n");
+        std::fprintf(ctx.file, "#endif\n");
+        GenerateCalls(program, ctx, entry.first_function, entry.end_function);
+        std::fprintf(ctx.file, "}\n\n");
+    }
+
+    std::fprintf(ctx.file, "void gigagrad_main(void **buffers, int64_t batch)\n{\n");
+    std::fprintf(ctx.file, "#if __linux__\n");
+    std::fprintf(ctx.file, "    feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);\n");
+    std::fprintf(ctx.file, "#endif\n");
+    std::fprintf(ctx.file, "    gigagrad_run(buffers, batch);\n");
+    std::fprintf(ctx.file, "}\n\n");
+
+    // Runs the program num_steps times, advancing the stepped buffers after every step and
+    // recording *record after each one.
+    std::fprintf(ctx.file,
+                 "void gigagrad_steps(\n"
+                 "    void **buffers,\n"
+                 "    int64_t batch,\n"
+                 "    int64_t num_steps,\n"
+                 "    int64_t num_stepped,\n"
+                 "    const int64_t *stepped_buffers,\n"
+                 "    const int64_t *strides,\n"
+                 "    const float *record,\n"
+                 "    float *records)\n{\n");
+    std::fprintf(ctx.file, "#if __linux__\n");
+    std::fprintf(ctx.file, "    feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);\n");
+    std::fprintf(ctx.file, "#endif\n");
+    std::fprintf(ctx.file, "    for(int64_t istep = 0; istep < num_steps; istep++)\n    {\n");
+    std::fprintf(ctx.file, "        gigagrad_run(buffers, batch);\n");
+    std::fprintf(ctx.file, "        records[istep] = *record;\n");
+    std::fprintf(ctx.file, "        for(int64_t i = 0; i < num_stepped; i++)\n");
+    std::fprintf(ctx.file, "            buffers[stepped_buffers[i]] = (char *)buffers[stepped_buffers[i]] + strides[i];\n");
+    std::fprintf(ctx.file, "    }\n");
     std::fprintf(ctx.file, "}\n");
+
+    // Instrumented builds write their profile on request rather than at exit
+    std::fprintf(ctx.file,
+                 "\n#ifdef GIGAGRAD_PROFILE\n"
+                 "extern void __gcov_dump(void);\n"
+                 "void gigagrad_dump_profile(void)\n"
+                 "{\n"
+                 "    __gcov_dump();\n"
+                 "}\n"
+                 "#endif\n");
 }
 
 using GraphEvalFn = BackendScalarC::GraphEvalFn;
+using GraphStepsFn = BackendScalarC::GraphStepsFn;
 
-static std::pair<GraphEvalFn, void *> CompileAndLoad(const std::filesystem::path &source_path)
-{
-    std::filesystem::path obj_path = source_path;
-    obj_path.replace_extension(".so");
-    std::string command =
-        "cc " +
-        source_path.string() + 
-        " -o " +
-        obj_path.string() +
-        "  -Ofast -fPIC -shared -lm -march=native -mtune=native";
-    std::system(command.c_str());
-    // std::printf("Compiling with: %s\n", command.c_str());
-
-    void *handle = dlopen(obj_path.c_str(), RTLD_NOW | RTLD_LOCAL);
-    if(!handle)
-        throw std::runtime_error(dlerror());
+static void *LookupSymbol(void *handle, const char *name)
+{
     dlerror(); // Clear error conditions
-    auto main_fn = reinterpret_cast<GraphEvalFn>(dlsym(handle, "gigagrad_main"));
-    if(!main_fn)
+    void *symbol = dlsym(handle, name);
+    if(!symbol)
     {
         char *err = dlerror();
         if(!err)
-            throw std::runtime_error("Symbol gigagrad_main is NULL, which is unexpected");
+            throw std::runtime_error(std::string("Symbol ") + name + " is NULL, which is unexpected");
         else
             throw std::runtime_error(err);
     }
-    return { main_fn, handle };
+    return symbol;
 }
 
-static std::pair<GraphEvalFn, void *> Lower_ScalarC(const char *prefix, const Program &program)
+// The generated files are only needed until the library is loaded. Files that are already
+// gone are skipped.
+static void RemoveSources(const std::vector<std::filesystem::path> &source_paths)
 {
-    auto file_name = std::filesystem::temp_directory_path() / prefix;
-    file_name += ".c";
-    std::printf("FILE: %s\n", file_name.c_str());
-    FILE *file = std::fopen(file_name.c_str(), "w+");
-    if(!file)
-        throw std::system_error(errno, std::generic_category());
+    std::error_code error;
+    for(const std::filesystem::path &source_path : source_paths)
+        std::filesystem::remove(source_path, error);
+}
 
-    LowerCtx ctx = { prefix, file, 0 };
+// Profiles of a program are written to and read from a directory next to its source
+static std::filesystem::path ProfileDir(const std::filesystem::path &source_path)
+{
+    std::filesystem::path dir = source_path;
+    return dir.replace_extension(".profile");
+}
+
+// The library is loaded as <source>_<suffix>.so if a suffix is given, so that recompiling the
+// same source doesn't return the already loaded library from dlopen. The first source names
+// the library. If there are several, each is compiled by its own compiler process and the
+// objects are linked together.
+static void *CompileAndLoad(
+    const std::vector<std::filesystem::path> &source_paths,
+    const std::string &extra_flags = "",
+    const std::string &suffix = "",
+    BackendScalarC::CompileTimes *times = nullptr)
+{
+    using Clock = std::chrono::steady_clock;
+    std::string flags = " -Ofast -fPIC -march=native -mtune=native " + extra_flags;
+    auto start = Clock::now();
+
+    std::vector<std::filesystem::path> obj_paths;
+    if(source_paths.size() > 1)
+    {
+        std::vector<std::future<int>> compiles;
+        for(const std::filesystem::path &source_path : source_paths)
+        {
+            obj_paths.push_back(std::filesystem::path(source_path).replace_extension(".o"));
+            std::string command = "cc -c " + source_path.string() + " -o " + obj_paths.back().string() + flags;
+            compiles.push_back(std::async(std::launch::async, [command]() { return std::system(command.c_str()); }));
+        }
+        std::optional<std::filesystem::path> failed;
+        for(size_t i = 0; i < compiles.size(); i++)
+        {
+            if(compiles[i].get() != 0 && !failed)
+                failed = source_paths[i];
+        }
+        if(failed)
+        {
+            for(const std::filesystem::path &obj_path : obj_paths)
+                std::filesystem::remove(obj_path);
+            throw std::runtime_error("Failed to compile " + failed->string());
+        }
+    }
+    auto compiled = Clock::now();
+
+    std::filesystem::path lib_path = source_paths.front();
+    lib_path.replace_extension(".so");
+    std::string command = "cc";
+    for(const std::filesystem::path &path : obj_paths.empty() ? source_paths : obj_paths)
+        command += " " + path.string();
+    command += " -o " + lib_path.string() + " -shared -lm" + flags;
+    int status = std::system(command.c_str());
+    // std::printf("Compiling with: %s\n", command.c_str());
+    for(const std::filesystem::path &obj_path : obj_paths)
+        std::filesystem::remove(obj_path);
+    if(status != 0)
+        throw std::runtime_error("Failed to " + std::string(obj_paths.empty() ? "compile " : "link ") + source_paths.front().string());
+    auto linked = Clock::now();
+
+    if(!suffix.empty())
+    {
+        std::filesystem::path renamed = source_paths.front();
+        renamed.replace_extension();
+        renamed += "_" + suffix + ".so";
+        std::filesystem::rename(lib_path, renamed);
+        lib_path = renamed;
+    }
+    void *handle = dlopen(lib_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!handle)
+        throw std::runtime_error(dlerror());
+    std::filesystem::remove(lib_path); // Stays mapped, and every program has its own file
+    if(times)
+    {
+        // A single source is compiled and linked by one command
+        times->compile = std::chrono::duration<double>((obj_paths.empty() ? linked : compiled) - start).count();
+        times->link = obj_paths.empty() ? 0.0 : std::chrono::duration<double>(linked - compiled).count();
+        times->load = std::chrono::duration<double>(Clock::now() - linked).count();
+    }
+    return handle;
+}
 
+// Writes the includes and helpers that every generated file starts with
+static void GeneratePrelude(FILE *file)
+{
     std::fprintf(file, "#define _GNU_SOURCE\n#include <fenv.h>\n");
-    std::fprintf(file, "#include <stdint.h>\n#include <math.h>\n\n");
+    std::fprintf(file, "#include <stdint.h>\n#include <string.h>\n#include <math.h>\n");
+    std::fprintf(file, "#if defined(__AVX512VNNI__) || defined(__AVXVNNI__)\n#include <immintrin.h>\n#endif\n\n");
+
+    // BF16 is the upper half of an F32, rounded to nearest even when storing. I8 stores round
+    // to nearest and saturate.
+    std::fprintf(file,
+                 "static inline float gigagrad_from_bf16(uint16_t x)\n"
+                 "{\n"
+                 "    uint32_t bits = (uint32_t)x << 16;\n"
+                 "    float f;\n"
+                 "    memcpy(&f, &bits, sizeof(f));\n"
+                 "    return f;\n"
+                 "}\n\n"
+                 "static inline uint16_t gigagrad_to_bf16(float f)\n"
+                 "{\n"
+                 "    uint32_t bits;\n"
+                 "    memcpy(&bits, &f, sizeof(bits));\n"
+                 "    bits += 0x7fff + ((bits >> 16) & 1);\n"
+                 "    return (uint16_t)(bits >> 16);\n"
+                 "}\n\n"
+                 "static inline int8_t gigagrad_to_i8(float f)\n"
+                 "{\n"
+                 "    float r = nearbyintf(f);\n"
+                 "    return (int8_t)(r > 127.0f ? 127.0f : r < -127.0f ? -127.0f : r);\n"
+                 "}\n\n"
+                 "static inline uint8_t gigagrad_to_u8(float f)\n"
+                 "{\n"
+                 "    float r = nearbyintf(f);\n"
+                 "    return (uint8_t)(r > 255.0f ? 255.0f : r < 0.0f ? 0.0f : r);\n"
+                 "}\n\n"
+                 "static inline int16_t gigagrad_to_i16(float f)\n"
+                 "{\n"
+                 "    float r = nearbyintf(f);\n"
+                 "    return (int16_t)(r > 32767.0f ? 32767.0f : r < -32768.0f ? -32768.0f : r);\n"
+                 "}\n\n"
+                 "static inline int32_t gigagrad_to_i32(float f)\n"
+                 "{\n"
+                 "    double r = nearbyint((double)f);\n"
+                 "    return (int32_t)(r > 2147483647.0 ? 2147483647.0 : r < -2147483648.0 ? -2147483648.0 : r);\n"
+                 "}\n\n"
+                 "static inline int64_t gigagrad_to_i64(float f)\n"
+                 "{\n"
+                 "    float r = nearbyintf(f);\n"
+                 "    return (int64_t)(r >= 0x1p63f ? 0x1p63f - 0x1p39f : r < -0x1p63f ? -0x1p63f : r);\n"
+                 "}\n\n");
+
+    // VNNI multiplies unsigned by signed bytes, so x is offset by 128 to be unsigned and 128
+    // times the sum of y is taken off again. Lanes wrap around like int32 sums, so the result
+    // is exact whenever it fits in an int32.
+    std::fprintf(file,
+                 "static inline int32_t gigagrad_dot_i8(const int8_t *x, const int8_t *y, int64_t n)\n"
+                 "{\n"
+                 "    int32_t sum = 0;\n"
+                 "    int64_t i = 0;\n"
+                 "#if defined(__AVX512VNNI__) && defined(__AVX512BW__)\n"
+                 "    __m512i offset = _mm512_set1_epi8((char)0x80), ones = _mm512_set1_epi8(1);\n"
+                 "    __m512i products = _mm512_setzero_si512(), y_sums = _mm512_setzero_si512();\n"
+                 "    for(; i + 64 <= n; i += 64)\n"
+                 "    {\n"
+                 "        __m512i xi = _mm512_xor_si512(_mm512_loadu_si512(x + i), offset);\n"
+                 "        __m512i yi = _mm512_loadu_si512(y + i);\n"
+                 "        products = _mm512_dpbusd_epi32(products, xi, yi);\n"
+                 "        y_sums = _mm512_dpbusd_epi32(y_sums, ones, yi);\n"
+                 "    }\n"
+                 "    sum = _mm512_reduce_add_epi32(_mm512_sub_epi32(products, _mm512_slli_epi32(y_sums, 7)));\n"
+                 "#elif defined(__AVXVNNI__)\n"
+                 "    __m256i offset = _mm256_set1_epi8((char)0x80), ones = _mm256_set1_epi8(1);\n"
+                 "    __m256i products = _mm256_setzero_si256(), y_sums = _mm256_setzero_si256();\n"
+                 "    for(; i + 32 <= n; i += 32)\n"
+                 "    {\n"
+                 "        __m256i xi = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(x + i)), offset);\n"
+                 "        __m256i yi = _mm256_loadu_si256((const __m256i *)(y + i));\n"
+                 "        products = _mm256_dpbusd_avx_epi32(products, xi, yi);\n"
+                 "        y_sums = _mm256_dpbusd_avx_epi32(y_sums, ones, yi);\n"
+                 "    }\n"
+                 "    __m256i lanes = _mm256_sub_epi32(products, _mm256_slli_epi32(y_sums, 7));\n"
+                 "    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(lanes), _mm256_extracti128_si256(lanes, 1));\n"
+                 "    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));\n"
+                 "    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));\n"
+                 "    sum = _mm_cvtsi128_si32(half);\n"
+                 "#endif\n"
+                 "    for(; i < n; i++)\n"
+                 "        sum += (int32_t)x[i] * y[i];\n"
+                 "    return sum;\n"
+                 "}\n\n");
+}
+
+// Writes the helpers, constants and kernels of the program, and gigagrad_run() which calls
+// the kernels of the main entry point in order
+static void GenerateProgram(LowerCtx &ctx)
+{
+    const Program &program = ctx.program;
+    GeneratePrelude(ctx.file);
+    GenerateConstants(program, ctx);
 
     for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
         ::Lower_ScalarC(ctx, program.functions[ifn], ifn);
 
+    GenerateRun(program, ctx);
+}
+
+// Every file of kernels costs a compiler process and parsing the prelude, so programs are
+// only split into files of at least this many instructions
+static constexpr size_t MinInsnsPerFile = 2048;
+
+static FILE *OpenSource(const std::filesystem::path &path)
+{
+    FILE *file = std::fopen(path.c_str(), "w+");
+    if(!file)
+        throw std::system_error(errno, std::generic_category());
+    return file;
+}
+
+// Writes the program to new source files, at most max_files of them, and returns their paths.
+// The first file holds the constants, the kernels that read them so the C compiler can still
+// specialize those kernels for their values, and the entry points. The other kernels are split
+// into contiguous ranges with about the same number of instructions, one file each.
+static std::vector<std::filesystem::path> Lower_ScalarC(const char *prefix, const Program &program, size_t max_files)
+{
+    // dlopen returns the already loaded library for a path it has seen, so every program
+    // needs its own file to be loaded alongside others
+    static std::atomic<size_t> num_programs = 0;
+    auto base_name = std::filesystem::temp_directory_path() / prefix;
+    base_name += "_" + std::to_string(getpid()) + "_" + std::to_string(num_programs++);
+    std::vector<std::filesystem::path> paths = { base_name };
+    paths.front() += ".c";
+    std::printf("FILE: %s\n", paths.front().c_str());
+
+    std::vector<size_t> split_functions;
+    size_t split_insns = 0;
+    for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
+    {
+        const FunctionBuilder &fn = program.functions[ifn];
+        bool reads_constant = std::any_of(fn.inputs.begin(), fn.inputs.end(), [&](size_t buffer) { return program.buffers[buffer].constant; });
+        if(!reads_constant)
+        {
+            split_functions.push_back(ifn);
+            split_insns += fn.insns.size();
+        }
+    }
+    size_t num_kernel_files = std::min(max_files - 1, split_insns / MinInsnsPerFile);
+
+    FILE *file = OpenSource(paths.front());
+    LowerCtx ctx = { prefix, file, 0, program };
+    if(num_kernel_files == 0)
+    {
+        GenerateProgram(ctx);
+        GenerateMain(program, ctx);
+        std::fclose(file);
+        return paths;
+    }
+
+    // Kernels are called across files, but stay private to the library
+    ctx.linkage = "__attribute__((visibility(\"hidden\")))";
+    std::vector<bool> in_main_file(program.functions.size(), true);
+    for(size_t ifn : split_functions)
+        in_main_file[ifn] = false;
+    GeneratePrelude(file);
+    GenerateConstants(program, ctx);
+    for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
+    {
+        if(in_main_file[ifn])
+            continue;
+        GenerateSignature(ctx, program.functions[ifn], ifn);
+        std::fprintf(file, ";\n\n");
+    }
+    for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
+    {
+        if(in_main_file[ifn])
+            ::Lower_ScalarC(ctx, program.functions[ifn], ifn);
+    }
+    GenerateRun(program, ctx);
     GenerateMain(program, ctx);
     std::fclose(file);
-    return CompileAndLoad(file_name);
+
+    // A new file starts once the kernels written so far reach the next multiple of the share
+    // of one file
+    size_t insns = 0;
+    for(size_t i = 0; i < split_functions.size(); i++)
+    {
+        size_t num_files = paths.size() - 1;
+        if(i == 0 || (num_files < num_kernel_files && insns * num_kernel_files >= split_insns * num_files))
+        {
+            if(i != 0)
+                std::fclose(ctx.file);
+            paths.push_back(base_name);
+            paths.back() += "_part" + std::to_string(paths.size() - 1) + ".c";
+            ctx.file = OpenSource(paths.back());
+            GeneratePrelude(ctx.file);
+        }
+        const FunctionBuilder &fn = program.functions[split_functions[i]];
+        ::Lower_ScalarC(ctx, fn, split_functions[i]);
+        insns += fn.insns.size();
+    }
+    std::fclose(ctx.file);
+    return paths;
 }
 
 BackendScalarC::~BackendScalarC()
 {
-    dlclose(this->handle);
-    for(ssize_t ibuff = 0; ibuff < std::ssize(this->program.buffers); ibuff++)
+    if(this->async_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->async_mutex);
+            this->stop_async_worker = true;
+        }
+        this->async_cv.notify_all();
+        this->async_worker.join();
+    }
+    if(this->optimized_handle.valid())
+    {
+        try
+        {
+            dlclose(this->optimized_handle.get());
+        }
+        catch(...)
+        {
+        }
+    }
+    if(this->handle)
+        dlclose(this->handle);
+    // Sources and profiles stay around while profiling, in case the program is recompiled
+    if(!this->source_paths.empty())
+    {
+        std::error_code error;
+        RemoveSources(this->source_paths);
+        std::filesystem::remove_all(ProfileDir(this->source_paths.front()), error);
+    }
+    if(this->program.memory_plan)
+        return;
+    // Buffers are only allocated once the program has been compiled and loaded
+    for(ssize_t ibuff = 0; ibuff < std::ssize(this->buffers); ibuff++)
     {
         auto &desc = this->program.buffers[ibuff];
         if(!std::holds_alternative<GraphNodeHandle>(desc.id))
@@ -207,13 +727,93 @@ BackendScalarC::~BackendScalarC()
 void BackendScalarC::LowerProgram(Program &&program)
 {
     this->program = std::move(program);
-    auto [eval_fn, handle] = Lower_ScalarC("gg_scalar", this->program);
-    this->eval_fn = eval_fn;
+    size_t max_files = this->max_compile_units;
+    if(max_files == 0)
+        max_files = std::max(1u, std::thread::hardware_concurrency());
+    auto start = std::chrono::steady_clock::now();
+    this->source_paths = Lower_ScalarC("gg_scalar", this->program, max_files);
+    this->compile_times.generate = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    this->batch_size = this->program.MaxBatchSize();
+    if(this->profile_runs == 0)
+    {
+        this->LoadProgram(CompileAndLoad(this->source_paths, "", "", &this->compile_times));
+        RemoveSources(this->source_paths);
+        return;
+    }
+    // Atomic counters, since replicas may run the instrumented code concurrently
+    std::string flags = "-DGIGAGRAD_PROFILE -fprofile-generate -fprofile-update=atomic -fprofile-dir=" + ProfileDir(this->source_paths.front()).string();
+    this->LoadProgram(CompileAndLoad(this->source_paths, flags, "", &this->compile_times));
+}
+
+void BackendScalarC::LoadProgram(void *handle)
+{
     this->handle = handle;
+    this->eval_fn = reinterpret_cast<GraphEvalFn>(LookupSymbol(this->handle, "gigagrad_main"));
+    this->steps_fn = reinterpret_cast<GraphStepsFn>(LookupSymbol(this->handle, "gigagrad_steps"));
+    this->entry_fns.clear();
+    for(size_t ientry = 0; ientry < this->program.entry_points.size(); ientry++)
+    {
+        std::string name = "gigagrad_entry" + std::to_string(ientry);
+        this->entry_fns.push_back(reinterpret_cast<GraphEvalFn>(LookupSymbol(this->handle, name.c_str())));
+    }
+}
+
+void BackendScalarC::AdvanceProfile(size_t num_runs)
+{
+    if(this->optimized_handle.valid())
+    {
+        if(this->optimized_handle.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        this->profile_runs = 0;
+        void *optimized;
+        try
+        {
+            optimized = this->optimized_handle.get();
+        }
+        catch(const std::exception &)
+        {
+            // Failing to optimize only loses the speedup, so go on with the instrumented code
+            return;
+        }
+        void *instrumented = this->handle;
+        this->LoadProgram(optimized);
+        dlclose(instrumented);
+        return;
+    }
+    if(this->num_profiled_runs >= this->profile_runs)
+    {
+        // Write the counters of the runs so far and compile with them while execution goes on
+        // with the instrumented code
+        reinterpret_cast<void (*)()>(LookupSymbol(this->handle, "gigagrad_dump_profile"))();
+        std::vector<std::filesystem::path> sources = this->source_paths;
+        this->optimized_handle = std::async(std::launch::async, [sources]()
+        {
+            std::filesystem::path profile_dir = ProfileDir(sources.front());
+            std::string flags = "-fprofile-use -fprofile-partial-training -Wno-missing-profile -fprofile-dir=" + profile_dir.string();
+            void *handle;
+            try
+            {
+                handle = CompileAndLoad(sources, flags, "pgo");
+            }
+            catch(...)
+            {
+                RemoveSources(sources);
+                std::filesystem::remove_all(profile_dir);
+                throw;
+            }
+            RemoveSources(sources);
+            std::filesystem::remove_all(profile_dir);
+            return handle;
+        });
+        return;
+    }
+    this->num_profiled_runs += num_runs;
 }
 
 void *BackendScalarC::InitBuffers()
 {
+    if(this->program.memory_plan)
+        this->arena.reset(new float[(this->program.memory_plan->size_bytes + sizeof(float) - 1) / sizeof(float)]);
     this->buffers.reserve(this->program.buffers.size());
     for(ssize_t ibuff = 0; ibuff < std::ssize(this->program.buffers); ibuff++)
     {
@@ -223,9 +823,14 @@ void *BackendScalarC::InitBuffers()
             GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
             this->buffers.push_back(reinterpret_cast<void *>(tensor.data()));
         }
+        else if(this->program.memory_plan)
+        {
+            char *intermediate_buf = reinterpret_cast<char *>(this->arena.get()) + this->program.memory_plan->offsets_bytes[ibuff];
+            this->buffers.push_back(reinterpret_cast<void *>(intermediate_buf));
+        }
         else
         {
-            float *intermediate_buf = new float[desc.size_elts];
+            float *intermediate_buf = new float[(desc.SizeBytes() + sizeof(float) - 1) / sizeof(float)];
             this->buffers.push_back(reinterpret_cast<void *>(intermediate_buf));
         }
     }
@@ -237,16 +842,378 @@ void *BackendScalarC::GetBuffer(size_t idx)
     return this->buffers.at(idx);
 }
 
-void BackendScalarC::Execute()
+void BackendScalarC::BindInputs(std::vector<void *> &bound_buffers)
 {
+    bound_buffers.resize(this->buffers.size());
     for(ssize_t ibuff = 0; ibuff < std::ssize(this->program.buffers); ibuff++)
     {
         auto &desc = this->program.buffers[ibuff];
         if(std::holds_alternative<GraphNodeHandle>(desc.id))
         {
             GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
-            this->buffers[ibuff] = (reinterpret_cast<void *>(tensor.data()));
+            bound_buffers[ibuff] = (reinterpret_cast<void *>(tensor.data()));
+        }
+        else
+        {
+            bound_buffers[ibuff] = this->buffers[ibuff];
+        }
+    }
+    for(auto [ibuff, data] : this->bound_inputs)
+        bound_buffers[ibuff] = data;
+}
+
+void BackendScalarC::BindInput(GraphNodeHandle tensor, void *data)
+{
+    std::optional<size_t> buffer = this->program.FindBuffer(tensor);
+    if(!buffer)
+        throw std::domain_error("Bound input is not used by the program");
+    this->bound_inputs[*buffer] = data;
+}
+
+void BackendScalarC::WaitForAsync()
+{
+    std::unique_lock<std::mutex> lock(this->async_mutex);
+    this->async_cv.wait(lock, [&] { return this->num_in_flight == 0; });
+}
+
+void BackendScalarC::Execute()
+{
+    // Steps share intermediate buffers, so let any queued async steps finish first
+    this->WaitForAsync();
+    if(this->profile_runs != 0)
+        this->AdvanceProfile(1);
+    this->BindInputs(this->buffers);
+    eval_fn(this->buffers.data(), this->batch_size);
+}
+
+void BackendScalarC::ExecuteEntryPoint(size_t entry_point)
+{
+    this->WaitForAsync();
+    if(this->profile_runs != 0)
+        this->AdvanceProfile(1);
+    this->BindInputs(this->buffers);
+    this->entry_fns.at(entry_point)(this->buffers.data(), this->batch_size);
+}
+
+std::unique_ptr<Backend> BackendScalarC::CreateReplica()
+{
+    // Take another reference to the already loaded library rather than compiling it again
+    Dl_info info;
+    if(!dladdr(reinterpret_cast<void *>(this->eval_fn), &info))
+        throw std::runtime_error("Failed to find the loaded program");
+    auto replica = std::make_unique<BackendScalarC>();
+    replica->handle = dlopen(info.dli_fname, RTLD_NOW | RTLD_LOCAL | RTLD_NOLOAD);
+    if(!replica->handle)
+        throw std::runtime_error(dlerror());
+    replica->program = this->program;
+    replica->eval_fn = this->eval_fn;
+    replica->steps_fn = this->steps_fn;
+    replica->entry_fns = this->entry_fns;
+    replica->bound_inputs = this->bound_inputs;
+    replica->batch_size = this->batch_size;
+    replica->InitBuffers();
+    return replica;
+}
+
+void BackendScalarC::ExecuteSteps(
+    size_t num_steps,
+    const std::vector<SteppedInput> &inputs,
+    const float *record,
+    float *records)
+{
+    this->WaitForAsync();
+    if(this->profile_runs != 0)
+        this->AdvanceProfile(num_steps);
+    std::vector<void *> bound_buffers;
+    this->BindInputs(bound_buffers);
+
+    std::vector<int64_t> stepped_buffers;
+    std::vector<int64_t> strides;
+    for(const SteppedInput &input : inputs)
+    {
+        std::optional<size_t> buffer = this->program.FindBuffer(input.tensor);
+        if(!buffer)
+            throw std::domain_error("Stepped input is not used by the program");
+        bound_buffers[*buffer] = input.base;
+        stepped_buffers.push_back(static_cast<int64_t>(*buffer));
+        strides.push_back(static_cast<int64_t>(input.stride_elts * SizeOf(this->program.buffers[*buffer].dtype)));
+    }
+    this->steps_fn(
+        bound_buffers.data(),
+        this->batch_size,
+        static_cast<int64_t>(num_steps),
+        static_cast<int64_t>(inputs.size()),
+        stepped_buffers.data(),
+        strides.data(),
+        record,
+        records);
+}
+
+std::future<void> BackendScalarC::ExecuteAsync(const float *record, float *recorded)
+{
+    // The code may only be swapped while no step is running
+    if(this->profile_runs != 0)
+    {
+        this->WaitForAsync();
+        this->AdvanceProfile(1);
+    }
+    std::unique_lock<std::mutex> lock(this->async_mutex);
+    this->async_cv.wait(lock, [&] { return this->num_in_flight < this->async_slots.size(); });
+
+    size_t slot = this->next_async_slot;
+    this->next_async_slot = (slot + 1) % this->async_slots.size();
+    this->num_in_flight++;
+    this->BindInputs(this->async_slots[slot]);
+
+    this->async_queue.push_back({ slot, this->batch_size, record, recorded, std::promise<void>() });
+    std::future<void> result = this->async_queue.back().done.get_future();
+
+    if(!this->async_worker.joinable())
+    {
+        this->async_worker = std::thread([this]()
+        {
+            std::unique_lock<std::mutex> lock(this->async_mutex);
+            for(;;)
+            {
+                this->async_cv.wait(lock, [&] { return this->stop_async_worker || !this->async_queue.empty(); });
+                if(this->async_queue.empty())
+                    return;
+
+                AsyncStep step = std::move(this->async_queue.front());
+                this->async_queue.pop_front();
+                lock.unlock();
+                this->eval_fn(this->async_slots[step.slot].data(), step.batch_size);
+                if(step.recorded)
+                    *step.recorded = *step.record;
+                step.done.set_value();
+                lock.lock();
+                this->num_in_flight--;
+                this->async_cv.notify_all();
+            }
+        });
+    }
+    lock.unlock();
+    this->async_cv.notify_all();
+    return result;
+}
+
+void BackendScalarC::SetBatchSize(size_t batch_size)
+{
+    dim_t max_batch_size = this->program.MaxBatchSize();
+    if(max_batch_size == 0)
+        throw std::domain_error("The program has no batch dimension");
+    if(batch_size == 0 || batch_size > static_cast<size_t>(max_batch_size))
+        throw std::domain_error("Batch size must be between 1 and the maximum batch size");
+
+    // Queued async steps read the batch size parameter when they run, so they must finish
+    // with the batch size they were submitted with
+    this->WaitForAsync();
+    this->batch_size = static_cast<int64_t>(batch_size);
+
+    // Means over the batch dimension divide by the graph's batch size parameter
+    for(const BufferDescriptor &desc : this->program.buffers)
+    {
+        if(!std::holds_alternative<GraphNodeHandle>(desc.id))
+            continue;
+        GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+        if(tensor.graph->batch_size_node == tensor.node_idx)
+            *tensor.data() = static_cast<float>(batch_size);
+    }
+}
+
+static const char *DataTypeName(DataType dtype)
+{
+    switch(dtype)
+    {
+    case DataType::F32:
+        return "f32";
+    case DataType::F16:
+        return "f16";
+    case DataType::BF16:
+        return "bf16";
+    case DataType::I8:
+        return "i8";
+    case DataType::U8:
+        return "u8";
+    case DataType::I16:
+        return "i16";
+    case DataType::I32:
+        return "i32";
+    case DataType::I64:
+        return "i64";
+    default:
+        throw std::domain_error("Invalid data type");
+    }
+}
+
+static FILE *OpenForWriting(const std::filesystem::path &path)
+{
+    FILE *file = std::fopen(path.c_str(), "w");
+    if(!file)
+        throw std::system_error(errno, std::generic_category(), path.string());
+    return file;
+}
+
+static std::string ShapeString(const Shape &shape, const char *separator)
+{
+    std::string result;
+    for(size_t i = 0; i < shape.size(); i++)
+        result += (i == 0 ? "" : separator) + std::to_string(shape[i]);
+    return result;
+}
+
+void BackendScalarC::Export(const std::string &directory, const std::string &name) const
+{
+    bool valid_name = !name.empty() && !std::isdigit(static_cast<unsigned char>(name[0]))
+        && std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; });
+    if(!valid_name)
+        throw std::domain_error("Exported name must be a C identifier: " + name);
+
+    // Tensors that aren't constants are passed to run(), except for the batch size, which
+    // run() fills in from its batch argument. Intermediates live in one arena, laid out by
+    // the memory plan if there is one.
+    const Program &program = this->program;
+    size_t output_buffer = program.functions.back().output_buffer;
+    dim_t max_batch = program.MaxBatchSize();
+    std::vector<size_t> inputs;
+    std::optional<size_t> batch_size_buffer;
+    std::vector<size_t> offsets(program.buffers.size(), 0);
+    size_t arena_bytes = program.memory_plan ? program.memory_plan->size_bytes : 0;
+    for(size_t ibuff = 0; ibuff < program.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = program.buffers[ibuff];
+        if(std::holds_alternative<GraphNodeHandle>(desc.id))
+        {
+            GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+            if(tensor.graph->batch_size_node == tensor.node_idx)
+                batch_size_buffer = ibuff;
+            else if(!desc.constant)
+                inputs.push_back(ibuff);
+        }
+        else if(program.memory_plan)
+        {
+            offsets[ibuff] = program.memory_plan->offsets_bytes[ibuff];
         }
+        else if(ibuff != output_buffer)
+        {
+            offsets[ibuff] = arena_bytes;
+            arena_bytes += (desc.SizeBytes() + 63) / 64 * 64;
+        }
+    }
+    if(std::holds_alternative<GraphNodeHandle>(program.buffers[output_buffer].id))
+        throw std::domain_error("Cannot export a program whose output is one of its inputs");
+    auto input_shape = [&](size_t ibuff) { return std::get<GraphNodeHandle>(program.buffers[ibuff].id).shape(); };
+    Shape output_shape = program.functions.back().node.shape();
+    DataType output_dtype = program.buffers[output_buffer].dtype;
+    std::string upper_name = name;
+    std::transform(name.begin(), name.end(), upper_name.begin(), [](char c) { return std::toupper(static_cast<unsigned char>(c)); });
+
+    std::filesystem::path dir(directory);
+    std::filesystem::create_directories(dir);
+
+    // The header only depends on the types and shapes of the inputs and output
+    FILE *header = OpenForWriting(dir / (name + ".h"));
+    std::fprintf(header, "/* Generated by gigagrad */\n");
+    std::fprintf(header, "#ifndef %s_H\n#define %s_H\n\n#include <stdint.h>\n\n", upper_name.c_str(), upper_name.c_str());
+    std::fprintf(header, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+    std::fprintf(header, "typedef struct %s_model %s_model;\n\n", name.c_str(), name.c_str());
+    if(max_batch != 0)
+        std::fprintf(header, "#define %s_MAX_BATCH %zu\n\n", upper_name.c_str(), static_cast<size_t>(max_batch));
+    std::fprintf(header, "/* Allocates the intermediate buffers of one instance of the model. Returns NULL if out of memory. */\n");
+    std::fprintf(header, "%s_model *%s_init(void);\n\n", name.c_str(), name.c_str());
+    std::fprintf(header, "/*\n");
+    for(size_t i = 0; i < inputs.size(); i++)
+        std::fprintf(header, " * input%zu: [%s]\n", i, ShapeString(input_shape(inputs[i]), "][").c_str());
+    std::fprintf(header, " * output: [%s]\n", ShapeString(output_shape, "][").c_str());
+    if(max_batch != 0)
+        std::fprintf(header, " * batch: number of rows of the leading dimension to compute, 1 to %s_MAX_BATCH\n", upper_name.c_str());
+    std::fprintf(header, " * Instances may run concurrently with each other, but not with themselves.\n */\n");
+    std::fprintf(header, "void %s_run(\n    %s_model *model", name.c_str(), name.c_str());
+    for(size_t i = 0; i < inputs.size(); i++)
+        std::fprintf(header, ",\n    const %s *input%zu", CType(program.buffers[inputs[i]].dtype), i);
+    std::fprintf(header, ",\n    %s *output", CType(output_dtype));
+    if(max_batch != 0)
+        std::fprintf(header, ",\n    int64_t batch");
+    std::fprintf(header, ");\n\n");
+    std::fprintf(header, "void %s_free(%s_model *model);\n\n", name.c_str(), name.c_str());
+    std::fprintf(header, "#ifdef __cplusplus\n}\n#endif\n\n#endif\n");
+    std::fclose(header);
+
+    FILE *source = OpenForWriting(dir / (name + ".c"));
+    LowerCtx ctx = { name.c_str(), source, 0, program };
+    try
+    {
+        std::fprintf(source, "/* Generated by gigagrad */\n");
+        GenerateProgram(ctx);
+    }
+    catch(...)
+    {
+        std::fclose(source);
+        throw;
+    }
+    std::fprintf(source, "#include <stdlib.h>\n#include \"%s.h\"\n\n", name.c_str());
+    std::fprintf(source, "struct %s_model\n{\n", name.c_str());
+    std::fprintf(source, "    void *buffers[%zu];\n    char *arena;\n    float batch_size;\n};\n\n", program.buffers.size());
+    std::fprintf(source, "%s_model *%s_init(void)\n{\n", name.c_str(), name.c_str());
+    std::fprintf(source, "    %s_model *model = calloc(1, sizeof(*model));\n", name.c_str());
+    std::fprintf(source, "    if(!model)\n        return NULL;\n");
+    std::fprintf(source, "    model->arena = aligned_alloc(64, %zu);\n", std::max<size_t>(64, (arena_bytes + 63) / 64 * 64));
+    std::fprintf(source, "    if(!model->arena)\n    {\n        free(model);\n        return NULL;\n    }\n");
+    for(size_t ibuff = 0; ibuff < program.buffers.size(); ibuff++)
+    {
+        if(std::holds_alternative<size_t>(program.buffers[ibuff].id) && ibuff != output_buffer)
+            std::fprintf(source, "    model->buffers[%zu] = model->arena + %zu;\n", ibuff, offsets[ibuff]);
+    }
+    if(batch_size_buffer)
+        std::fprintf(source, "    model->buffers[%zu] = &model->batch_size;\n", *batch_size_buffer);
+    std::fprintf(source, "    return model;\n}\n\n");
+
+    std::fprintf(source, "void %s_run(\n    %s_model *model", name.c_str(), name.c_str());
+    for(size_t i = 0; i < inputs.size(); i++)
+        std::fprintf(source, ",\n    const %s *input%zu", CType(program.buffers[inputs[i]].dtype), i);
+    std::fprintf(source, ",\n    %s *output", CType(output_dtype));
+    if(max_batch != 0)
+        std::fprintf(source, ",\n    int64_t batch");
+    std::fprintf(source, ")\n{\n");
+    if(max_batch == 0)
+        std::fprintf(source, "    int64_t batch = 0;\n");
+    if(batch_size_buffer)
+        std::fprintf(source, "    model->batch_size = (float)batch;\n");
+    for(size_t i = 0; i < inputs.size(); i++)
+        std::fprintf(source, "    model->buffers[%zu] = (void *)input%zu;\n", inputs[i], i);
+    std::fprintf(source, "    model->buffers[%zu] = output;\n", output_buffer);
+    std::fprintf(source, "    gigagrad_run(model->buffers, batch);\n}\n\n");
+
+    std::fprintf(source, "void %s_free(%s_model *model)\n{\n", name.c_str(), name.c_str());
+    std::fprintf(source, "    if(!model)\n        return;\n    free(model->arena);\n    free(model);\n}\n");
+    std::fclose(source);
+
+    FILE *manifest = OpenForWriting(dir / (name + ".json"));
+    std::fprintf(manifest, "{\n    \"name\": \"%s\",\n", name.c_str());
+    std::fprintf(manifest, "    \"max_batch\": %zu,\n", static_cast<size_t>(max_batch));
+    std::fprintf(manifest, "    \"arena_bytes\": %zu,\n", arena_bytes);
+    std::fprintf(manifest, "    \"buffers\": [\n");
+    for(size_t ibuff = 0; ibuff < program.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = program.buffers[ibuff];
+        auto input = std::find(inputs.begin(), inputs.end(), ibuff);
+        std::string kind = ibuff == output_buffer ? "\"output\""
+            : ibuff == batch_size_buffer ? "\"batch_size\""
+            : desc.constant ? "\"constant\""
+            : input != inputs.end() ? "\"input\", \"argument\": \"input" + std::to_string(input - inputs.begin()) + "\""
+            : "\"intermediate\", \"offset\": " + std::to_string(offsets[ibuff]);
+        std::string shape = ibuff == output_buffer ? ShapeString(output_shape, ", ")
+            : std::holds_alternative<GraphNodeHandle>(desc.id) ? ShapeString(input_shape(ibuff), ", ")
+            : std::to_string(desc.size_elts);
+        std::fprintf(manifest,
+                     "        { \"index\": %zu, \"kind\": %s, \"dtype\": \"%s\", \"shape\": [%s], \"size_bytes\": %zu }%s\n",
+                     ibuff,
+                     kind.c_str(),
+                     DataTypeName(desc.dtype),
+                     shape.c_str(),
+                     desc.SizeBytes(),
+                     ibuff + 1 < program.buffers.size() ? "," : "");
     }
-    eval_fn(this->buffers.data());
+    std::fprintf(manifest, "    ]\n}\n");
+    std::fclose(manifest);
 }
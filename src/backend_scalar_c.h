@@ -2,6 +2,15 @@
 #include "backend.h"
 #include "codegen.h"
 
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
 namespace gigagrad
 {
 namespace codegen
@@ -9,17 +18,90 @@ namespace codegen
 
 struct BackendScalarC : public Backend
 {
-    using GraphEvalFn = void (*)(void **);
+    using GraphEvalFn = void (*)(void **, int64_t);
+    using GraphStepsFn = void (*)(void **, int64_t, int64_t, int64_t, const int64_t *, const int64_t *, const float *, float *);
     virtual ~BackendScalarC();
     virtual void LowerProgram(Program &&program);
     virtual void *InitBuffers();
     virtual void *GetBuffer(size_t idx);
     virtual void Execute();
+    virtual std::future<void> ExecuteAsync(const float *record = nullptr, float *recorded = nullptr);
+    virtual void WaitForAsync();
+    virtual void ExecuteSteps(
+        size_t num_steps,
+        const std::vector<SteppedInput> &inputs,
+        const float *record,
+        float *records);
+    virtual void ExecuteEntryPoint(size_t entry_point);
+    virtual std::unique_ptr<Backend> CreateReplica();
+    virtual void BindInput(GraphNodeHandle tensor, void *data);
+    virtual void SetBatchSize(size_t batch_size);
+
+    void BindInputs(std::vector<void *> &bound_buffers);
+    void LoadProgram(void *handle);
+    void AdvanceProfile(size_t num_runs);
 
-    void *handle;
+    // Writes the program to directory as a C library that builds without gigagrad: <name>.c,
+    // a header <name>.h declaring <name>_init(), <name>_run() and <name>_free(), and
+    // <name>.json describing every buffer. Every tensor that isn't embedded as a constant
+    // becomes an argument of <name>_run(), in the order of the program's buffers.
+    void Export(const std::string &directory, const std::string &name) const;
+
+    void *handle = nullptr;
     Program program;
     std::vector<void *> buffers;
+    std::unique_ptr<float[]> arena; // Backs the intermediate buffers if the program has a memory plan
     GraphEvalFn eval_fn;
+    GraphStepsFn steps_fn;
+    std::vector<GraphEvalFn> entry_fns;
+    std::unordered_map<size_t, void *> bound_inputs; // Buffer index -> data, see BindInput
+    int64_t batch_size = 0; // Passed to every kernel, see SetBatchSize
+
+    // Large programs are split into several C files that are compiled in parallel and linked
+    // into one library. At most this many files are generated, 0 for one per hardware thread,
+    // and 1 keeps the program in a single file.
+    size_t max_compile_units = 0;
+
+    // Wall time of each phase of the last LowerProgram, in seconds. A program in a single
+    // file is compiled and linked by one command, which counts as compiling.
+    struct CompileTimes
+    {
+        double generate = 0.0;
+        double compile = 0.0;
+        double link = 0.0;
+        double load = 0.0;
+    };
+    CompileTimes compile_times;
+
+    // Profile-guided optimization. If profile_runs is nonzero when the program is lowered, it
+    // is first compiled with profiling instrumentation. After that many runs, it's recompiled
+    // in the background with the collected profile, and the first run after that finishes
+    // switches to the optimized code and resets profile_runs to zero. If the recompile fails,
+    // the instrumented code stays. Until then, async runs don't overlap. Replicas keep the code
+    // they were created with.
+    size_t profile_runs = 0;
+    size_t num_profiled_runs = 0;
+    std::vector<std::filesystem::path> source_paths; // Removed once they are no longer needed
+    std::future<void *> optimized_handle;
+
+    // Async execution: each in-flight step owns one of two slots holding its bound buffer
+    // pointers, so at most one step waits while another runs on the worker.
+    struct AsyncStep
+    {
+        size_t slot;
+        int64_t batch_size;
+        const float *record;
+        float *recorded;
+        std::promise<void> done;
+    };
+    std::array<std::vector<void *>, 2> async_slots;
+    size_t next_async_slot = 0;
+    size_t num_in_flight = 0;
+    std::deque<AsyncStep> async_queue;
+    std::mutex async_mutex;
+    std::condition_variable async_cv;
+    std::thread async_worker;
+    bool stop_async_worker = false;
 };
 
 }
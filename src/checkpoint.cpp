@@ -0,0 +1,309 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace gigagrad
+{
+
+static constexpr char CheckpointMagic[8] = { 'G', 'G', 'C', 'K', 'P', 'T', 0, 1 };
+
+static size_t AlignUp(size_t x)
+{
+    return (x + CheckpointAlignment - 1) / CheckpointAlignment * CheckpointAlignment;
+}
+
+static size_t SizeBytes(DataType dtype, const Shape &shape)
+{
+    return std::accumulate(shape.begin(), shape.end(), dim_t{1}, std::multiplies{}) * SizeOf(dtype);
+}
+
+static GraphNodeHandle Weight(nn::Module &network, size_t iweight)
+{
+    return { &network.graph, network.graph.inputs[network.weights[iweight]] };
+}
+
+static void AppendU64(std::string &header, uint64_t x)
+{
+    header.append(reinterpret_cast<const char *>(&x), sizeof(x));
+}
+
+static void WriteAll(int fd, const void *data, size_t size_bytes)
+{
+    const char *bytes = static_cast<const char *>(data);
+    while(size_bytes > 0)
+    {
+        ssize_t written = write(fd, bytes, size_bytes);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written < 0)
+            throw std::system_error(errno, std::generic_category());
+        bytes += written;
+        size_bytes -= static_cast<size_t>(written);
+    }
+}
+
+// The header is the magic, the number of tensors and then for every tensor the length of its
+// name, the name, its type, its number of dimensions, every dimension and the offset of its
+// values. All numbers are uint64. Returns the header and sets offsets to the offset of every
+// tensor and then the end of the file.
+static std::string CheckpointHeader(const std::vector<CheckpointTensor> &tensors, std::vector<size_t> &offsets)
+{
+    size_t header_bytes = sizeof(CheckpointMagic) + 8;
+    for(const CheckpointTensor &tensor : tensors)
+        header_bytes += 8 + tensor.name.size() + 8 + 8 + 8 * tensor.shape.size() + 8;
+
+    std::string header(CheckpointMagic, sizeof(CheckpointMagic));
+    AppendU64(header, tensors.size());
+    offsets.clear();
+    size_t offset = AlignUp(header_bytes);
+    for(const CheckpointTensor &tensor : tensors)
+    {
+        if(!tensor.data)
+            throw std::domain_error("Tensor " + tensor.name + " has no data to save");
+        AppendU64(header, tensor.name.size());
+        header += tensor.name;
+        AppendU64(header, static_cast<uint64_t>(tensor.dtype));
+        AppendU64(header, tensor.shape.size());
+        for(dim_t dim : tensor.shape)
+            AppendU64(header, static_cast<uint64_t>(dim));
+        AppendU64(header, offset);
+        offsets.push_back(offset);
+        offset = AlignUp(offset + SizeBytes(tensor.dtype, tensor.shape));
+    }
+    offsets.push_back(std::max(header.size(), offset));
+    return header;
+}
+
+struct FilePiece
+{
+    size_t offset;
+    const void *data;
+    size_t size_bytes;
+};
+
+// Makes the entries of the directory holding path durable, e.g. after renaming a file into it
+static void SyncDirectory(const std::string &path)
+{
+    std::string directory = std::filesystem::path(path).parent_path().string();
+    if(directory.empty())
+        directory = ".";
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+        throw std::system_error(errno, std::generic_category(), directory);
+    int result = fsync(fd);
+    int error = errno;
+    close(fd);
+    if(result != 0)
+        throw std::system_error(error, std::generic_category(), directory);
+}
+
+// Writes the pieces, in increasing order of offset, to a temporary file with zeros in between
+// and renames it to path. The file is on disk before the rename, so after a crash path holds
+// either the old or the new checkpoint in full.
+static void WriteAtomically(const std::string &path, const std::vector<FilePiece> &pieces)
+{
+    std::string temporary_path = path + ".tmp";
+    int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        throw std::system_error(errno, std::generic_category(), temporary_path);
+    try
+    {
+        static constexpr char padding[CheckpointAlignment] = {};
+        size_t written = 0;
+        for(const FilePiece &piece : pieces)
+        {
+            for(size_t gap; (gap = std::min(piece.offset - written, sizeof(padding))) > 0; written += gap)
+                WriteAll(fd, padding, gap);
+            WriteAll(fd, piece.data, piece.size_bytes);
+            written += piece.size_bytes;
+        }
+        if(fsync(fd) != 0)
+            throw std::system_error(errno, std::generic_category(), temporary_path);
+        if(close(fd) != 0)
+        {
+            fd = -1;
+            throw std::system_error(errno, std::generic_category(), temporary_path);
+        }
+        fd = -1;
+        if(rename(temporary_path.c_str(), path.c_str()) != 0)
+            throw std::system_error(errno, std::generic_category(), path);
+    }
+    catch(...)
+    {
+        if(fd >= 0)
+            close(fd);
+        unlink(temporary_path.c_str());
+        throw;
+    }
+    SyncDirectory(path);
+}
+
+void SaveCheckpoint(const std::vector<CheckpointTensor> &tensors, const std::string &path)
+{
+    std::vector<size_t> offsets;
+    std::string header = CheckpointHeader(tensors, offsets);
+    std::vector<FilePiece> pieces = { { 0, header.data(), header.size() } };
+    for(size_t i = 0; i < tensors.size(); i++)
+        pieces.push_back({ offsets[i], tensors[i].data, SizeBytes(tensors[i].dtype, tensors[i].shape) });
+    WriteAtomically(path, pieces);
+}
+
+void SaveCheckpoint(nn::Module &network, const std::string &path)
+{
+    std::vector<CheckpointTensor> tensors;
+    for(size_t i = 0; i < network.weights.size(); i++)
+    {
+        GraphNodeHandle weight = Weight(network, i);
+        tensors.push_back({ network.weight_names[i], weight->dtype, weight.shape(), weight.data() });
+    }
+    SaveCheckpoint(tensors, path);
+}
+
+void StageCheckpoint(const std::vector<CheckpointTensor> &tensors, std::vector<uint8_t> &image)
+{
+    std::vector<size_t> offsets;
+    std::string header = CheckpointHeader(tensors, offsets);
+    image.resize(offsets.back());
+    std::memcpy(image.data(), header.data(), header.size());
+    size_t end = header.size();
+    for(size_t i = 0; i < tensors.size(); i++)
+    {
+        size_t size_bytes = SizeBytes(tensors[i].dtype, tensors[i].shape);
+        std::memset(image.data() + end, 0, offsets[i] - end);
+        std::memcpy(image.data() + offsets[i], tensors[i].data, size_bytes);
+        end = offsets[i] + size_bytes;
+    }
+    std::memset(image.data() + end, 0, image.size() - end);
+}
+
+void WriteCheckpointImage(const std::vector<uint8_t> &image, const std::string &path)
+{
+    WriteAtomically(path, { { 0, image.data(), image.size() } });
+}
+
+Checkpoint::Checkpoint(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    this->mapping_bytes = static_cast<size_t>(st.st_size);
+    if(this->mapping_bytes < sizeof(CheckpointMagic) + 8)
+    {
+        close(fd);
+        throw std::runtime_error("Invalid checkpoint " + path);
+    }
+    // Private and writable, so weights can be trained in place without changing the file
+    this->mapping = mmap(nullptr, this->mapping_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    close(fd);
+    if(this->mapping == MAP_FAILED)
+    {
+        this->mapping = nullptr;
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    const char *bytes = static_cast<const char *>(this->mapping);
+    size_t pos = 0;
+    auto read_u64 = [&]()
+    {
+        if(this->mapping_bytes - pos < 8)
+            throw std::runtime_error("Checkpoint " + path + " has a truncated header");
+        uint64_t x;
+        std::memcpy(&x, bytes + pos, 8);
+        pos += 8;
+        return x;
+    };
+    try
+    {
+        if(std::memcmp(bytes, CheckpointMagic, sizeof(CheckpointMagic)) != 0)
+            throw std::runtime_error("Invalid checkpoint " + path);
+        pos = sizeof(CheckpointMagic);
+        uint64_t num_tensors = read_u64();
+        for(uint64_t i = 0; i < num_tensors; i++)
+        {
+            Entry entry;
+            uint64_t name_bytes = read_u64();
+            if(this->mapping_bytes - pos < name_bytes)
+                throw std::runtime_error("Checkpoint " + path + " has a truncated header");
+            entry.name.assign(bytes + pos, name_bytes);
+            pos += name_bytes;
+            uint64_t dtype = read_u64();
+            if(dtype > static_cast<uint64_t>(DataType::I64))
+                throw std::runtime_error("Checkpoint " + path + " has an unknown data type");
+            entry.dtype = static_cast<DataType>(dtype);
+            uint64_t ndim = read_u64();
+            for(uint64_t d = 0; d < ndim; d++)
+                entry.shape.push_back(static_cast<dim_t>(read_u64()));
+            entry.offset = read_u64();
+            size_t size_bytes = SizeBytes(entry.dtype, entry.shape);
+            if(entry.offset % CheckpointAlignment != 0
+               || entry.offset > this->mapping_bytes
+               || this->mapping_bytes - entry.offset < size_bytes)
+                throw std::runtime_error("Checkpoint " + path + " is shorter than its header says");
+            this->tensors.push_back(std::move(entry));
+        }
+    }
+    catch(...)
+    {
+        munmap(this->mapping, this->mapping_bytes);
+        throw;
+    }
+}
+
+Checkpoint::~Checkpoint()
+{
+    if(this->mapping)
+        munmap(this->mapping, this->mapping_bytes);
+}
+
+const Checkpoint::Entry &Checkpoint::Find(const std::string &name) const
+{
+    auto entry = std::find_if(
+        this->tensors.begin(),
+        this->tensors.end(),
+        [&](const Entry &e) { return e.name == name; });
+    if(entry == this->tensors.end())
+        throw std::domain_error("Checkpoint has no tensor " + name);
+    return *entry;
+}
+
+void *Checkpoint::Data(const Entry &entry) const
+{
+    return static_cast<char *>(this->mapping) + entry.offset;
+}
+
+void Checkpoint::Load(nn::Module &network) const
+{
+    // Check every weight before binding any, so a mismatch leaves the network untouched
+    std::vector<const Entry *> entries;
+    for(size_t i = 0; i < network.weights.size(); i++)
+    {
+        GraphNodeHandle weight = Weight(network, i);
+        const Entry &entry = this->Find(network.weight_names[i]);
+        if(entry.dtype != weight->dtype || entry.shape != weight.shape())
+            throw std::domain_error("Weight " + entry.name + " has a different type or shape in the checkpoint");
+        entries.push_back(&entry);
+    }
+    for(size_t i = 0; i < network.weights.size(); i++)
+        Weight(network, i).data() = static_cast<float *>(this->Data(*entries[i]));
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "graph.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gigagrad
+{
+
+constexpr size_t CheckpointAlignment = 64;
+
+struct CheckpointTensor
+{
+    std::string name;
+    DataType dtype;
+    Shape shape;
+    const void *data;
+};
+
+// Writes the tensors to path. The file starts with a header listing the name, type, shape and
+// offset of every tensor, followed by their values in host byte order, each aligned to
+// CheckpointAlignment bytes. The file is written next to path and renamed over it, so a reader
+// never sees a partial checkpoint.
+void SaveCheckpoint(const std::vector<CheckpointTensor> &tensors, const std::string &path);
+
+// Writes every weight of network, see above
+void SaveCheckpoint(nn::Module &network, const std::string &path);
+
+// Copies the contents of the checkpoint file of the tensors into image, reusing its memory, so
+// the file can be written later by WriteCheckpointImage() while the tensors change
+void StageCheckpoint(const std::vector<CheckpointTensor> &tensors, std::vector<uint8_t> &image);
+void WriteCheckpointImage(const std::vector<uint8_t> &image, const std::string &path);
+
+// A checkpoint file mapped into memory. Load() points the weights of a network straight at
+// their values in the mapping, so nothing is read or copied up front and pages are only read
+// when kernels first touch them. Training may update the loaded weights in place: the
+// mapping is private, so updates never reach the file. The checkpoint must outlive every use
+// of the weights it was loaded into.
+struct Checkpoint
+{
+    explicit Checkpoint(const std::string &path);
+    ~Checkpoint();
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+
+    // Binds every weight of network to the tensor of the same name, whose type and shape
+    // must match
+    void Load(nn::Module &network) const;
+
+    struct Entry
+    {
+        std::string name;
+        DataType dtype;
+        Shape shape;
+        size_t offset; // Of the values, in bytes from the start of the file
+    };
+
+    const Entry &Find(const std::string &name) const; // Throws if there is no such tensor
+    void *Data(const Entry &entry) const;
+
+    std::vector<Entry> tensors;
+    void *mapping = nullptr;
+    size_t mapping_bytes = 0;
+};
+
+}
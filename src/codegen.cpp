@@ -4,6 +4,7 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <limits>
 
 namespace gigagrad
 {
@@ -12,6 +13,24 @@ namespace codegen
 
 size_t CodegenNode(Program &prog, FunctionBuilder &f, GraphNodeHandle node, size_t load_idx, size_t max_seen_size_elts);
 
+// Loads the offset of the given row of a ragged input
+static size_t LoadRaggedOffset(Program &prog, FunctionBuilder &f, GraphNodeHandle node, size_t row)
+{
+    GraphNodeHandle offsets = { node.graph, *node->ragged };
+    auto input = f.Input(prog.AddBuffer(offsets, offsets.shape()[0]));
+    return f.LoadInt(input, row);
+}
+
+// Loops over dimension 1 of a ragged node, up to the length of the row that row_loop is at
+static size_t RaggedLoop(Program &prog, FunctionBuilder &f, GraphNodeHandle node, size_t row_loop)
+{
+    auto begin = LoadRaggedOffset(prog, f, node, row_loop);
+    auto next_row = f.Arithmetic(row_loop, IntArithmeticInsn::Op::ADD, f.IntImmediate(1));
+    auto end = LoadRaggedOffset(prog, f, node, next_row);
+    auto length = f.Arithmetic(end, IntArithmeticInsn::Op::SUB, begin);
+    return f.DynamicLoop(node.shape()[1], node.strides()[1], length);
+}
+
 size_t CodegenNode(
     Program &prog,
     FunctionBuilder &f,
@@ -24,7 +43,33 @@ size_t CodegenNode(
     size_elts = std::max(max_seen_size_elts, size_elts);
     size_t buffer_id = prog.AddBuffer(node, size_elts);
     auto input = f.Input(buffer_id);
-    return f.Load(input, load_idx);
+    // Scalar tensors broadcast to every element
+    if(node.shape().empty())
+        load_idx = f.IntImmediate(0);
+    // Row r of an indexed input is row indices[r] of the data bound to it
+    if(node->gather)
+    {
+        GraphNodeHandle indices = { node.graph, *node->gather };
+        auto indices_input = f.Input(prog.AddBuffer(indices, indices.shape()[0]));
+        auto row_stride = f.IntImmediate(node.strides()[0]);
+        auto row = f.Arithmetic(load_idx, IntArithmeticInsn::Op::DIV, row_stride);
+        auto row_begin = f.Arithmetic(row, IntArithmeticInsn::Op::MUL, row_stride);
+        auto in_row = f.Arithmetic(load_idx, IntArithmeticInsn::Op::SUB, row_begin);
+        auto gathered = f.Arithmetic(f.LoadInt(indices_input, row), IntArithmeticInsn::Op::MUL, row_stride);
+        load_idx = f.Arithmetic(gathered, IntArithmeticInsn::Op::ADD, in_row);
+    }
+    // The rows of ragged inputs are packed, so element j of row r is at offsets[r] + j
+    if(node->ragged)
+    {
+        auto row_stride = f.IntImmediate(node.strides()[0]);
+        auto element_stride = f.IntImmediate(node.strides()[1]);
+        auto row = f.Arithmetic(load_idx, IntArithmeticInsn::Op::DIV, row_stride);
+        auto row_begin = f.Arithmetic(row, IntArithmeticInsn::Op::MUL, row_stride);
+        auto in_row = f.Arithmetic(load_idx, IntArithmeticInsn::Op::SUB, row_begin);
+        auto offset = f.Arithmetic(LoadRaggedOffset(prog, f, node, row), IntArithmeticInsn::Op::MUL, element_stride);
+        load_idx = f.Arithmetic(offset, IntArithmeticInsn::Op::ADD, in_row);
+    }
+    return f.integer_product ? f.LoadInt(input, load_idx, *f.integer_product) : f.Load(input, load_idx);
 }
 
 size_t CodegenNode(
@@ -41,13 +86,13 @@ size_t CodegenNode(
 size_t CodegenNode(
     Program &prog,
     FunctionBuilder &f,
-    GraphNodeHandle,
+    GraphNodeHandle node,
     const UnaryOp &u,
     size_t load_idx,
     size_t max_seen_size_elts)
 {
     auto x = CodegenNode(prog, f, u.x, load_idx, max_seen_size_elts);
-    return f.Unary(u.type, x);
+    return f.Unary(u.type, x, node->dtype);
 }
 
 size_t CodegenNode(
@@ -58,45 +103,166 @@ size_t CodegenNode(
     size_t load_idx,
     size_t max_seen_size_elts)
 {
-    const Shape &xshape = b.x.shape();
-    const Shape &yshape = b.y.shape();
     const Shape &broadcasted_shape = node.shape();
     const Shape &broadcasted_strides = node.strides();
 
-    auto generate_stride_adjustments =
-        [&f, &broadcasted_shape, &broadcasted_strides, load_idx](const Shape &shape)
+    // Operand shapes are aligned to the trailing dimensions of the broadcasted shape. Every
+    // dimension the operand doesn't broadcast along contributes (idx / stride % dim) * its stride.
+    auto generate_broadcast_index =
+        [&f, &broadcasted_shape, &broadcasted_strides, load_idx](GraphNodeHandle operand)
         {
-            auto load = load_idx;
+            const Shape &shape = operand.shape();
+            const Shape &strides = operand.strides();
+            if(shape == broadcasted_shape)
+                return load_idx;
+
+            ssize_t offset = std::ssize(broadcasted_shape) - std::ssize(shape);
+            auto load = f.IntImmediate(0);
             for(ssize_t i = 0; i < std::ssize(shape); i++)
             {
-                if(broadcasted_shape[i] != 1 && shape[i] == 1)
-                {
-                    auto divisor = f.IntImmediate(broadcasted_strides[i] * broadcasted_shape[i]);
-                    auto modulus = f.IntImmediate(broadcasted_strides[i]);
-                    auto div = f.Arithmetic(load, IntArithmeticInsn::Op::DIV, divisor);
-                    auto mod = f.Arithmetic(load, IntArithmeticInsn::Op::MOD, modulus);
-                    load = f.Arithmetic(div, IntArithmeticInsn::Op::ADD, mod);
-                }
+                if(shape[i] == 1)
+                    continue;
+                auto broadcasted_stride = f.IntImmediate(broadcasted_strides[i + offset]);
+                auto broadcasted_dim = f.IntImmediate(broadcasted_shape[i + offset]);
+                auto stride = f.IntImmediate(strides[i]);
+                auto div = f.Arithmetic(load_idx, IntArithmeticInsn::Op::DIV, broadcasted_stride);
+                auto mod = f.Arithmetic(div, IntArithmeticInsn::Op::MOD, broadcasted_dim);
+                auto mul = f.Arithmetic(mod, IntArithmeticInsn::Op::MUL, stride);
+                load = f.Arithmetic(load, IntArithmeticInsn::Op::ADD, mul);
             }
             return load;
         };
 
-    size_t xload = generate_stride_adjustments(xshape);
-    size_t yload = generate_stride_adjustments(yshape);
+    size_t xload = generate_broadcast_index(b.x);
+    size_t yload = generate_broadcast_index(b.y);
     auto x = CodegenNode(prog, f, b.x, xload, max_seen_size_elts);
     auto y = CodegenNode(prog, f, b.y, yload, max_seen_size_elts);
+    if(f.integer_product)
+        return f.Arithmetic(x, IntArithmeticInsn::Op::MUL, y, *f.integer_product);
     return f.Binary(b.type, x, y);
 }
 
-size_t CodegenNode(
+// True if the values of node are stored as int8, looking through views
+static bool IsInt8(const Program &prog, GraphNodeHandle node)
+{
+    for(;;)
+    {
+        if(auto cached = prog.node_function_cache.find(node.node_idx); cached != prog.node_function_cache.end())
+            return prog.buffers[prog.functions[cached->second].output_buffer].dtype == DataType::I8;
+        if(node->Kind() != GraphNode::Kind::ViewOp)
+            return node->Kind() == GraphNode::Kind::Tensor && node->dtype == DataType::I8;
+        node = node->u.v.view_op.x;
+    }
+}
+
+// An operand of a reduced product that reads a buffer, directly or through a single view, at
+// offset plus the loop over every dimension of the product times the stride along it. Unlike
+// an index recovered from the flat index of the product with div and mod, this one steps by a
+// constant along the reduction loop, so compilers can vectorize the loop.
+struct StridedOperand
+{
+    GraphNodeHandle buffer;
+    dim_t offset;
+    Shape strides; // Along every dimension of the product, 0 where the operand is broadcast
+    size_t max_seen_size_elts;
+};
+
+// Nullopt for views of views and for gathered or ragged tensors, whose index needs div and mod
+static std::optional<StridedOperand> AsStrided(const Program &prog, GraphNodeHandle operand, const Shape &product_shape)
+{
+    StridedOperand result = { operand, 0, Shape(product_shape.size(), 0), 0 };
+    Shape strides = operand.strides();
+    if(!prog.node_function_cache.contains(operand.node_idx) && operand->Kind() == GraphNode::Kind::ViewOp)
+    {
+        const ViewOp &v = operand->u.v.view_op;
+        result.buffer = v.x;
+        result.offset = v.offset;
+        strides = v.strides;
+        dim_t view_size = std::accumulate(v.shape.begin(), v.shape.end(), dim_t{1}, std::multiplies{});
+        result.max_seen_size_elts = view_size - v.offset;
+    }
+    GraphNodeHandle buffer = result.buffer;
+    if(!prog.node_function_cache.contains(buffer.node_idx)
+       && (buffer->Kind() != GraphNode::Kind::Tensor || buffer->gather || buffer->ragged))
+        return std::nullopt;
+
+    // Operand shapes are aligned to the trailing dimensions of the product
+    const Shape &shape = operand.shape();
+    ssize_t first_dim = std::ssize(product_shape) - std::ssize(shape);
+    for(ssize_t i = 0; i < std::ssize(shape); i++)
+    {
+        if(shape[i] != 1)
+            result.strides[i + first_dim] = strides[i];
+    }
+    return result;
+}
+
+static size_t StridedInput(Program &prog, FunctionBuilder &f, const StridedOperand &operand)
+{
+    if(auto cached = prog.node_function_cache.find(operand.buffer.node_idx); cached != prog.node_function_cache.end())
+    {
+        size_t buffer_id = prog.functions[cached->second].output_buffer;
+        prog.buffers[buffer_id].size_elts = std::max(prog.buffers[buffer_id].size_elts, operand.max_seen_size_elts);
+        return f.Input(buffer_id);
+    }
+    const Shape &shape = operand.buffer.shape();
+    size_t size_elts = std::accumulate(shape.begin(), shape.end(), dim_t{1}, std::multiplies{});
+    return f.Input(prog.AddBuffer(operand.buffer, std::max(size_elts, operand.max_seen_size_elts)));
+}
+
+// Index of the operand's element at the current iteration of the loops. Dimensions without a
+// loop don't move the index.
+static size_t StridedIndex(FunctionBuilder &f, const StridedOperand &operand, const std::vector<std::optional<size_t>> &dim_loops)
+{
+    auto idx = f.IntImmediate(operand.offset);
+    for(size_t i = 0; i < dim_loops.size(); i++)
+    {
+        if(!dim_loops[i] || operand.strides[i] == 0)
+            continue;
+        auto stride = f.IntImmediate(operand.strides[i]);
+        auto mul = f.Arithmetic(*dim_loops[i], IntArithmeticInsn::Op::MUL, stride);
+        idx = f.Arithmetic(idx, IntArithmeticInsn::Op::ADD, mul);
+    }
+    return idx;
+}
+
+// Generates the loops of the reduction into f, and calls store(store_idx, value) wherever the
+// reduced value of an output element is ready.
+template <typename TStore>
+static void GenerateReduction(
     Program &prog,
-    FunctionBuilder &old_f,
+    FunctionBuilder &f,
     GraphNodeHandle node,
     const ReduceOp &r,
-    size_t output_load_idx,
-    size_t max_seen_size_elts)
+    TStore store)
 {
-    FunctionBuilder f(node, max_seen_size_elts);
+    // Sums of products of int8 values multiply and accumulate exactly in integers. Products
+    // are at most 128 * 128, so int32 holds sums of up to 2^17 of them.
+    GraphNodeHandle product = r.x;
+    std::optional<DataType> integer;
+    std::optional<StridedOperand> x, y;
+    if(r.type == ReduceOpType::SUM
+       && product->Kind() == GraphNode::Kind::BinaryOp
+       && product->u.b.binary_op.type == BinaryOpType::MUL
+       && IsInt8(prog, product->u.b.binary_op.x)
+       && IsInt8(prog, product->u.b.binary_op.y))
+    {
+        dim_t reduced_elts = 1;
+        for(auto dim : r.dims)
+            reduced_elts *= r.x.shape()[dim];
+        integer = reduced_elts <= (dim_t{1} << 17) ? DataType::I32 : DataType::I64;
+        x = AsStrided(prog, product->u.b.binary_op.x, r.x.shape());
+        y = AsStrided(prog, product->u.b.binary_op.y, r.x.shape());
+    }
+
+    // When both operands are contiguous along the innermost reduced dimension, that loop is a
+    // dot product
+    dim_t dot_dim = r.dims.back();
+    bool dot = integer == DataType::I32
+        && x && x->strides[dot_dim] == 1
+        && y && y->strides[dot_dim] == 1
+        && !(dot_dim == 0 && r.x->batched)
+        && !(dot_dim == 1 && r.x->ragged);
 
     std::vector<size_t> accumulators;
     auto reduce_dim = r.dims.begin(); // dims is sorted
@@ -108,12 +274,27 @@ size_t CodegenNode(
     const Shape &input_shape = r.x.shape();
     const Shape &input_strides = r.x.strides();
 
+    // Dimension 1 of a ragged input loops up to the length of the current row. Reductions over
+    // rows also reduce over dimension 1, so the loop over rows always comes first.
+    size_t row_loop = 0;
+    std::vector<std::optional<size_t>> dim_loops(input_shape.size());
+    auto loop_over = [&](ssize_t i)
+    {
+        size_t loop = i == 1 && r.x->ragged
+            ? RaggedLoop(prog, f, r.x, row_loop)
+            : f.Loop(input_shape[i], input_strides[i], i == 0 && r.x->batched);
+        if(i == 0)
+            row_loop = loop;
+        dim_loops[i] = loop;
+        return loop;
+    };
+
     // Generate loops for all of the non-reducing dimensions
     for(ssize_t i = 0; i < std::ssize(input_shape); i++)
     {
         if(reduce_dim == r.dims.end() || i != *reduce_dim)
         {
-            auto loop = f.Loop(input_shape[i], input_strides[i]);
+            auto loop = loop_over(i);
             auto input_stride = f.IntImmediate(input_strides[i]);
             auto output_stride = f.IntImmediate(*ioutput_strides);
             auto mul_input_stride = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, input_stride);
@@ -137,27 +318,61 @@ size_t CodegenNode(
     // Generate loops along reduction dimension
     for(auto dim : r.dims)
     {
-        accumulators.push_back(f.Immediate(0.0f));
-        auto loop = f.Loop(input_shape[dim], input_strides[dim]);
+        if(dot && dim == dot_dim)
+            break;
+        accumulators.push_back(integer ? f.IntImmediate(0, *integer) : f.Immediate(0.0f));
+        auto loop = loop_over(dim);
         auto stride = f.IntImmediate(input_strides[dim]);
         auto mul = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, stride);
         load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul);
     }
 
-    auto to_accumulate = CodegenNode(prog, f, r.x, load_idx, 0);
+    size_t to_accumulate;
+    if(dot)
+    {
+        auto x_input = StridedInput(prog, f, *x);
+        auto y_input = StridedInput(prog, f, *y);
+        auto x_idx = StridedIndex(f, *x, dim_loops);
+        auto y_idx = StridedIndex(f, *y, dim_loops);
+        to_accumulate = f.DotInt8(x_input, x_idx, y_input, y_idx, input_shape[dot_dim]);
+    }
+    else if(x && y)
+    {
+        auto x_value = f.LoadInt(StridedInput(prog, f, *x), StridedIndex(f, *x, dim_loops), *integer);
+        auto y_value = f.LoadInt(StridedInput(prog, f, *y), StridedIndex(f, *y, dim_loops), *integer);
+        to_accumulate = f.Arithmetic(x_value, IntArithmeticInsn::Op::MUL, y_value, *integer);
+    }
+    else
+    {
+        f.integer_product = integer;
+        to_accumulate = CodegenNode(prog, f, r.x, load_idx, 0);
+        f.integer_product = std::nullopt;
+    }
 
-    ssize_t iaccum = std::ssize(r.dims) - 1;
-    do
+    for(ssize_t iaccum = std::ssize(accumulators) - 1; iaccum >= 0; iaccum--)
     {
         f.Accumulate(r.type, accumulators[iaccum], to_accumulate);
         to_accumulate = accumulators[iaccum];
         f.EndLoop();
-        iaccum--;
-    } while(iaccum >= 0);
-    f.Store(store_idx, accumulators[0]);
+    }
+    store(store_idx, integer ? f.IntToFloat(to_accumulate) : to_accumulate);
     for(ssize_t i = 0; i < std::ssize(input_shape) - std::ssize(r.dims); i++)
         f.EndLoop();
+}
 
+size_t CodegenNode(
+    Program &prog,
+    FunctionBuilder &old_f,
+    GraphNodeHandle node,
+    const ReduceOp &r,
+    size_t output_load_idx,
+    size_t max_seen_size_elts)
+{
+    FunctionBuilder f(node, max_seen_size_elts);
+    GenerateReduction(prog, f, node, r, [&](size_t store_idx, size_t value)
+    {
+        f.Store(store_idx, value);
+    });
     prog.PushFunction(std::move(f));
     auto input = old_f.Input(prog.functions.back().output_buffer);
     return old_f.Load(input, output_load_idx);
@@ -204,13 +419,20 @@ size_t CodegenNode(
 
 size_t CodegenNode(Program &prog, FunctionBuilder &f, GraphNodeHandle node, size_t load_idx, size_t max_seen_size_elts)
 {
+    if(auto bound = f.bound_values.find(node.node_idx); bound != f.bound_values.end())
+    {
+        auto [bound_load_idx, value] = bound->second;
+        if(load_idx != bound_load_idx)
+            throw std::domain_error("A fused reduction can only be consumed elementwise");
+        return value;
+    }
     if(prog.node_function_cache.contains(node.node_idx))
     {
         size_t function_id = prog.node_function_cache[node.node_idx];
         size_t buffer_id = prog.functions[function_id].output_buffer;
         prog.buffers[buffer_id].size_elts = std::max(prog.buffers[buffer_id].size_elts, max_seen_size_elts);
         auto input = f.Input(buffer_id);
-        return f.Load(input, load_idx);
+        return f.integer_product ? f.LoadInt(input, load_idx, *f.integer_product) : f.Load(input, load_idx);
     }
     return node->Visit([&](auto &&x)
     {
@@ -218,6 +440,28 @@ size_t CodegenNode(Program &prog, FunctionBuilder &f, GraphNodeHandle node, size
     });
 }
 
+static size_t GenerateElementwiseLoops(Program &prog, FunctionBuilder &f, GraphNodeHandle node)
+{
+    const Shape &shape = node.shape();
+    const Shape &strides = node.strides();
+    auto load_idx = f.IntImmediate(0);
+    size_t row_loop = 0;
+    for(ssize_t i = 0; i < std::ssize(shape); i++)
+    {
+        size_t loop;
+        if(i == 1 && node->ragged)
+            loop = RaggedLoop(prog, f, node, row_loop);
+        else
+            loop = f.Loop(shape[i], strides[i], i == 0 && node->batched);
+        if(i == 0)
+            row_loop = loop;
+        auto stride = f.IntImmediate(strides[i]);
+        auto mul = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, stride);
+        load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul);
+    }
+    return load_idx;
+}
+
 void CodegenNode(Program &prog, GraphNodeHandle node, std::optional<size_t> output_buffer)
 {
     // ReduceOp generates its own loops
@@ -230,15 +474,7 @@ void CodegenNode(Program &prog, GraphNodeHandle node, std::optional<size_t> outp
     {
         FunctionBuilder f(node);
         const Shape &shape = node.shape();
-        const Shape &strides = node.strides();
-        auto load_idx = f.IntImmediate(0);
-        for(ssize_t i = 0; i < std::ssize(shape); i++)
-        {
-            auto loop = f.Loop(shape[i], strides[i]);
-            auto stride = f.IntImmediate(strides[i]);
-            auto mul = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, stride);
-            load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul);
-        }
+        auto load_idx = GenerateElementwiseLoops(prog, f, node);
         auto to_store = CodegenNode(prog, f, node, load_idx, 0);
         f.Store(load_idx, to_store);
         for(ssize_t i = 0; i < std::ssize(shape); i++)
@@ -256,6 +492,239 @@ void CodegenNode(Program &prog, GraphNodeHandle node, std::optional<size_t> outp
     }
 }
 
+void CodegenElementwise(Program &prog, const std::vector<GraphNodeHandle> &nodes, const std::vector<size_t> &output_buffers)
+{
+    if(nodes.empty() || nodes.size() != output_buffers.size())
+        throw std::domain_error("CodegenElementwise needs exactly one output buffer per node");
+
+    const Shape &shape = nodes[0].shape();
+    for(GraphNodeHandle node : nodes)
+        if(node.shape() != shape || node->batched != nodes[0]->batched || node->ragged != nodes[0]->ragged)
+            throw std::domain_error("CodegenElementwise nodes must all have the same shape");
+
+    FunctionBuilder f(nodes[0]);
+    auto load_idx = GenerateElementwiseLoops(prog, f, nodes[0]);
+
+    // Compute every value before storing any of them, since outputs may also be inputs
+    std::vector<size_t> to_store;
+    for(GraphNodeHandle node : nodes)
+        to_store.push_back(CodegenNode(prog, f, node, load_idx, 0));
+    for(size_t i = 0; i < to_store.size(); i++)
+        f.Store(load_idx, to_store[i], i);
+    for(ssize_t i = 0; i < std::ssize(shape); i++)
+        f.EndLoop();
+
+    f.aux_output_buffers.assign(output_buffers.begin() + 1, output_buffers.end());
+    prog.PushFunction(std::move(f));
+    prog.buffers.pop_back();
+    prog.ChangeOutputBuffer(prog.functions.size() - 1, output_buffers[0]);
+}
+
+std::optional<GraphNodeHandle> FusableReduction(GraphNodeHandle node)
+{
+    // Views whose strides are the contiguous strides of their shape, with no offset and the
+    // same number of elements as their input, leave every element at the same flat index.
+    while(node->Kind() == GraphNode::Kind::ViewOp)
+    {
+        const ViewOp &v = node->u.v.view_op;
+        auto num_elements = [](const Shape &shape)
+        {
+            return std::accumulate(shape.begin(), shape.end(), dim_t{1}, std::multiplies{});
+        };
+        if(v.offset != 0 || v.strides != node.strides() || num_elements(v.shape) != num_elements(v.x.shape()))
+            return std::nullopt;
+        node = v.x;
+    }
+    if(node->Kind() != GraphNode::Kind::ReduceOp)
+        return std::nullopt;
+    return node;
+}
+
+void CodegenReduceEpilogue(
+    Program &prog,
+    GraphNodeHandle node,
+    const std::vector<GraphNodeHandle> &epilogue,
+    const std::vector<size_t> &output_buffers)
+{
+    std::optional<GraphNodeHandle> reduction = FusableReduction(node);
+    if(!reduction)
+        throw std::domain_error("CodegenReduceEpilogue needs a reduction");
+    // Without a buffer for epilogue[0], it is stored into a new buffer like any function output
+    bool new_output_buffer = epilogue.size() == output_buffers.size() + 1;
+    if(epilogue.empty() || (epilogue.size() != output_buffers.size() && !new_output_buffer))
+        throw std::domain_error("CodegenReduceEpilogue needs one output buffer per node");
+    for(GraphNodeHandle e : epilogue)
+        if(e.shape() != node.shape())
+            throw std::domain_error("CodegenReduceEpilogue nodes must have the shape of the reduction");
+
+    FunctionBuilder f(*reduction);
+    GenerateReduction(prog, f, *reduction, (*reduction)->u.r.reduce_op, [&](size_t store_idx, size_t value)
+    {
+        for(GraphNodeHandle n = node; n.node_idx != reduction->node_idx; n = n->u.v.view_op.x)
+            f.bound_values[n.node_idx] = { store_idx, value };
+        f.bound_values[reduction->node_idx] = { store_idx, value };
+
+        std::vector<size_t> to_store;
+        for(GraphNodeHandle e : epilogue)
+            to_store.push_back(CodegenNode(prog, f, e, store_idx, 0));
+        for(size_t i = 0; i < to_store.size(); i++)
+            f.Store(store_idx, to_store[i], i);
+    });
+
+    // The reduced values never reach memory, so later loads of the reduction must not find
+    // this function in the cache.
+    auto cached = prog.node_function_cache.find(reduction->node_idx);
+    std::optional<size_t> previous_function;
+    if(cached != prog.node_function_cache.end())
+        previous_function = cached->second;
+
+    f.aux_output_buffers.assign(output_buffers.begin() + (new_output_buffer ? 0 : 1), output_buffers.end());
+    prog.PushFunction(std::move(f));
+    if(!new_output_buffer)
+    {
+        prog.buffers.pop_back();
+        prog.ChangeOutputBuffer(prog.functions.size() - 1, output_buffers[0]);
+    }
+    if(previous_function)
+        prog.node_function_cache[reduction->node_idx] = *previous_function;
+    else
+        prog.node_function_cache.erase(reduction->node_idx);
+    prog.node_function_cache[epilogue[0].node_idx] = prog.functions.size() - 1;
+}
+
+void Program::PlanMemory(const std::vector<size_t> &live_out, bool in_place)
+{
+    // Every buffer is live from the first to the last function that touches it, inclusive
+    constexpr size_t kNotUsed = std::numeric_limits<size_t>::max();
+    std::vector<std::pair<size_t, size_t>> live_ranges(this->buffers.size(), { kNotUsed, 0 });
+    auto touch = [&](size_t buffer, size_t ifn)
+    {
+        live_ranges[buffer].first = std::min(live_ranges[buffer].first, ifn);
+        live_ranges[buffer].second = std::max(live_ranges[buffer].second, ifn);
+    };
+    for(size_t ifn = 0; ifn < this->functions.size(); ifn++)
+    {
+        const FunctionBuilder &fn = this->functions[ifn];
+        for(size_t input : fn.inputs)
+            touch(input, ifn);
+        touch(fn.output_buffer, ifn);
+        for(size_t aux : fn.aux_output_buffers)
+            touch(aux, ifn);
+    }
+    if(!this->functions.empty())
+        touch(this->functions.back().output_buffer, this->functions.size());
+    for(size_t buffer : live_out)
+        touch(buffer, this->functions.size());
+
+    // Buffers stored in place over another one join its group, which is placed as one buffer
+    // that is live for as long as any of its members
+    std::vector<size_t> group(this->buffers.size());
+    std::iota(group.begin(), group.end(), 0);
+    auto is_intermediate = [&](size_t buffer)
+    {
+        return !std::holds_alternative<GraphNodeHandle>(this->buffers[buffer].id);
+    };
+    for(size_t ifn = 0; in_place && ifn < this->functions.size(); ifn++)
+    {
+        const FunctionBuilder &fn = this->functions[ifn];
+        if(!fn.aux_output_buffers.empty() || !is_intermediate(fn.output_buffer) || live_ranges[fn.output_buffer].first != ifn)
+            continue;
+        for(size_t iinput = 0; iinput < fn.inputs.size(); iinput++)
+        {
+            size_t input = fn.inputs[iinput];
+            if(is_intermediate(input)
+               && live_ranges[input].second == ifn
+               && this->buffers[input].dtype == this->buffers[fn.output_buffer].dtype
+               && fn.ReadsOnlyAtStoreIndex(iinput))
+            {
+                group[fn.output_buffer] = group[input];
+                break;
+            }
+        }
+    }
+    std::vector<std::pair<size_t, size_t>> group_ranges(this->buffers.size(), { kNotUsed, 0 });
+    std::vector<size_t> group_sizes(this->buffers.size(), 0); // In bytes
+    for(size_t ibuffer = 0; ibuffer < this->buffers.size(); ibuffer++)
+    {
+        if(live_ranges[ibuffer].first == kNotUsed)
+            continue;
+        size_t g = group[ibuffer];
+        group_ranges[g].first = std::min(group_ranges[g].first, live_ranges[ibuffer].first);
+        group_ranges[g].second = std::max(group_ranges[g].second, live_ranges[ibuffer].second);
+        group_sizes[g] = std::max(group_sizes[g], this->buffers[ibuffer].SizeBytes());
+    }
+
+    // Place the largest groups first, each at the lowest offset that doesn't overlap a placed
+    // group with an overlapping live range. Offsets are aligned to 64 bytes.
+    constexpr size_t kAlignmentBytes = 64;
+    std::vector<size_t> order;
+    for(size_t ibuffer = 0; ibuffer < this->buffers.size(); ibuffer++)
+    {
+        if(is_intermediate(ibuffer) && group[ibuffer] == ibuffer && group_ranges[ibuffer].first != kNotUsed)
+            order.push_back(ibuffer);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return group_sizes[a] > group_sizes[b];
+    });
+
+    MemoryPlan plan = { std::vector<size_t>(this->buffers.size(), 0), 0 };
+    std::vector<size_t> placed;
+    for(size_t ibuffer : order)
+    {
+        auto [first, last] = group_ranges[ibuffer];
+        std::vector<std::pair<size_t, size_t>> taken;
+        for(size_t other : placed)
+        {
+            if(group_ranges[other].first <= last && first <= group_ranges[other].second)
+                taken.push_back({ plan.offsets_bytes[other], plan.offsets_bytes[other] + group_sizes[other] });
+        }
+        std::sort(taken.begin(), taken.end());
+
+        size_t offset = 0;
+        for(auto [begin, end] : taken)
+        {
+            if(offset + group_sizes[ibuffer] <= begin)
+                break;
+            offset = std::max(offset, (end + kAlignmentBytes - 1) / kAlignmentBytes * kAlignmentBytes);
+        }
+        plan.offsets_bytes[ibuffer] = offset;
+        plan.size_bytes = std::max(plan.size_bytes, offset + group_sizes[ibuffer]);
+        placed.push_back(ibuffer);
+    }
+    for(size_t ibuffer = 0; ibuffer < this->buffers.size(); ibuffer++)
+        plan.offsets_bytes[ibuffer] = plan.offsets_bytes[group[ibuffer]];
+    this->memory_plan = std::move(plan);
+}
+
+size_t Program::IntermediateBytes() const
+{
+    if(this->memory_plan)
+        return this->memory_plan->size_bytes;
+
+    size_t size_bytes = 0;
+    for(const BufferDescriptor &desc : this->buffers)
+    {
+        if(!std::holds_alternative<GraphNodeHandle>(desc.id))
+            size_bytes += desc.SizeBytes();
+    }
+    return size_bytes;
+}
+
+dim_t Program::MaxBatchSize() const
+{
+    dim_t max_batch_size = 0;
+    for(const FunctionBuilder &fn : this->functions)
+    {
+        for(const Instruction &insn : fn.insns)
+        {
+            if(const BeginLoopInsn *loop = std::get_if<BeginLoopInsn>(&insn); loop && loop->batched)
+                max_batch_size = loop->range;
+        }
+    }
+    return max_batch_size;
+}
+
 codegen::Program CodegenNode(GraphNodeHandle node)
 {
     codegen::Program result;
@@ -15,6 +15,7 @@ namespace codegen
 struct LoadIntImmediateInsn
 {
     int64_t value;
+    DataType dtype = DataType::I64; // Integer type of the value
 
     void Print(size_t iinsn)
     {
@@ -36,6 +37,7 @@ struct IntArithmeticInsn
     Op op;
     size_t x;
     size_t y;
+    DataType dtype = DataType::I64; // Integer type the operation is done in
 
     void Print(size_t iinsn)
     {
@@ -47,10 +49,15 @@ struct BeginLoopInsn
 {
     dim_t range;
     dim_t stride;
+    bool batched = false; // Loops over the batch size given at run time instead, which is at most range
+    std::optional<size_t> dynamic_range; // Loops up to the value of this insn instead, which is at most range
 
     void Print(size_t iinsn)
     {
-        std::printf("v%zu = LOOP [0..%zd, %zd]\n", iinsn, range, stride);
+        if(dynamic_range)
+            std::printf("v%zu = LOOP [0..v%zu <= %zd, %zd]\n", iinsn, *dynamic_range, range, stride);
+        else
+            std::printf("v%zu = LOOP [0..%s%zd, %zd]\n", iinsn, batched ? "batch <= " : "", range, stride);
     }
 };
 
@@ -73,14 +80,44 @@ struct LoadInsn
     }
 };
 
+// Loads an integer from an input that holds integers, e.g. the offsets of a ragged input
+struct LoadIntInsn
+{
+    size_t input;
+    size_t idx;
+    DataType dtype = DataType::I64; // Integer type the value is widened to
+
+    void Print(size_t iinsn)
+    {
+        std::printf("v%zu = LOAD INT I%zu[v%zu]\n", iinsn, input, idx);
+    }
+};
+
+// Sum of the products of length int8 values of two inputs, each stored contiguously from its
+// index, accumulated in int32. Backends lower it to dot product instructions.
+struct DotInt8Insn
+{
+    size_t x_input;
+    size_t x_idx;
+    size_t y_input;
+    size_t y_idx;
+    dim_t length;
+
+    void Print(size_t iinsn)
+    {
+        std::printf("v%zu = DOT I%zu[v%zu..], I%zu[v%zu..] x %zd\n", iinsn, x_input, x_idx, y_input, y_idx, length);
+    }
+};
+
 struct StoreInsn
 {
     size_t offset;
     size_t value;
+    size_t output = 0; // 0 is the function's output buffer, i > 0 is aux_output_buffers[i - 1]
 
     void Print(size_t iinsn)
     {
-        std::printf("Output[v%zu] = v%zu\n", offset, value);
+        std::printf("Output%zu[v%zu] = v%zu\n", output, offset, value);
     }
 };
 
@@ -98,6 +135,7 @@ struct UnaryInsn
 {
     UnaryOpType type;
     size_t x;
+    DataType dtype = DataType::F32; // Type that CAST rounds to
 
     void Print(size_t iinsn)
     {
@@ -131,6 +169,16 @@ struct BinaryInsn
     }
 };
 
+struct IntToFloatInsn
+{
+    size_t x;
+
+    void Print(size_t iinsn)
+    {
+        std::printf("v%zu = FLOAT(v%zu)\n", iinsn, x);
+    }
+};
+
 struct AccumulateInsn
 {
     ReduceOpType type;
@@ -152,10 +200,13 @@ using Instruction = std::variant<
     BeginLoopInsn,
     EndLoopInsn,
     LoadInsn,
+    LoadIntInsn,
+    DotInt8Insn,
     StoreInsn,
     LoadImmediateInsn,
     UnaryInsn,
     BinaryInsn,
+    IntToFloatInsn,
     AccumulateInsn>;
 
 struct FunctionBuilder
@@ -175,9 +226,15 @@ struct FunctionBuilder
             output_size);
     }
 
-    size_t Loop(dim_t range, dim_t stride)
+    size_t Loop(dim_t range, dim_t stride, bool batched = false)
+    {
+        insns.emplace_back(BeginLoopInsn{range, stride, batched});
+        return insns.size() - 1;
+    }
+
+    size_t DynamicLoop(dim_t max_range, dim_t stride, size_t range)
     {
-        insns.emplace_back(BeginLoopInsn{range, stride});
+        insns.emplace_back(BeginLoopInsn{max_range, stride, false, range});
         return insns.size() - 1;
     }
 
@@ -206,9 +263,21 @@ struct FunctionBuilder
         return insns.size() - 1;
     }
 
-    size_t Store(size_t offset, size_t value)
+    size_t LoadInt(size_t input_idx, size_t load_idx, DataType dtype = DataType::I64)
     {
-        insns.emplace_back(StoreInsn{offset, value});
+        insns.emplace_back(LoadIntInsn{input_idx, load_idx, dtype});
+        return insns.size() - 1;
+    }
+
+    size_t DotInt8(size_t x_input, size_t x_idx, size_t y_input, size_t y_idx, dim_t length)
+    {
+        insns.emplace_back(DotInt8Insn{x_input, x_idx, y_input, y_idx, length});
+        return insns.size() - 1;
+    }
+
+    size_t Store(size_t offset, size_t value, size_t output = 0)
+    {
+        insns.emplace_back(StoreInsn{offset, value, output});
         return insns.size() - 1;
     }
 
@@ -218,21 +287,21 @@ struct FunctionBuilder
         return insns.size() - 1;
     }
 
-    size_t IntImmediate(int64_t value)
+    size_t IntImmediate(int64_t value, DataType dtype = DataType::I64)
     {
-        insns.emplace_back(LoadIntImmediateInsn{value});
+        insns.emplace_back(LoadIntImmediateInsn{value, dtype});
         return insns.size() - 1;
     }
 
-    size_t Arithmetic(size_t x, IntArithmeticInsn::Op op, size_t y)
+    size_t Arithmetic(size_t x, IntArithmeticInsn::Op op, size_t y, DataType dtype = DataType::I64)
     {
-        insns.emplace_back(IntArithmeticInsn{op, x, y});
+        insns.emplace_back(IntArithmeticInsn{op, x, y, dtype});
         return insns.size() - 1;
     }
 
-    size_t Unary(UnaryOpType type, size_t x)
+    size_t Unary(UnaryOpType type, size_t x, DataType dtype = DataType::F32)
     {
-        insns.emplace_back(UnaryInsn{type, x});
+        insns.emplace_back(UnaryInsn{type, x, dtype});
         return insns.size() - 1;
     }
 
@@ -242,12 +311,47 @@ struct FunctionBuilder
         return insns.size() - 1;
     }
 
+    size_t IntToFloat(size_t x)
+    {
+        insns.emplace_back(IntToFloatInsn{x});
+        return insns.size() - 1;
+    }
+
     size_t Accumulate(ReduceOpType type, size_t accumulator, size_t x)
     {
         insns.emplace_back(AccumulateInsn{type, accumulator, x});
         return insns.size() - 1;
     }
 
+    // True if every load of the given input reads the element that the function stores to in
+    // the same iteration, so the output may be written over that input
+    bool ReadsOnlyAtStoreIndex(size_t input_idx) const
+    {
+        std::optional<size_t> store_idx;
+        for(const Instruction &insn : insns)
+        {
+            if(const StoreInsn *store = std::get_if<StoreInsn>(&insn))
+            {
+                if(store_idx && *store_idx != store->offset)
+                    return false;
+                store_idx = store->offset;
+            }
+        }
+        for(const Instruction &insn : insns)
+        {
+            if(const LoadInsn *load = std::get_if<LoadInsn>(&insn); load && load->input == input_idx)
+            {
+                if(!store_idx || load->idx != *store_idx)
+                    return false;
+            }
+            if(const LoadIntInsn *load = std::get_if<LoadIntInsn>(&insn); load && load->input == input_idx)
+                return false;
+            if(const DotInt8Insn *dot = std::get_if<DotInt8Insn>(&insn); dot && (dot->x_input == input_idx || dot->y_input == input_idx))
+                return false;
+        }
+        return store_idx.has_value();
+    }
+
     void Print()
     {
         for(ssize_t i = 0; i < std::ssize(insns); i++)
@@ -262,12 +366,49 @@ struct FunctionBuilder
     std::vector<Instruction> insns;
     std::vector<size_t> inputs; // Indices into the program inputs
     size_t output_buffer;
+    std::vector<size_t> aux_output_buffers; // Additional outputs of multi-output functions
+
+    // Node index -> (load index, insn) for nodes whose value at that load index is already
+    // computed in this function, e.g. the accumulator of a fused reduction
+    std::unordered_map<size_t, std::pair<size_t, size_t>> bound_values;
+
+    // Loads tensors and computed nodes as integers of this type and multiplies them as such,
+    // while generating the product of a quantized reduction
+    std::optional<DataType> integer_product;
 };
 
 struct BufferDescriptor
 {
     std::variant<GraphNodeHandle, size_t> id; // Either a tensor or a function index
     size_t size_elts;
+    bool constant = false; // A tensor whose data doesn't change after lowering, so backends may embed it
+    DataType dtype = DataType::F32;
+
+    size_t SizeBytes() const { return size_elts * SizeOf(dtype); }
+};
+
+// An input that Backend::ExecuteSteps advances by stride_elts elements of its type after every step
+struct SteppedInput
+{
+    GraphNodeHandle tensor;
+    void *base;
+    size_t stride_elts;
+};
+
+// A range of consecutive functions that a backend can run on its own, e.g. only the
+// gradient computation of a training program
+struct EntryPoint
+{
+    size_t first_function;
+    size_t end_function;
+};
+
+// Places the intermediate buffers of a program in one arena, where buffers that are never
+// live at the same time share memory
+struct MemoryPlan
+{
+    std::vector<size_t> offsets_bytes; // Offset of every buffer, only meaningful for intermediates
+    size_t size_bytes;
 };
 
 struct Program
@@ -296,7 +437,7 @@ struct Program
                 if(std::get<GraphNodeHandle>(buff_id).node_idx == t.node_idx)
                     return iinput;
         }
-        buffers.push_back({ t, size_elts });
+        buffers.push_back({ t, size_elts, false, t->dtype });
         return buffers.size() - 1;
     }
 
@@ -309,16 +450,47 @@ struct Program
                 if(std::get<size_t>(buff_id) == fn_idx)
                     return iinput;
         }
-        buffers.push_back({ fn_idx, functions[fn_idx].output_size });
+        buffers.push_back({ fn_idx, functions[fn_idx].output_size, false, functions[fn_idx].node->dtype });
         return buffers.size() - 1;
     }
 
+    std::optional<size_t> FindBuffer(GraphNodeHandle t) const
+    {
+        for(size_t ibuffer = 0; ibuffer < buffers.size(); ibuffer++)
+        {
+            const auto &buff_id = buffers[ibuffer].id;
+            if(std::holds_alternative<GraphNodeHandle>(buff_id))
+                if(std::get<GraphNodeHandle>(buff_id).node_idx == t.node_idx)
+                    return ibuffer;
+        }
+        return std::nullopt;
+    }
+
     size_t GetOutputBufferForNodeIdx(size_t node_id)
     {
         size_t function_id = node_function_cache[node_id];
         return functions[function_id].output_buffer;
     }
 
+    // Computes memory_plan. The output of the last function and the buffers in live_out are read
+    // after the program runs, so they are never reused. If in_place, a function may also store
+    // its output over an input that it reads for the last time, see ReadsOnlyAtStoreIndex.
+    void PlanMemory(const std::vector<size_t> &live_out = {}, bool in_place = false);
+
+    // Bytes of memory taken by the intermediate buffers, with the memory plan if there is one
+    size_t IntermediateBytes() const;
+
+    // Largest batch size the program can run with, or 0 if it has no batched loops
+    dim_t MaxBatchSize() const;
+
+    size_t AddEntryPoint(size_t first_function, size_t end_function)
+    {
+        if(first_function > end_function || end_function > functions.size())
+            throw std::domain_error("Invalid entry point");
+        entry_points.push_back({ first_function, end_function });
+        return entry_points.size() - 1;
+    }
+
     void ChangeOutputBuffer(size_t fn_idx, size_t new_output_buffer)
     {
         if(new_output_buffer >= buffers.size())
@@ -339,9 +511,32 @@ struct Program
     std::unordered_map<size_t, size_t> node_function_cache;
     std::vector<FunctionBuilder> functions;
     std::vector<BufferDescriptor> buffers;
+    std::vector<EntryPoint> entry_points;
+    std::optional<MemoryPlan> memory_plan;
 };
 
 void CodegenNode(codegen::Program &prog, GraphNodeHandle node, std::optional<size_t> output_buffer = std::nullopt);
+
+// Generates a single function that evaluates every node elementwise in one loop nest and
+// stores nodes[i] into output_buffers[i]. All nodes must have the same shape.
+void CodegenElementwise(
+    codegen::Program &prog,
+    const std::vector<GraphNodeHandle> &nodes,
+    const std::vector<size_t> &output_buffers);
+
+// Returns the reduction that node is, looking through views that don't move any elements
+std::optional<GraphNodeHandle> FusableReduction(GraphNodeHandle node);
+
+// Generates the reduction FusableReduction(node), but instead of storing the reduced values,
+// evaluates the epilogue nodes on them elementwise and stores epilogue[i] into
+// output_buffers[i]. Within the epilogue, node refers to the reduced value. If output_buffers
+// has no entry for epilogue[0], it gets a new buffer. Later loads of epilogue[0] read the
+// stored values.
+void CodegenReduceEpilogue(
+    codegen::Program &prog,
+    GraphNodeHandle node,
+    const std::vector<GraphNodeHandle> &epilogue,
+    const std::vector<size_t> &output_buffers);
 codegen::Program CodegenNode(GraphNodeHandle node);
 
 }
@@ -0,0 +1,266 @@
+#include "dataloader.h"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace gigagrad
+{
+
+static DataType IdxDataType(uint8_t code, const std::string &path)
+{
+    switch(code)
+    {
+    case 0x08:
+        return DataType::U8;
+    case 0x09:
+        return DataType::I8;
+    case 0x0B:
+        return DataType::I16;
+    case 0x0C:
+        return DataType::I32;
+    case 0x0D:
+        return DataType::F32;
+    default:
+        throw std::domain_error("Unsupported IDX data type in " + path);
+    }
+}
+
+static uint32_t ReadBigEndian32(const uint8_t *bytes)
+{
+    return (uint32_t{bytes[0]} << 24) | (uint32_t{bytes[1]} << 16) | (uint32_t{bytes[2]} << 8) | uint32_t{bytes[3]};
+}
+
+// Reads one big-endian integer of type dtype
+static int64_t ReadBigEndianInt(const uint8_t *bytes, DataType dtype)
+{
+    switch(dtype)
+    {
+    case DataType::U8:
+        return bytes[0];
+    case DataType::I8:
+        return static_cast<int8_t>(bytes[0]);
+    case DataType::I16:
+        return static_cast<int16_t>((bytes[0] << 8) | bytes[1]);
+    case DataType::I32:
+        return static_cast<int32_t>(ReadBigEndian32(bytes));
+    default:
+        throw std::domain_error("Labels must be integers");
+    }
+}
+
+// Copies big-endian values of elt_bytes each into host byte order
+static void CopyToHostOrder(uint8_t *dst, const uint8_t *src, size_t size_bytes, size_t elt_bytes)
+{
+    if(elt_bytes == 1 || std::endian::native == std::endian::big)
+    {
+        std::memcpy(dst, src, size_bytes);
+        return;
+    }
+    for(size_t i = 0; i < size_bytes; i += elt_bytes)
+    {
+        if(elt_bytes == 2)
+        {
+            uint16_t x;
+            std::memcpy(&x, src + i, 2);
+            x = __builtin_bswap16(x);
+            std::memcpy(dst + i, &x, 2);
+        }
+        else
+        {
+            uint32_t x;
+            std::memcpy(&x, src + i, 4);
+            x = __builtin_bswap32(x);
+            std::memcpy(dst + i, &x, 4);
+        }
+    }
+}
+
+IdxFile::IdxFile(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    this->mapping_bytes = static_cast<size_t>(st.st_size);
+    if(this->mapping_bytes < 4)
+    {
+        close(fd);
+        throw std::runtime_error("Invalid IDX file " + path);
+    }
+    this->mapping = mmap(nullptr, this->mapping_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    close(fd);
+    if(this->mapping == MAP_FAILED)
+    {
+        this->mapping = nullptr;
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    // The header is two zero bytes, the type, the number of dimensions and then every
+    // dimension as a big-endian uint32
+    const uint8_t *bytes = static_cast<const uint8_t *>(this->mapping);
+    size_t ndim = bytes[3];
+    size_t header_bytes = 4 + 4 * ndim;
+    try
+    {
+        if(bytes[0] != 0 || bytes[1] != 0 || this->mapping_bytes < header_bytes)
+            throw std::runtime_error("Invalid IDX file " + path);
+        this->dtype = IdxDataType(bytes[2], path);
+        for(size_t i = 0; i < ndim; i++)
+            this->shape.push_back(static_cast<dim_t>(ReadBigEndian32(bytes + 4 + 4 * i)));
+        size_t num_elts = std::accumulate(this->shape.begin(), this->shape.end(), dim_t{1}, std::multiplies{});
+        if(this->mapping_bytes < header_bytes + num_elts * SizeOf(this->dtype))
+            throw std::runtime_error("IDX file " + path + " is shorter than its header says");
+    }
+    catch(...)
+    {
+        munmap(this->mapping, this->mapping_bytes);
+        throw;
+    }
+    this->data = bytes + header_bytes;
+    madvise(this->mapping, this->mapping_bytes, MADV_WILLNEED);
+}
+
+IdxFile::~IdxFile()
+{
+    if(this->mapping)
+        munmap(this->mapping, this->mapping_bytes);
+}
+
+size_t IdxFile::ExampleBytes() const
+{
+    if(this->shape.empty())
+        return SizeOf(this->dtype);
+    return std::accumulate(this->shape.begin() + 1, this->shape.end(), dim_t{1}, std::multiplies{}) * SizeOf(this->dtype);
+}
+
+IdxBatchLoader::IdxBatchLoader(const std::string &inputs_path, const std::string &labels_path, IdxBatchLoaderOptions options)
+    : inputs(inputs_path),
+      labels(labels_path),
+      options(options)
+{
+    if(this->options.batch_size == 0 || this->options.num_buffers == 0)
+        throw std::domain_error("Batches and the ring of buffers must not be empty");
+    if(this->inputs.shape.empty() || this->labels.NumExamples() != this->inputs.NumExamples())
+        throw std::domain_error("Inputs and labels must have the same number of examples");
+    if(this->labels.ExampleBytes() != SizeOf(this->labels.dtype))
+        throw std::domain_error("Every example must have one label");
+    if(this->NumBatches() == 0)
+        throw std::domain_error("Dataset has no full batch");
+    for(size_t i = 0; i < this->labels.NumExamples(); i++)
+    {
+        int64_t label = ReadBigEndianInt(this->labels.data + i * this->labels.ExampleBytes(), this->labels.dtype);
+        if(label < 0 || label >= static_cast<int64_t>(this->options.num_classes))
+            throw std::domain_error("Label " + std::to_string(label) + " is not a valid class");
+    }
+
+    this->buffers.resize(this->options.num_buffers);
+    for(Buffer &buffer : this->buffers)
+    {
+        buffer.inputs.resize(this->options.batch_size * this->inputs.ExampleBytes());
+        buffer.labels.resize(this->options.batch_size * this->options.num_classes);
+    }
+    this->producer = std::thread([this]() { this->Produce(); });
+}
+
+IdxBatchLoader::~IdxBatchLoader()
+{
+    this->stop = true;
+    this->released++;
+    this->released.notify_one();
+    this->producer.join();
+}
+
+size_t IdxBatchLoader::NumBatches() const
+{
+    size_t num_examples = this->inputs.NumExamples();
+    if(this->options.drop_last)
+        return num_examples / this->options.batch_size;
+    return (num_examples + this->options.batch_size - 1) / this->options.batch_size;
+}
+
+void IdxBatchLoader::Produce()
+{
+    std::mt19937_64 gen(this->options.seed);
+    std::vector<size_t> order(this->inputs.NumExamples());
+    std::iota(order.begin(), order.end(), 0);
+    size_t example_bytes = this->inputs.ExampleBytes();
+    size_t label_bytes = this->labels.ExampleBytes();
+    size_t num_classes = this->options.num_classes;
+    for(size_t epoch = 0; ; epoch++)
+    {
+        if(this->options.shuffle)
+            std::shuffle(order.begin(), order.end(), gen);
+        for(size_t ibatch = 0; ibatch < this->NumBatches(); ibatch++)
+        {
+            // Wait until the consumer has released the batch that last used this buffer
+            size_t batch = this->produced.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                size_t released = this->released.load(std::memory_order_acquire);
+                if(this->stop)
+                    return;
+                if(batch - released < this->buffers.size())
+                    break;
+                this->released.wait(released);
+            }
+
+            Buffer &buffer = this->buffers[batch % this->buffers.size()];
+            size_t first = ibatch * this->options.batch_size;
+            buffer.size = std::min(this->options.batch_size, order.size() - first);
+            buffer.epoch = epoch;
+            std::fill(buffer.labels.begin(), buffer.labels.end(), 0.0f);
+            for(size_t i = 0; i < buffer.size; i++)
+            {
+                size_t example = order[first + i];
+                CopyToHostOrder(
+                    buffer.inputs.data() + i * example_bytes,
+                    this->inputs.data + example * example_bytes,
+                    example_bytes,
+                    SizeOf(this->inputs.dtype));
+                int64_t label = ReadBigEndianInt(this->labels.data + example * label_bytes, this->labels.dtype);
+                buffer.labels[i * num_classes + label] = 1.0f;
+            }
+            this->produced.store(batch + 1, std::memory_order_release);
+            this->produced.notify_one();
+        }
+    }
+}
+
+IdxBatchLoader::Batch IdxBatchLoader::Next()
+{
+    size_t batch = this->released.load(std::memory_order_relaxed);
+    if(this->holding)
+    {
+        batch++;
+        this->released.store(batch, std::memory_order_release);
+        this->released.notify_one();
+    }
+    for(size_t produced = this->produced.load(std::memory_order_acquire);
+        produced <= batch;
+        produced = this->produced.load(std::memory_order_acquire))
+    {
+        this->produced.wait(produced);
+    }
+    this->holding = true;
+    Buffer &buffer = this->buffers[batch % this->buffers.size()];
+    return { buffer.inputs.data(), buffer.labels.data(), buffer.size, buffer.epoch };
+}
+
+}
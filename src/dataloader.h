@@ -0,0 +1,94 @@
+#pragma once
+
+#include "graph.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace gigagrad
+{
+
+// A dataset file in the IDX format, mapped into memory. Pages are only read when they are
+// first touched.
+struct IdxFile
+{
+    explicit IdxFile(const std::string &path);
+    ~IdxFile();
+    IdxFile(const IdxFile &) = delete;
+    IdxFile &operator=(const IdxFile &) = delete;
+
+    size_t NumExamples() const { return shape.empty() ? 1 : static_cast<size_t>(shape[0]); }
+    size_t ExampleBytes() const; // Size of one element along dimension 0
+
+    DataType dtype;
+    Shape shape;
+    const uint8_t *data; // Big-endian values, as stored in the file
+    void *mapping = nullptr;
+    size_t mapping_bytes = 0;
+};
+
+struct IdxBatchLoaderOptions
+{
+    size_t batch_size;
+    size_t num_classes; // Labels are one-hot encoded into this many floats
+    bool shuffle = true; // Every epoch visits the examples in a new random order
+    bool drop_last = false; // Skips the last batch of an epoch if it isn't full
+    uint64_t seed = 0;
+    size_t num_buffers = 4; // Batches that are decoded ahead of the one being trained on
+};
+
+// Streams batches of examples and one-hot labels from a pair of IDX files. A background thread
+// decodes batches into a ring of buffers ahead of time and hands them to Next() through a
+// lock-free single producer, single consumer queue. Inputs keep the type of the file, in host
+// byte order, so they can be bound to an input of that type directly.
+struct IdxBatchLoader
+{
+    struct Batch
+    {
+        void *inputs;
+        float *labels;
+        size_t size; // Number of examples, at most batch_size
+        size_t epoch;
+    };
+
+    IdxBatchLoader(const std::string &inputs_path, const std::string &labels_path, IdxBatchLoaderOptions options);
+    ~IdxBatchLoader();
+
+    // Returns the next batch, waiting only if the background thread is behind. The batch
+    // stays valid until the next call.
+    Batch Next();
+
+    size_t NumBatches() const; // Per epoch
+    DataType InputType() const { return inputs.dtype; }
+    Shape ExampleShape() const { return Shape(inputs.shape.begin() + 1, inputs.shape.end()); }
+
+    struct Buffer
+    {
+        std::vector<uint8_t> inputs;
+        std::vector<float> labels;
+        size_t size;
+        size_t epoch;
+    };
+
+    void Produce();
+
+    IdxFile inputs;
+    IdxFile labels;
+    IdxBatchLoaderOptions options;
+    std::vector<Buffer> buffers;
+
+    // Batches decoded and handed back so far. Buffer i % buffers.size() holds batch i. Once
+    // Next() has returned a batch, the consumer holds batch released until the next call.
+    std::atomic<size_t> produced = 0;
+    std::atomic<size_t> released = 0;
+    bool holding = false;
+    std::atomic<bool> stop = false;
+    std::thread producer;
+};
+
+}
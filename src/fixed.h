@@ -0,0 +1,354 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// Header-only networks of fixed shape. Shapes are template parameters, and the operators build
+// expression templates instead of graph nodes, so the C++ compiler fuses every expression into
+// one loop at build time and no code is generated or compiled at run time. Elementwise
+// operands broadcast like in Graph. Every element of an expression is computed on demand, so
+// materialize values read more than once, like the operands of a matmul, into an Array.
+namespace gigagrad
+{
+namespace fixed
+{
+
+using dim_t = std::ptrdiff_t;
+
+template <dim_t... Dims>
+struct Extents
+{
+    static_assert(((Dims > 0) && ...), "Dimensions must be positive");
+    static constexpr size_t rank = sizeof...(Dims);
+    static constexpr std::array<dim_t, rank> dims = { Dims... };
+    static constexpr size_t size = (size_t{1} * ... * static_cast<size_t>(Dims));
+};
+
+namespace detail
+{
+
+// Builds Extents from a constexpr array of dimensions
+template <auto Dims, size_t... I>
+Extents<Dims[I]...> MakeExtents(std::index_sequence<I...>);
+
+template <auto Dims>
+using ExtentsOf = decltype(MakeExtents<Dims>(std::make_index_sequence<Dims.size()>{}));
+
+template <typename X, typename Y>
+constexpr auto BroadcastDims()
+{
+    constexpr size_t rank = std::max(X::rank, Y::rank);
+    std::array<dim_t, rank> dims = {};
+    for(size_t i = 0; i < rank; i++)
+    {
+        dim_t x = i < X::rank ? X::dims[X::rank - 1 - i] : 1;
+        dim_t y = i < Y::rank ? Y::dims[Y::rank - 1 - i] : 1;
+        if(x != y && x != 1 && y != 1)
+            throw "Shapes cannot be broadcast"; // Not a constant expression, so fails to compile
+        dims[rank - 1 - i] = std::max(x, y);
+    }
+    return dims;
+}
+
+template <typename X, size_t Axis>
+constexpr auto ReducedDims()
+{
+    std::array<dim_t, X::rank - 1> dims = {};
+    for(size_t i = 0, j = 0; i < X::rank; i++)
+    {
+        if(i != Axis)
+            dims[j++] = X::dims[i];
+    }
+    return dims;
+}
+
+// Index of element i of an expression of extents To in an operand of extents From that is
+// broadcast to To. Dimensions are known at compile time, so this compiles to multiplications.
+template <typename From, typename To>
+constexpr size_t BroadcastIndex(size_t i)
+{
+    if constexpr(std::is_same_v<From, To>)
+    {
+        return i;
+    }
+    else
+    {
+        size_t result = 0;
+        size_t from_stride = 1;
+        for(size_t d = 0; d < From::rank; d++)
+        {
+            size_t to_dim = static_cast<size_t>(To::dims[To::rank - 1 - d]);
+            size_t from_dim = static_cast<size_t>(From::dims[From::rank - 1 - d]);
+            size_t coord = i % to_dim;
+            i /= to_dim;
+            if(from_dim != 1)
+                result += coord * from_stride;
+            from_stride *= from_dim;
+        }
+        return result;
+    }
+}
+
+}
+
+// Every expression derives from ExpressionBase, has a member type extents and returns its
+// elements in row-major order from operator[]
+struct ExpressionBase
+{
+};
+
+template <typename T>
+concept Expression = std::derived_from<T, ExpressionBase>;
+
+template <typename T>
+struct IsArray : std::false_type
+{
+};
+
+// Arrays are held by reference and must outlive the expressions that read them. Everything
+// else is small and held by value.
+template <typename T>
+using Operand = std::conditional_t<IsArray<T>::value, const T &, T>;
+
+// Reads data that is owned elsewhere, like the inputs and weights of a network
+template <dim_t... Dims>
+struct Input : ExpressionBase
+{
+    using extents = Extents<Dims...>;
+
+    float operator[](size_t i) const { return data[i]; }
+
+    const float *data;
+};
+
+// Stores the values of an expression
+template <dim_t... Dims>
+struct Array : ExpressionBase
+{
+    using extents = Extents<Dims...>;
+
+    Array() = default;
+
+    template <Expression TExpr>
+    Array(const TExpr &expr)
+    {
+        static_assert(std::is_same_v<typename TExpr::extents, extents>, "Array must have the shape of the expression");
+        for(size_t i = 0; i < extents::size; i++)
+            values[i] = expr[i];
+    }
+
+    float operator[](size_t i) const { return values[i]; }
+    float *data() { return values.data(); }
+
+    std::array<float, extents::size> values;
+};
+
+template <dim_t... Dims>
+struct IsArray<Array<Dims...>> : std::true_type
+{
+};
+
+struct Immediate : ExpressionBase
+{
+    using extents = Extents<>;
+
+    float operator[](size_t) const { return value; }
+
+    float value;
+};
+
+// Numbers become immediates, expressions keep their type
+template <typename T>
+using AsExpression = std::conditional_t<Expression<T>, std::remove_cvref_t<T>, Immediate>;
+
+template <typename T>
+Operand<AsExpression<T>> ToOperand(const T &x)
+{
+    if constexpr(Expression<T>)
+        return x;
+    else
+        return Immediate{ {}, static_cast<float>(x) };
+}
+
+template <typename TOp, typename X>
+struct UnaryOp : ExpressionBase
+{
+    using extents = typename X::extents;
+
+    float operator[](size_t i) const { return TOp{}(x[i]); }
+
+    Operand<X> x;
+};
+
+template <typename TOp, typename X, typename Y>
+struct BinaryOp : ExpressionBase
+{
+    using x_extents = typename X::extents;
+    using y_extents = typename Y::extents;
+    using extents = detail::ExtentsOf<detail::BroadcastDims<x_extents, y_extents>()>;
+
+    float operator[](size_t i) const
+    {
+        return TOp{}(
+            x[detail::BroadcastIndex<x_extents, extents>(i)],
+            y[detail::BroadcastIndex<y_extents, extents>(i)]);
+    }
+
+    Operand<X> x;
+    Operand<Y> y;
+};
+
+// Reduces dimension Axis of x
+template <typename TOp, size_t Axis, typename X>
+struct ReduceOp : ExpressionBase
+{
+    using x_extents = typename X::extents;
+    static_assert(Axis < x_extents::rank, "Reduced axis is out of range");
+    using extents = detail::ExtentsOf<detail::ReducedDims<x_extents, Axis>()>;
+
+    float operator[](size_t i) const
+    {
+        constexpr size_t length = static_cast<size_t>(x_extents::dims[Axis]);
+        constexpr size_t inner = [] {
+            size_t size = 1;
+            for(size_t d = Axis + 1; d < x_extents::rank; d++)
+                size *= static_cast<size_t>(x_extents::dims[d]);
+            return size;
+        }();
+        size_t base = i / inner * length * inner + i % inner;
+        float accumulator = x[base];
+        for(size_t k = 1; k < length; k++)
+            accumulator = TOp{}(accumulator, x[base + k * inner]);
+        return accumulator;
+    }
+
+    Operand<X> x;
+};
+
+// Reads the elements of x in the same order with another shape
+template <typename X, dim_t... Dims>
+struct ReshapeOp : ExpressionBase
+{
+    using extents = Extents<Dims...>;
+    static_assert(extents::size == X::extents::size, "Reshape must keep the number of elements");
+
+    float operator[](size_t i) const { return x[i]; }
+
+    Operand<X> x;
+};
+
+template <typename X, typename Y>
+struct MatmulOp : ExpressionBase
+{
+    using x_extents = typename X::extents;
+    using y_extents = typename Y::extents;
+    static_assert(x_extents::rank == 2 && y_extents::rank == 2, "Matmul operands must be matrices");
+    static_assert(x_extents::dims[1] == y_extents::dims[0], "Matmul operands have incompatible shapes");
+    using extents = Extents<x_extents::dims[0], y_extents::dims[1]>;
+
+    float operator[](size_t i) const
+    {
+        constexpr size_t K = static_cast<size_t>(x_extents::dims[1]);
+        constexpr size_t N = static_cast<size_t>(y_extents::dims[1]);
+        size_t row = i / N, col = i % N;
+        float accumulator = 0.0f;
+        for(size_t k = 0; k < K; k++)
+            accumulator += x[row * K + k] * y[k * N + col];
+        return accumulator;
+    }
+
+    Operand<X> x;
+    Operand<Y> y;
+};
+
+struct Add { float operator()(float x, float y) const { return x + y; } };
+struct Sub { float operator()(float x, float y) const { return x - y; } };
+struct Mul { float operator()(float x, float y) const { return x * y; } };
+struct Div { float operator()(float x, float y) const { return x / y; } };
+struct Max { float operator()(float x, float y) const { return std::max(x, y); } };
+struct Min { float operator()(float x, float y) const { return std::min(x, y); } };
+struct Pow { float operator()(float x, float y) const { return std::pow(x, y); } };
+struct Exp { float operator()(float x) const { return std::exp(x); } };
+struct Log { float operator()(float x) const { return std::log(x); } };
+struct Sqrt { float operator()(float x) const { return std::sqrt(x); } };
+struct Sin { float operator()(float x) const { return std::sin(x); } };
+struct Cos { float operator()(float x) const { return std::cos(x); } };
+struct Neg { float operator()(float x) const { return -x; } };
+struct Relu { float operator()(float x) const { return std::max(x, 0.0f); } };
+struct Sigmoid { float operator()(float x) const { return 1.0f / (1.0f + std::exp(-x)); } };
+
+// At least one operand of a binary operator must be an expression, the other may be a number
+template <typename X, typename Y>
+concept BinaryOperands = (Expression<X> || std::is_arithmetic_v<X>)
+    && (Expression<Y> || std::is_arithmetic_v<Y>)
+    && (Expression<X> || Expression<Y>);
+
+template <typename TOp, typename X, typename Y>
+auto MakeBinary(const X &x, const Y &y)
+{
+    return BinaryOp<TOp, AsExpression<X>, AsExpression<Y>>{ {}, ToOperand(x), ToOperand(y) };
+}
+
+template <typename X, typename Y> requires BinaryOperands<X, Y>
+auto operator+(const X &x, const Y &y) { return MakeBinary<Add>(x, y); }
+template <typename X, typename Y> requires BinaryOperands<X, Y>
+auto operator-(const X &x, const Y &y) { return MakeBinary<Sub>(x, y); }
+template <typename X, typename Y> requires BinaryOperands<X, Y>
+auto operator*(const X &x, const Y &y) { return MakeBinary<Mul>(x, y); }
+template <typename X, typename Y> requires BinaryOperands<X, Y>
+auto operator/(const X &x, const Y &y) { return MakeBinary<Div>(x, y); }
+template <typename X, typename Y> requires BinaryOperands<X, Y>
+auto max(const X &x, const Y &y) { return MakeBinary<Max>(x, y); }
+template <typename X, typename Y> requires BinaryOperands<X, Y>
+auto min(const X &x, const Y &y) { return MakeBinary<Min>(x, y); }
+template <typename X, typename Y> requires BinaryOperands<X, Y>
+auto pow(const X &x, const Y &y) { return MakeBinary<Pow>(x, y); }
+
+template <Expression X>
+auto operator-(const X &x) { return UnaryOp<Neg, X>{ {}, x }; }
+template <Expression X>
+auto exp(const X &x) { return UnaryOp<Exp, X>{ {}, x }; }
+template <Expression X>
+auto log(const X &x) { return UnaryOp<Log, X>{ {}, x }; }
+template <Expression X>
+auto sqrt(const X &x) { return UnaryOp<Sqrt, X>{ {}, x }; }
+template <Expression X>
+auto sin(const X &x) { return UnaryOp<Sin, X>{ {}, x }; }
+template <Expression X>
+auto cos(const X &x) { return UnaryOp<Cos, X>{ {}, x }; }
+template <Expression X>
+auto relu(const X &x) { return UnaryOp<Relu, X>{ {}, x }; }
+template <Expression X>
+auto sigmoid(const X &x) { return UnaryOp<Sigmoid, X>{ {}, x }; }
+
+template <size_t Axis, Expression X>
+auto sum(const X &x) { return ReduceOp<Add, Axis, X>{ {}, x }; }
+template <size_t Axis, Expression X>
+auto max(const X &x) { return ReduceOp<Max, Axis, X>{ {}, x }; }
+template <size_t Axis, Expression X>
+auto min(const X &x) { return ReduceOp<Min, Axis, X>{ {}, x }; }
+
+template <dim_t... Dims, Expression X>
+auto reshape(const X &x) { return ReshapeOp<X, Dims...>{ {}, x }; }
+
+template <Expression X, Expression Y>
+auto matmul(const X &x, const Y &y) { return MatmulOp<X, Y>{ {}, x, y }; }
+template <Expression X, Expression Y>
+auto operator%(const X &x, const Y &y) { return matmul(x, y); }
+
+// Writes the elements of expr to output in one fused loop
+template <Expression TExpr>
+void Evaluate(const TExpr &expr, float *output)
+{
+    for(size_t i = 0; i < TExpr::extents::size; i++)
+        output[i] = expr[i];
+}
+
+}
+}
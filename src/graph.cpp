@@ -79,6 +79,34 @@ static Shape ComputeReducedShape(const ReduceOp &op)
     return shape;
 }
 
+// Whether operand carries the batch dimension into the leading dimension of a broadcast of
+// the given shape
+static bool IsBatchedOperand(GraphNodeHandle operand, const Shape &broadcasted_shape)
+{
+    if(!operand->batched)
+        return false;
+    if(operand.shape().size() != broadcasted_shape.size())
+        throw std::domain_error("Broadcasting must keep the batch dimension leading");
+    return true;
+}
+
+// The ragged offsets that a broadcast of x and y to the given shape follows, if any
+static std::optional<size_t> BroadcastRagged(GraphNodeHandle x, GraphNodeHandle y, const Shape &broadcasted_shape)
+{
+    std::optional<size_t> ragged;
+    for(GraphNodeHandle operand : { x, y })
+    {
+        if(!operand->ragged)
+            continue;
+        if(operand.shape().size() != broadcasted_shape.size())
+            throw std::domain_error("Broadcasting must keep the ragged dimension second");
+        if(ragged && ragged != operand->ragged)
+            throw std::domain_error("Cannot combine ragged tensors with different offsets");
+        ragged = operand->ragged;
+    }
+    return ragged;
+}
+
 static GraphNodeHandle WrapInUnary(GraphNodeHandle x, UnaryOpType type)
 {
     Graph *graph = x.graph;
@@ -218,6 +246,11 @@ GraphNodeHandle GraphNodeHandle::relu() const
     return gigagrad::relu(GraphNodeHandle{*this});
 }
 
+GraphNodeHandle GraphNodeHandle::cast(DataType dtype) const
+{
+    return gigagrad::cast(GraphNodeHandle{*this}, dtype);
+}
+
 GraphNodeHandle GraphNodeHandle::softmax(dim_t axis) const
 {
     return gigagrad::softmax(GraphNodeHandle{*this}, axis);
@@ -299,6 +332,13 @@ GraphNodeHandle sigmoid(GraphNodeHandle x)
     return expx / (1 + expx);
 }
 
+GraphNodeHandle cast(GraphNodeHandle x, DataType dtype)
+{
+    GraphNodeHandle result = WrapInUnary(x, UnaryOpType::CAST);
+    result->dtype = dtype;
+    return result;
+}
+
 GraphNodeHandle operator-(GraphNodeHandle x)
 {
     return 0 - x;
@@ -330,7 +370,9 @@ GraphNodeHandle operator-(GraphNodeHandle x, GraphNodeHandle y)
 
 GraphNodeHandle operator-(float x, GraphNodeHandle y)
 {
-    return (-x) + y;
+    Graph *graph = y.graph;
+    GraphNodeHandle xnode = graph->AddNode(Immediate{x});
+    return xnode - y;
 }
 
 GraphNodeHandle operator-(GraphNodeHandle x, float y)
@@ -575,6 +617,9 @@ GraphNodeHandle min(GraphNodeHandle x, Dims dims, bool keepdim)
 GraphNodeHandle mean(GraphNodeHandle x, dim_t axis, bool keepdim)
 {
     axis = FixDim(axis, x.shape().size());
+    // The size of the batch dimension is only known at run time
+    if(axis == 0 && x->batched)
+        return x.sum(axis, keepdim) / x.graph->BatchSize();
     float denom = x.shape()[axis];
     GraphNodeHandle div = x / denom;
     GraphNodeHandle result = div.sum(axis, keepdim);
@@ -637,10 +682,11 @@ GraphNodeHandle Graph::Immediate(float imm)
     return this->AddNode(gigagrad::Immediate{imm});
 }
 
-GraphNodeHandle Graph::AddInput(Shape shape)
+GraphNodeHandle Graph::AddInput(Shape shape, DataType dtype)
 {
     this->inputs.push_back(this->nodes.size());
     GraphNodeHandle result = this->AddNode(Tensor{}, std::move(shape));
+    result->dtype = dtype;
     return result;
 }
 
@@ -649,6 +695,51 @@ GraphNodeHandle Graph::AddInput(dim_t dim)
     return this->AddInput(Shape{dim});
 }
 
+GraphNodeHandle Graph::AddInput(BatchDim batch, Shape shape, DataType dtype)
+{
+    if(batch.max_size <= 0)
+        throw std::domain_error("Batch dimension must have a positive maximum size");
+    if(this->max_batch_size != 0 && this->max_batch_size != batch.max_size)
+        throw std::domain_error("All batched inputs of a graph must have the same maximum batch size");
+    this->max_batch_size = batch.max_size;
+    shape.insert(shape.begin(), batch.max_size);
+    GraphNodeHandle result = this->AddInput(std::move(shape), dtype);
+    result->batched = true;
+    return result;
+}
+
+RaggedInput Graph::AddRaggedInput(dim_t rows, dim_t max_length, Shape shape)
+{
+    GraphNodeHandle offsets = this->AddInput(Shape{ rows + 1 }, DataType::I64);
+    shape.insert(shape.begin(), { rows, max_length });
+    GraphNodeHandle values = this->AddInput(std::move(shape));
+    values->ragged = offsets.node_idx;
+    return { values, offsets };
+}
+
+IndexedInput Graph::AddIndexedInput(BatchDim batch, Shape shape, DataType dtype)
+{
+    GraphNodeHandle indices = this->AddInput(Shape{ batch.max_size }, DataType::I64);
+    GraphNodeHandle values = this->AddInput(batch, std::move(shape), dtype);
+    values->gather = indices.node_idx;
+    return { values, indices };
+}
+
+GraphNodeHandle Graph::AddParameter(float value)
+{
+    float &storage = this->parameters.emplace_back(value);
+    GraphNodeHandle result = this->AddInput(Shape{});
+    result.data() = &storage;
+    return result;
+}
+
+GraphNodeHandle Graph::BatchSize()
+{
+    if(!this->batch_size_node)
+        this->batch_size_node = this->AddParameter(static_cast<float>(this->max_batch_size)).node_idx;
+    return { this, *this->batch_size_node };
+}
+
 GraphNodeHandle Graph::AddNode(Tensor tensor, Shape shape)
 {
     Shape strides = ComputeStrides(shape);
@@ -680,6 +771,8 @@ GraphNodeHandle Graph::AddNode(UnaryOp op)
             .u = { std::move(op) },
             .shape = op.x.shape(),
             .strides = op.x.strides(),
+            .batched = op.x->batched,
+            .ragged = op.x->ragged,
         });
 }
 
@@ -687,12 +780,16 @@ GraphNodeHandle Graph::AddNode(BinaryOp op)
 {
     Shape shape = ComputeBroadcastedShape(op.x.shape(), op.y.shape());
     Shape strides = ComputeStrides(shape);
+    bool batched = IsBatchedOperand(op.x, shape) || IsBatchedOperand(op.y, shape);
+    std::optional<size_t> ragged = BroadcastRagged(op.x, op.y, shape);
     return this->AddNode(
         GraphNode
         {
             .u = { std::move(op) },
             .shape = std::move(shape),
             .strides = std::move(strides), 
+            .batched = batched,
+            .ragged = ragged,
         });
 }
 
@@ -700,12 +797,29 @@ GraphNodeHandle Graph::AddNode(ReduceOp op)
 {
     Shape shape = ComputeReducedShape(op);
     Shape strides = ComputeStrides(shape);
+    // dims is sorted, and empty dims reduce over everything
+    bool batched = op.x->batched && !op.dims.empty() && op.dims[0] != 0;
+
+    // The length of a ragged row is only known inside the loop over rows, so reducing over
+    // rows also needs to reduce over the ragged dimension
+    std::optional<size_t> ragged;
+    if(op.x->ragged)
+    {
+        bool reduces_rows = op.dims.empty() || op.dims[0] == 0;
+        bool reduces_ragged = op.dims.empty() || std::find(op.dims.begin(), op.dims.end(), 1) != op.dims.end();
+        if(reduces_rows && !reduces_ragged)
+            throw std::domain_error("Reductions over the rows of a ragged tensor must also reduce over dimension 1");
+        if(!reduces_rows && !reduces_ragged)
+            ragged = op.x->ragged;
+    }
     return this->AddNode(
         GraphNode
         {
             .u = { std::move(op) },
             .shape = std::move(shape),
             .strides = std::move(strides),
+            .batched = batched,
+            .ragged = ragged,
         });
 }
 
@@ -714,6 +828,23 @@ GraphNodeHandle Graph::AddNode(ViewOp op)
     if(op.shape.empty())
         throw std::logic_error("ViewOp has empty shape");
 
+    // A view keeps the batch dimension if its leading dimension walks the rows of its input
+    bool batched = false;
+    if(op.x->batched)
+    {
+        if(op.shape[0] != op.x.shape()[0] || op.strides[0] != op.x.strides()[0])
+            throw std::domain_error("Views of batched tensors must keep the batch dimension leading");
+        batched = true;
+    }
+    if(op.x->ragged)
+    {
+        if(op.shape.size() < 2
+           || op.shape[0] != op.x.shape()[0] || op.strides[0] != op.x.strides()[0]
+           || op.shape[1] != op.x.shape()[1] || op.strides[1] != op.x.strides()[1])
+            throw std::domain_error("Views of ragged tensors must keep their first two dimensions");
+    }
+    std::optional<size_t> ragged = op.x->ragged;
+
     Shape shape = op.shape;
     Shape strides = ComputeStrides(op.shape);
     return this->AddNode(
@@ -722,6 +853,8 @@ GraphNodeHandle Graph::AddNode(ViewOp op)
             .u = { std::move(op) },
             .shape = std::move(shape),
             .strides = std::move(strides),
+            .batched = batched,
+            .ragged = ragged,
         });
 }
 
@@ -767,9 +900,9 @@ GraphNodeHandle nn::Module::Immediate(float imm)
     return this->graph.Immediate(imm);
 }
 
-GraphNodeHandle nn::Module::AddInput(Shape shape)
+GraphNodeHandle nn::Module::AddInput(Shape shape, DataType dtype)
 {
-    return this->graph.AddInput(std::move(shape));
+    return this->graph.AddInput(std::move(shape), dtype);
 }
 
 GraphNodeHandle nn::Module::AddInput(dim_t dim)
@@ -777,16 +910,40 @@ GraphNodeHandle nn::Module::AddInput(dim_t dim)
     return this->graph.AddInput(dim);
 }
 
-GraphNodeHandle nn::Module::AddWeight(Shape shape)
+GraphNodeHandle nn::Module::AddInput(BatchDim batch, Shape shape, DataType dtype)
 {
+    return this->graph.AddInput(batch, std::move(shape), dtype);
+}
+
+RaggedInput nn::Module::AddRaggedInput(dim_t rows, dim_t max_length, Shape shape)
+{
+    return this->graph.AddRaggedInput(rows, max_length, std::move(shape));
+}
+
+IndexedInput nn::Module::AddIndexedInput(BatchDim batch, Shape shape, DataType dtype)
+{
+    return this->graph.AddIndexedInput(batch, std::move(shape), dtype);
+}
+
+GraphNodeHandle nn::Module::AddParameter(float value)
+{
+    return this->graph.AddParameter(value);
+}
+
+GraphNodeHandle nn::Module::AddWeight(Shape shape, std::string name)
+{
+    if(name.empty())
+        name = "weight" + std::to_string(this->weights.size());
+    if(std::find(this->weight_names.begin(), this->weight_names.end(), name) != this->weight_names.end())
+        throw std::domain_error("Duplicate weight name " + name);
     this->weights.push_back(this->graph.inputs.size());
+    this->weight_names.push_back(std::move(name));
     return this->graph.AddInput(std::move(shape));
 }
 
-GraphNodeHandle nn::Module::AddWeight(dim_t dim)
+GraphNodeHandle nn::Module::AddWeight(dim_t dim, std::string name)
 {
-    this->weights.push_back(this->graph.inputs.size());
-    return this->graph.AddInput(dim);
+    return this->AddWeight(Shape{ dim }, std::move(name));
 }
 
 GraphNode::U::U(const U &that) : k({ that.k.kind })
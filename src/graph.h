@@ -5,6 +5,7 @@
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string>
 #include <variant>
 #include <vector>
 
@@ -25,13 +26,49 @@ using dim_t = ssize_t;
 using Shape = std::vector<dim_t>;
 using Dims = std::vector<dim_t>;
 
+// Leading dimension of an input whose size is only chosen at run time, up to max_size. Buffers
+// are sized for max_size, and kernels loop over as many rows as the batch size set on the backend.
+struct BatchDim
+{
+    dim_t max_size;
+};
+
+struct RaggedInput;
+struct IndexedInput;
+
+// Type that values are stored as in memory. Kernels always compute in float, and convert when
+// loading and storing.
+enum class DataType
+{
+    F32,
+    F16,
+    BF16, // The upper half of an F32
+    I8, // Quantized values, rounded and clamped to [-127, 127] when storing
+    // Integers, e.g. raw input data. Stores round to nearest and saturate.
+    U8,
+    I16,
+    I32,
+    I64,
+};
+
+constexpr size_t SizeOf(DataType dtype)
+{
+    return dtype == DataType::F32 || dtype == DataType::I32 ? 4
+        : dtype == DataType::I8 || dtype == DataType::U8 ? 1
+        : dtype == DataType::I64 ? 8
+        : 2;
+}
+
 struct CompiledTensor
 {
     float *data;
-    Shape shape;
+    Shape shape; // The leading dimension is the maximum batch size if the tensor is batched
     std::unique_ptr<codegen::Backend> backend;
+    std::vector<std::unique_ptr<float[]>> constants; // Backing memory of tensors computed at compile time
 
+    void SetBatchSize(dim_t batch_size) { backend->SetBatchSize(batch_size); }
     void Execute() { backend->Execute(); }
+    std::future<void> ExecuteAsync() { return backend->ExecuteAsync(); }
 };
 
 struct GraphNodeHandle
@@ -54,6 +91,7 @@ struct GraphNodeHandle
     GraphNodeHandle as_strided(Shape shape, Shape strides, dim_t offset) const;
 
     GraphNodeHandle relu() const;
+    GraphNodeHandle cast(DataType dtype) const;
     GraphNodeHandle softmax(dim_t axis = -1) const;
     GraphNodeHandle mean(dim_t axis = 0, bool keepdim = false) const;
     GraphNodeHandle variance(dim_t axis = 0, bool keepdim = false) const;
@@ -207,6 +245,14 @@ struct GraphNode
     Shape shape;
     Shape strides;
     bool needs_gradient = true;
+    DataType dtype = DataType::F32; // Storage type of the node's values whenever they are materialized
+    bool batched = false; // The leading dimension is the batch dimension of a BatchDim input
+    // Node index of the offsets of a ragged input. Dimension 1 of this node only has as many
+    // valid elements per row as that input, the rest is padding that kernels skip.
+    std::optional<size_t> ragged;
+    // Node index of the row indices of an indexed input. Row r of this tensor is row indices[r]
+    // of the data bound to it.
+    std::optional<size_t> gather;
 };
 
 GraphNodeHandle sqrt(GraphNodeHandle x);
@@ -215,6 +261,8 @@ GraphNodeHandle log(GraphNodeHandle x);
 GraphNodeHandle sin(GraphNodeHandle x);
 GraphNodeHandle cos(GraphNodeHandle x);
 GraphNodeHandle sigmoid(GraphNodeHandle x);
+// Rounds the values of x to what dtype can hold. They are stored as dtype when materialized.
+GraphNodeHandle cast(GraphNodeHandle x, DataType dtype);
 GraphNodeHandle operator-(GraphNodeHandle x);
 
 GraphNodeHandle operator+(GraphNodeHandle x, GraphNodeHandle y);
@@ -282,8 +330,21 @@ GraphNodeHandle matmul(GraphNodeHandle x, GraphNodeHandle y);
 struct Graph
 {
     GraphNodeHandle Immediate(float imm);
-    GraphNodeHandle AddInput(Shape shape);
+    // Inputs hold values of type dtype, which kernels convert to float when loading them. Their
+    // data pointer points at the raw values, e.g. bytes for U8.
+    GraphNodeHandle AddInput(Shape shape, DataType dtype = DataType::F32);
     GraphNodeHandle AddInput(dim_t dim);
+    // Input of shape { batch, shape... }. All batched inputs of a graph share one batch size.
+    GraphNodeHandle AddInput(BatchDim batch, Shape shape, DataType dtype = DataType::F32);
+    // Scalar input owned by the graph. Unlike an Immediate, kernels read its value at runtime,
+    // so it can be changed between executions without recompiling.
+    GraphNodeHandle AddParameter(float value);
+    // Parameter holding the current batch size, which Backend::SetBatchSize keeps up to date
+    GraphNodeHandle BatchSize();
+    // Input of shape { rows, max_length, shape... } with rows of different lengths, see RaggedInput
+    RaggedInput AddRaggedInput(dim_t rows, dim_t max_length, Shape shape = {});
+    // Input of shape { batch, shape... } whose rows are gathered from a dataset, see IndexedInput
+    IndexedInput AddIndexedInput(BatchDim batch, Shape shape, DataType dtype = DataType::F32);
 
     GraphNodeHandle AddNode(struct Tensor, Shape shape);
     GraphNodeHandle AddNode(struct Immediate);
@@ -296,6 +357,39 @@ struct Graph
 
     std::vector<size_t> inputs;
     std::deque<GraphNode> nodes;
+    std::deque<float> parameters; // Backing storage of parameters
+    dim_t max_batch_size = 0; // 0 if the graph has no batched inputs
+    std::optional<size_t> batch_size_node;
+};
+
+// A batch of rows of different lengths, stored without padding. Row r holds offsets[r + 1] -
+// offsets[r] elements (each of the shape given to AddRaggedInput), starting at element
+// offsets[r] of the values. Nodes computed from the values skip the padding of every row, and
+// reductions over dimension 1 only see the valid elements.
+struct RaggedInput
+{
+    GraphNodeHandle values;
+    GraphNodeHandle offsets; // rows + 1 I64
+
+    void SetData(float *values_data, int64_t *offsets_data)
+    {
+        values.data() = values_data;
+        offsets.data() = reinterpret_cast<float *>(offsets_data);
+    }
+};
+
+// Kernels read row r of values from row indices[r] of a dataset with any number of rows, so a
+// shuffled batch only needs new indices instead of a copy of its rows
+struct IndexedInput
+{
+    GraphNodeHandle values;
+    GraphNodeHandle indices; // One I64 per row of values
+
+    void SetData(void *dataset, int64_t *indices_data)
+    {
+        values.data() = static_cast<float *>(dataset);
+        indices.data() = reinterpret_cast<float *>(indices_data);
+    }
 };
 
 namespace nn
@@ -305,16 +399,22 @@ struct Module
 {
     GraphNodeHandle Immediate(float imm);
 
-    GraphNodeHandle AddInput(Shape shape);
+    GraphNodeHandle AddInput(Shape shape, DataType dtype = DataType::F32);
     GraphNodeHandle AddInput(dim_t dim);
-
-    GraphNodeHandle AddWeight(Shape shape);
-    GraphNodeHandle AddWeight(dim_t dim);
+    GraphNodeHandle AddInput(BatchDim batch, Shape shape, DataType dtype = DataType::F32);
+    RaggedInput AddRaggedInput(dim_t rows, dim_t max_length, Shape shape = {});
+    IndexedInput AddIndexedInput(BatchDim batch, Shape shape, DataType dtype = DataType::F32);
+    GraphNodeHandle AddParameter(float value);
+
+    // Weights are named weight<i> by default, where i counts the weights added before
+    GraphNodeHandle AddWeight(Shape shape, std::string name = {});
+    GraphNodeHandle AddWeight(dim_t dim, std::string name = {});
     
     Graph graph;
     // TODO: Think about if this is a good idea..
     // kind of cumbersome doing a double lookup
     std::vector<size_t> weights; // Indices of forward.inputs that are weights
+    std::vector<std::string> weight_names; // Parallel to weights, names them in checkpoints
 };
 
 }
@@ -0,0 +1,681 @@
+#include "inference.h"
+#include "backend_scalar_c.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace gigagrad;
+
+struct FoldContext
+{
+    Graph &graph;
+    std::unordered_set<size_t> constant_tensors; // Weights and tensors computed at compile time
+    std::unordered_map<size_t, bool> is_constant;
+    std::unordered_map<size_t, size_t> num_users;
+    // Nodes that the forward pass uses more than once. Rewriting through them would compute
+    // them twice, so they are kept as they are.
+    std::unordered_set<size_t> shared;
+    std::unordered_map<size_t, GraphNodeHandle> simplified;
+    std::unordered_map<size_t, GraphNodeHandle> prepacked;
+    std::unordered_set<size_t> materialize; // Constant views that are stored in their own layout
+    std::unordered_map<size_t, GraphNodeHandle> folded;
+    std::vector<std::unique_ptr<float[]>> constants;
+};
+
+template <typename TFn>
+static void ForEachInput(GraphNodeHandle node, TFn fn)
+{
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::UnaryOp:
+        fn(node->u.u.unary_op.x);
+        break;
+    case GraphNode::Kind::BinaryOp:
+        fn(node->u.b.binary_op.x);
+        fn(node->u.b.binary_op.y);
+        break;
+    case GraphNode::Kind::ReduceOp:
+        fn(node->u.r.reduce_op.x);
+        break;
+    case GraphNode::Kind::ViewOp:
+        fn(node->u.v.view_op.x);
+        break;
+    default:
+        break;
+    }
+}
+
+template <typename TFn>
+static GraphNodeHandle RebuildInputs(GraphNodeHandle node, TFn map)
+{
+    Graph *graph = node.graph;
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::UnaryOp:
+    {
+        UnaryOp u = node->u.u.unary_op;
+        GraphNodeHandle x = map(u.x);
+        if(x.node_idx == u.x.node_idx)
+            return node;
+        return graph->AddNode(UnaryOp{ u.type, x });
+    }
+    case GraphNode::Kind::BinaryOp:
+    {
+        BinaryOp b = node->u.b.binary_op;
+        GraphNodeHandle x = map(b.x);
+        GraphNodeHandle y = map(b.y);
+        if(x.node_idx == b.x.node_idx && y.node_idx == b.y.node_idx)
+            return node;
+        return graph->AddNode(BinaryOp{ b.type, x, y });
+    }
+    case GraphNode::Kind::ReduceOp:
+    {
+        ReduceOp r = node->u.r.reduce_op;
+        GraphNodeHandle x = map(r.x);
+        if(x.node_idx == r.x.node_idx)
+            return node;
+        return graph->AddNode(ReduceOp{ r.type, x, r.dims, r.keepdim });
+    }
+    case GraphNode::Kind::ViewOp:
+    {
+        ViewOp v = node->u.v.view_op;
+        GraphNodeHandle x = map(v.x);
+        if(x.node_idx == v.x.node_idx)
+            return node;
+        return graph->AddNode(ViewOp{ x, v.shape, v.strides, v.offset });
+    }
+    default:
+        return node;
+    }
+}
+
+// Returns node with every input replaced by map(input), or node itself if no input changes.
+// The new node keeps the storage type of node.
+template <typename TFn>
+static GraphNodeHandle Rebuild(GraphNodeHandle node, TFn map)
+{
+    GraphNodeHandle result = RebuildInputs(node, map);
+    if(result.node_idx != node.node_idx)
+        result->dtype = node->dtype;
+    return result;
+}
+
+static Shape ContiguousStrides(const Shape &shape)
+{
+    Shape strides(shape.size());
+    dim_t stride = 1;
+    for(ssize_t i = std::ssize(shape) - 1; i >= 0; i--)
+    {
+        strides[i] = stride;
+        stride *= shape[i];
+    }
+    return strides;
+}
+
+static bool IsConstant(FoldContext &ctx, GraphNodeHandle node)
+{
+    if(auto cached = ctx.is_constant.find(node.node_idx); cached != ctx.is_constant.end())
+        return cached->second;
+
+    bool result = true;
+    if(node->Kind() == GraphNode::Kind::Tensor)
+    {
+        result = ctx.constant_tensors.contains(node.node_idx);
+        if(result && node.data() == nullptr)
+            throw std::domain_error("Weights must have data before compiling for inference");
+    }
+    ForEachInput(node, [&](GraphNodeHandle x) { result = IsConstant(ctx, x) && result; });
+    ctx.is_constant[node.node_idx] = result;
+    return result;
+}
+
+static void CountUsers(FoldContext &ctx, GraphNodeHandle node, std::unordered_set<size_t> &visited)
+{
+    if(!visited.insert(node.node_idx).second)
+        return;
+    ForEachInput(node, [&](GraphNodeHandle x)
+    {
+        ctx.num_users[x.node_idx]++;
+        CountUsers(ctx, x, visited);
+    });
+}
+
+static GraphNodeHandle Shift(FoldContext &ctx, GraphNodeHandle x, GraphNodeHandle c);
+
+// Returns sum(a * w) * c as sum(a * (w * c)), if the reduction sums a product with constant w
+// and c doesn't broadcast the reduction to a bigger shape
+static std::optional<GraphNodeHandle> ScaleReduction(FoldContext &ctx, GraphNodeHandle x, GraphNodeHandle c)
+{
+    if(ctx.shared.contains(x.node_idx) || x->Kind() != GraphNode::Kind::ReduceOp)
+        return std::nullopt;
+    ReduceOp r = x->u.r.reduce_op;
+    if(r.type != ReduceOpType::SUM || ctx.shared.contains(r.x.node_idx) || r.x->Kind() != GraphNode::Kind::BinaryOp)
+        return std::nullopt;
+    BinaryOp product = r.x->u.b.binary_op;
+    bool x_constant = IsConstant(ctx, product.x);
+    if(product.type != BinaryOpType::MUL || x_constant == IsConstant(ctx, product.y))
+        return std::nullopt;
+
+    const Shape &shape = x.shape();
+    const Shape &c_shape = c.shape();
+    if(c_shape.size() > shape.size())
+        return std::nullopt;
+    size_t offset = shape.size() - c_shape.size();
+    for(size_t i = 0; i < c_shape.size(); i++)
+    {
+        if(c_shape[i] != 1 && c_shape[i] != shape[i + offset])
+            return std::nullopt;
+    }
+
+    // Align c with the product by giving it size 1 along the reduced dimensions
+    Shape expanded(offset, 1);
+    expanded.insert(expanded.end(), c_shape.begin(), c_shape.end());
+    if(r.dims.empty())
+        expanded.assign(r.x.shape().size(), 1);
+    else if(!r.keepdim)
+        for(dim_t dim : r.dims)
+            expanded.insert(expanded.begin() + dim, 1);
+    GraphNodeHandle scale = expanded == c_shape ? c : c.reshape(std::move(expanded));
+
+    GraphNodeHandle weight = x_constant ? product.x : product.y;
+    GraphNodeHandle scaled_weight = ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, weight, scale });
+    GraphNodeHandle scaled_product = x_constant
+        ? ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, scaled_weight, product.y })
+        : ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, product.x, scaled_weight });
+    return ctx.graph.AddNode(ReduceOp{ ReduceOpType::SUM, scaled_product, r.dims, r.keepdim });
+}
+
+// Returns x * c for constant c, moving c into x where x is a product or sum with a constant
+static GraphNodeHandle Scale(FoldContext &ctx, GraphNodeHandle x, GraphNodeHandle c)
+{
+    if(!ctx.shared.contains(x.node_idx) && x->Kind() == GraphNode::Kind::BinaryOp)
+    {
+        BinaryOp b = x->u.b.binary_op;
+        // (a * c1) * c2 = a * (c1 * c2)
+        if(b.type == BinaryOpType::MUL && IsConstant(ctx, b.y))
+            return Scale(ctx, b.x, b.y * c);
+        // (a + c1) * c2 = a * c2 + c1 * c2
+        if(b.type == BinaryOpType::ADD && IsConstant(ctx, b.y))
+            return Shift(ctx, Scale(ctx, b.x, c), b.y * c);
+    }
+    if(std::optional<GraphNodeHandle> scaled = ScaleReduction(ctx, x, c))
+        return *scaled;
+    return ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, x, c });
+}
+
+// Returns x + c for constant c, merging c into x where x is a sum with a constant
+static GraphNodeHandle Shift(FoldContext &ctx, GraphNodeHandle x, GraphNodeHandle c)
+{
+    if(!ctx.shared.contains(x.node_idx) && x->Kind() == GraphNode::Kind::BinaryOp)
+    {
+        BinaryOp b = x->u.b.binary_op;
+        // (a + c1) + c2 = a + (c1 + c2)
+        if(b.type == BinaryOpType::ADD && IsConstant(ctx, b.y))
+            return Shift(ctx, b.x, b.y + c);
+    }
+    return ctx.graph.AddNode(BinaryOp{ BinaryOpType::ADD, x, c });
+}
+
+static GraphNodeHandle Simplify(FoldContext &ctx, GraphNodeHandle node)
+{
+    if(auto cached = ctx.simplified.find(node.node_idx); cached != ctx.simplified.end())
+        return cached->second;
+
+    GraphNodeHandle result = Rebuild(node, [&](GraphNodeHandle x) { return Simplify(ctx, x); });
+    if(result->Kind() == GraphNode::Kind::BinaryOp)
+    {
+        BinaryOp b = result->u.b.binary_op;
+        if(IsConstant(ctx, b.x) != IsConstant(ctx, b.y))
+        {
+            // Constants go on the right of sums and products, and subtracting or dividing by
+            // a constant becomes adding or multiplying by another constant
+            if((b.type == BinaryOpType::ADD || b.type == BinaryOpType::MUL) && IsConstant(ctx, b.x))
+                std::swap(b.x, b.y);
+            if(b.type == BinaryOpType::SUB && IsConstant(ctx, b.y))
+                b = { BinaryOpType::ADD, b.x, -b.y };
+            if(b.type == BinaryOpType::DIV && IsConstant(ctx, b.y))
+                b = { BinaryOpType::MUL, b.x, 1.0f / b.y };
+
+            if(b.type == BinaryOpType::MUL && IsConstant(ctx, b.y))
+                result = Scale(ctx, b.x, b.y);
+            else if(b.type == BinaryOpType::ADD && IsConstant(ctx, b.y))
+                result = Shift(ctx, b.x, b.y);
+        }
+    }
+    if(ctx.num_users[node.node_idx] > 1)
+        ctx.shared.insert(result.node_idx);
+    ctx.simplified[node.node_idx] = result;
+    return result;
+}
+
+// Returns the shape of operand aligned with the rank of the product it is an operand of
+static Shape ExpandedShape(GraphNodeHandle operand, size_t rank)
+{
+    Shape expanded(rank - operand.shape().size(), 1);
+    expanded.insert(expanded.end(), operand.shape().begin(), operand.shape().end());
+    return expanded;
+}
+
+static bool IsReduced(const ReduceOp &r, dim_t dim)
+{
+    return r.dims.empty() || std::find(r.dims.begin(), r.dims.end(), dim) != r.dims.end();
+}
+
+// Returns the order of the dimensions of an operand of r with the given expanded shape that
+// puts the reduced dimensions innermost, or nothing if that order doesn't move any data
+static std::optional<Dims> PackedOrder(const ReduceOp &r, const Shape &expanded)
+{
+    // Dimensions that aren't reduced first, then the reduced ones
+    Dims order;
+    for(dim_t i = 0; i < std::ssize(expanded); i++)
+        if(!IsReduced(r, i))
+            order.push_back(i);
+    for(dim_t i = 0; i < std::ssize(expanded); i++)
+        if(IsReduced(r, i))
+            order.push_back(i);
+
+    // Dimensions of size 1 don't move any data
+    Dims moved;
+    std::copy_if(order.begin(), order.end(), std::back_inserter(moved), [&](dim_t i) { return expanded[i] != 1; });
+    if(std::is_sorted(moved.begin(), moved.end()))
+        return std::nullopt;
+    return order;
+}
+
+// Returns a view of packed, which holds the values of a node of shape expanded with its
+// dimensions in the given order, with that node's shape and element positions
+static GraphNodeHandle Unpack(GraphNodeHandle packed, const Shape &expanded, const Dims &order)
+{
+    Shape packed_contiguous_strides = ContiguousStrides(packed.shape());
+    Shape unpacked_strides(expanded.size());
+    for(size_t k = 0; k < order.size(); k++)
+        unpacked_strides[order[k]] = packed_contiguous_strides[k];
+    return packed.as_strided(expanded, std::move(unpacked_strides), 0);
+}
+
+// Rewrites the constant operand of every summing reduction of a product into a view of a
+// copy that is laid out with the reduced dimensions innermost
+static GraphNodeHandle Prepack(FoldContext &ctx, GraphNodeHandle node)
+{
+    if(auto cached = ctx.prepacked.find(node.node_idx); cached != ctx.prepacked.end())
+        return cached->second;
+
+    GraphNodeHandle result = Rebuild(node, [&](GraphNodeHandle x) { return Prepack(ctx, x); });
+    auto is_product = [](GraphNodeHandle x)
+    {
+        return x->Kind() == GraphNode::Kind::BinaryOp && x->u.b.binary_op.type == BinaryOpType::MUL;
+    };
+    if(result->Kind() == GraphNode::Kind::ReduceOp
+       && result->u.r.reduce_op.type == ReduceOpType::SUM
+       && is_product(result->u.r.reduce_op.x))
+    {
+        ReduceOp r = result->u.r.reduce_op;
+        BinaryOp product = r.x->u.b.binary_op;
+        bool x_constant = IsConstant(ctx, product.x);
+        GraphNodeHandle weight = x_constant ? product.x : product.y;
+        if(x_constant != IsConstant(ctx, product.y))
+        {
+            Shape expanded = ExpandedShape(weight, r.x.shape().size());
+            if(std::optional<Dims> order = PackedOrder(r, expanded))
+            {
+                Shape expanded_strides = ContiguousStrides(expanded);
+                Shape packed_shape, packed_strides;
+                for(dim_t i : *order)
+                {
+                    packed_shape.push_back(expanded[i]);
+                    packed_strides.push_back(expanded_strides[i]);
+                }
+                GraphNodeHandle reshaped = expanded == weight.shape() ? weight : weight.reshape(expanded);
+                GraphNodeHandle packed = reshaped.as_strided(packed_shape, std::move(packed_strides), 0);
+                ctx.materialize.insert(packed.node_idx);
+                GraphNodeHandle unpacked = Unpack(packed, expanded, *order);
+
+                GraphNodeHandle new_product = x_constant
+                    ? ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, unpacked, product.y })
+                    : ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, product.x, unpacked });
+                result = ctx.graph.AddNode(ReduceOp{ r.type, new_product, r.dims, r.keepdim });
+            }
+        }
+    }
+    ctx.prepacked[node.node_idx] = result;
+    return result;
+}
+
+// Collects the outermost constant nodes that need to be computed at compile time
+static void CollectFolded(
+    FoldContext &ctx,
+    GraphNodeHandle node,
+    bool fold_constants,
+    std::vector<GraphNodeHandle> &roots,
+    std::unordered_set<size_t> &visited)
+{
+    if(!visited.insert(node.node_idx).second)
+        return;
+    bool computed = node->Kind() == GraphNode::Kind::UnaryOp
+        || node->Kind() == GraphNode::Kind::BinaryOp
+        || node->Kind() == GraphNode::Kind::ReduceOp;
+    if(IsConstant(ctx, node) && ((fold_constants && computed) || ctx.materialize.contains(node.node_idx)))
+    {
+        roots.push_back(node);
+        return;
+    }
+    ForEachInput(node, [&](GraphNodeHandle x) { CollectFolded(ctx, x, fold_constants, roots, visited); });
+}
+
+// Computes the roots in one program and replaces them with tensors holding their values, or
+// immediates if they are scalars
+static void EvaluateFolded(FoldContext &ctx, const std::vector<GraphNodeHandle> &roots)
+{
+    if(roots.empty())
+        return;
+    codegen::Program prog;
+    for(GraphNodeHandle root : roots)
+        codegen::CodegenNode(prog, root);
+
+    codegen::BackendScalarC evaluator;
+    evaluator.LowerProgram(std::move(prog));
+    evaluator.InitBuffers();
+    evaluator.Execute();
+    for(GraphNodeHandle root : roots)
+    {
+        size_t buffer = evaluator.program.GetOutputBufferForNodeIdx(root.node_idx);
+        const float *values = reinterpret_cast<const float *>(evaluator.GetBuffer(buffer));
+        if(root.shape().empty())
+        {
+            ctx.folded[root.node_idx] = ctx.graph.Immediate(values[0]);
+            continue;
+        }
+        size_t size_elts = std::accumulate(root.shape().begin(), root.shape().end(), dim_t{1}, std::multiplies{});
+        std::unique_ptr<float[]> data(new float[size_elts]);
+        std::memcpy(data.get(), values, size_elts * sizeof(float));
+        GraphNodeHandle tensor = ctx.graph.AddNode(Tensor{ data.get() }, root.shape());
+        ctx.constant_tensors.insert(tensor.node_idx);
+        ctx.constants.push_back(std::move(data));
+        ctx.folded[root.node_idx] = tensor;
+    }
+}
+
+// Replaces every node in replacements below node, and remembers the results in replacements
+static GraphNodeHandle Substitute(std::unordered_map<size_t, GraphNodeHandle> &replacements, GraphNodeHandle node)
+{
+    if(auto replaced = replacements.find(node.node_idx); replaced != replacements.end())
+        return replaced->second;
+    GraphNodeHandle result = Rebuild(node, [&](GraphNodeHandle x) { return Substitute(replacements, x); });
+    replacements[node.node_idx] = result;
+    return result;
+}
+
+// A summing reduction of the product of an activation and a constant weight
+struct QuantizedReduction
+{
+    GraphNodeHandle reduction;
+    GraphNodeHandle activation; // The non-constant operand of the product, below its views
+    GraphNodeHandle weight; // The constant operand, reshaped to the rank of the product
+};
+
+// Collects the reductions to quantize, every reduction after the ones it depends on
+static void CollectQuantized(
+    FoldContext &ctx,
+    GraphNodeHandle node,
+    std::vector<QuantizedReduction> &reductions,
+    std::unordered_set<size_t> &visited)
+{
+    if(!visited.insert(node.node_idx).second)
+        return;
+    ForEachInput(node, [&](GraphNodeHandle x) { CollectQuantized(ctx, x, reductions, visited); });
+    if(node->Kind() != GraphNode::Kind::ReduceOp || node->u.r.reduce_op.type != ReduceOpType::SUM)
+        return;
+    GraphNodeHandle x = node->u.r.reduce_op.x;
+    if(x->Kind() != GraphNode::Kind::BinaryOp || x->u.b.binary_op.type != BinaryOpType::MUL)
+        return;
+    BinaryOp product = x->u.b.binary_op;
+    bool x_constant = IsConstant(ctx, product.x);
+    if(x_constant == IsConstant(ctx, product.y))
+        return;
+
+    GraphNodeHandle activation = x_constant ? product.y : product.x;
+    while(activation->Kind() == GraphNode::Kind::ViewOp)
+        activation = activation->u.v.view_op.x;
+    GraphNodeHandle weight = x_constant ? product.x : product.y;
+    Shape expanded = ExpandedShape(weight, x.shape().size());
+    reductions.push_back({ node, activation, expanded == weight.shape() ? weight : weight.reshape(expanded) });
+}
+
+static GraphNodeHandle ReplaceBelowViews(GraphNodeHandle node, GraphNodeHandle original, GraphNodeHandle replacement)
+{
+    if(node.node_idx == original.node_idx)
+        return replacement;
+    return Rebuild(node, [&](GraphNodeHandle x) { return ReplaceBelowViews(x, original, replacement); });
+}
+
+// Rewrites every summing reduction of an activation and a weight into an integer reduction of
+// int8 values, scaled back by the product of their scales. The int8 activations are returned
+// in int8_activations, producers first, and must be generated before the nodes that read them.
+static GraphNodeHandle Quantize(
+    FoldContext &ctx,
+    GraphNodeHandle output,
+    const QuantizeInt8 &options,
+    bool prepack,
+    std::vector<GraphNodeHandle> &int8_activations)
+{
+    std::vector<QuantizedReduction> reductions;
+    std::unordered_set<size_t> visited;
+    CollectQuantized(ctx, output, reductions, visited);
+    if(reductions.empty())
+        return output;
+
+    // One program computes the weights and the float activations of every calibration batch
+    codegen::Program prog;
+    std::vector<GraphNodeHandle> activations;
+    std::unordered_map<size_t, float> max_abs;
+    for(const QuantizedReduction &q : reductions)
+    {
+        codegen::CodegenNode(prog, q.weight);
+        if(max_abs.emplace(q.activation.node_idx, 0.0f).second)
+            activations.push_back(q.activation);
+    }
+    for(GraphNodeHandle activation : activations)
+        codegen::CodegenNode(prog, activation);
+
+    codegen::BackendScalarC evaluator;
+    evaluator.LowerProgram(std::move(prog));
+    evaluator.InitBuffers();
+    auto values = [&](GraphNodeHandle node)
+    {
+        size_t buffer = evaluator.program.GetOutputBufferForNodeIdx(node.node_idx);
+        return reinterpret_cast<const float *>(evaluator.GetBuffer(buffer));
+    };
+    auto num_elements = [](const Shape &shape)
+    {
+        return std::accumulate(shape.begin(), shape.end(), dim_t{1}, std::multiplies{});
+    };
+    size_t num_batches = 0;
+    for(; options.calibration_batch(num_batches); num_batches++)
+    {
+        evaluator.Execute();
+        for(GraphNodeHandle activation : activations)
+        {
+            const float *a = values(activation);
+            float &max = max_abs[activation.node_idx];
+            for(dim_t i = 0; i < num_elements(activation.shape()); i++)
+                max = std::max(max, std::abs(a[i]));
+        }
+    }
+    if(num_batches == 0)
+        throw std::domain_error("Quantizing needs at least one calibration batch");
+
+    // Values that never exceed 0 keep a scale of 1, so scales are never 0
+    auto scale_of = [](float max) { return max > 0.0f ? max / 127.0f : 1.0f; };
+    std::unordered_map<size_t, GraphNodeHandle> replacements;
+    for(GraphNodeHandle activation : activations)
+    {
+        GraphNodeHandle q = activation * (1.0f / scale_of(max_abs[activation.node_idx]));
+        q->dtype = DataType::I8;
+        replacements[activation.node_idx] = q;
+    }
+
+    std::unordered_map<size_t, GraphNodeHandle> quantized;
+    for(const QuantizedReduction &q : reductions)
+    {
+        ReduceOp r = q.reduction->u.r.reduce_op;
+        const Shape &expanded = q.weight.shape();
+        Shape expanded_strides = ContiguousStrides(expanded);
+
+        // Every output channel of the weight has its own scale
+        Shape channels_shape = expanded;
+        for(dim_t i = 0; i < std::ssize(expanded); i++)
+            if(IsReduced(r, i))
+                channels_shape[i] = 1;
+        Shape channel_strides = ContiguousStrides(channels_shape);
+        auto channel = [&](dim_t idx)
+        {
+            dim_t result = 0;
+            for(dim_t i = 0; i < std::ssize(expanded); i++)
+                result += (idx / expanded_strides[i] % expanded[i]) * (channels_shape[i] == 1 ? 0 : channel_strides[i]);
+            return result;
+        };
+
+        const float *w = values(q.weight);
+        dim_t num_elts = num_elements(expanded);
+        std::vector<float> scales(num_elements(channels_shape), 0.0f);
+        for(dim_t i = 0; i < num_elts; i++)
+            scales[channel(i)] = std::max(scales[channel(i)], std::abs(w[i]));
+        for(float &scale : scales)
+            scale = scale_of(scale);
+
+        // The weight is stored with the reduced dimensions innermost when prepacking
+        std::optional<Dims> order = prepack ? PackedOrder(r, expanded) : std::nullopt;
+        Shape stored_shape = expanded;
+        Shape stored_strides = expanded_strides;
+        if(order)
+        {
+            for(size_t k = 0; k < order->size(); k++)
+                stored_shape[k] = expanded[(*order)[k]];
+            Shape packed_contiguous_strides = ContiguousStrides(stored_shape);
+            for(size_t k = 0; k < order->size(); k++)
+                stored_strides[(*order)[k]] = packed_contiguous_strides[k];
+        }
+        std::unique_ptr<float[]> data(new float[(num_elts + sizeof(float) - 1) / sizeof(float)]);
+        int8_t *wq = reinterpret_cast<int8_t *>(data.get());
+        for(dim_t i = 0; i < num_elts; i++)
+        {
+            dim_t stored_idx = 0;
+            for(dim_t d = 0; d < std::ssize(expanded); d++)
+                stored_idx += (i / expanded_strides[d] % expanded[d]) * stored_strides[d];
+            float value = std::nearbyint(w[i] / scales[channel(i)]);
+            wq[stored_idx] = static_cast<int8_t>(std::clamp(value, -127.0f, 127.0f));
+        }
+        GraphNodeHandle weight = ctx.graph.AddNode(Tensor{ data.get() }, stored_shape);
+        weight->dtype = DataType::I8;
+        ctx.constant_tensors.insert(weight.node_idx);
+        ctx.constants.push_back(std::move(data));
+        if(order)
+            weight = Unpack(weight, expanded, *order);
+
+        // The integer sums are scaled by the activation scale times the channel scale
+        float activation_scale = scale_of(max_abs[q.activation.node_idx]);
+        Shape rescale_shape;
+        for(dim_t i = 0; i < std::ssize(channels_shape); i++)
+            if(r.keepdim || !IsReduced(r, i))
+                rescale_shape.push_back(channels_shape[i]);
+        GraphNodeHandle rescale = ctx.graph.Immediate(activation_scale * scales[0]);
+        if(!rescale_shape.empty())
+        {
+            std::unique_ptr<float[]> rescale_data(new float[scales.size()]);
+            for(size_t i = 0; i < scales.size(); i++)
+                rescale_data[i] = activation_scale * scales[i];
+            rescale = ctx.graph.AddNode(Tensor{ rescale_data.get() }, rescale_shape);
+            ctx.constant_tensors.insert(rescale.node_idx);
+            ctx.constants.push_back(std::move(rescale_data));
+        }
+
+        // The int8 activation reads reductions before this one, which are already quantized
+        BinaryOp product = r.x->u.b.binary_op;
+        bool x_constant = IsConstant(ctx, product.x);
+        GraphNodeHandle activation = ReplaceBelowViews(
+            x_constant ? product.y : product.x,
+            q.activation,
+            Substitute(quantized, replacements[q.activation.node_idx]));
+        GraphNodeHandle int8_product = x_constant
+            ? ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, weight, activation })
+            : ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, activation, weight });
+        GraphNodeHandle sum = ctx.graph.AddNode(ReduceOp{ ReduceOpType::SUM, int8_product, r.dims, r.keepdim });
+        quantized[q.reduction.node_idx] = ctx.graph.AddNode(BinaryOp{ BinaryOpType::MUL, sum, rescale });
+    }
+
+    output = Substitute(quantized, output);
+    for(GraphNodeHandle activation : activations)
+        int8_activations.push_back(Substitute(quantized, replacements[activation.node_idx]));
+    return output;
+}
+
+namespace gigagrad
+{
+
+CompiledTensor CompileInference(
+    nn::Module &network,
+    GraphNodeHandle output,
+    std::unique_ptr<codegen::Backend> backend,
+    InferenceOptions options)
+{
+    FoldContext ctx = { network.graph };
+    for(size_t iweight : network.weights)
+        ctx.constant_tensors.insert(network.graph.inputs[iweight]);
+
+    if(options.fold_constants)
+    {
+        std::unordered_set<size_t> visited;
+        CountUsers(ctx, output, visited);
+        output = Simplify(ctx, output);
+    }
+    // Quantizing packs the weights it quantizes by itself
+    if(options.prepack_weights && !options.quantize)
+        output = Prepack(ctx, output);
+
+    std::vector<GraphNodeHandle> roots;
+    std::unordered_set<size_t> visited;
+    CollectFolded(ctx, output, options.fold_constants, roots, visited);
+    EvaluateFolded(ctx, roots);
+    output = Substitute(ctx.folded, output);
+
+    std::vector<GraphNodeHandle> int8_activations;
+    if(options.quantize)
+        output = Quantize(ctx, output, *options.quantize, options.prepack_weights, int8_activations);
+
+    // Int8 activations are stored before the reductions that read them, so those find them
+    // in their own buffers
+    codegen::Program prog;
+    for(GraphNodeHandle activation : int8_activations)
+        codegen::CodegenNode(prog, activation);
+    codegen::CodegenNode(prog, output);
+    for(codegen::BufferDescriptor &desc : prog.buffers)
+    {
+        if(options.embed_weights
+           && (desc.dtype == DataType::F32 || desc.dtype == DataType::I8)
+           && std::holds_alternative<GraphNodeHandle>(desc.id)
+           && ctx.constant_tensors.contains(std::get<GraphNodeHandle>(desc.id).node_idx))
+            desc.constant = true;
+    }
+    prog.PlanMemory({}, true /* in_place */);
+    backend->LowerProgram(std::move(prog));
+
+    CompiledTensor result;
+    result.shape = output.shape();
+    result.data = reinterpret_cast<float *>(backend->InitBuffers());
+    result.backend = std::move(backend);
+    result.constants = std::move(ctx.constants);
+    return result;
+}
+
+void ExportInference(const CompiledTensor &model, const std::string &directory, const std::string &name)
+{
+    const auto *backend = dynamic_cast<const codegen::BackendScalarC *>(model.backend.get());
+    if(!backend)
+        throw std::domain_error("Only models compiled with BackendScalarC can be exported");
+    backend->Export(directory, name);
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "graph.h"
+#include "codegen.h"
+
+#include <functional>
+#include <optional>
+
+namespace gigagrad
+{
+
+struct QuantizeInt8
+{
+    // Points the network inputs at calibration batch i and returns true, or returns false
+    // once there are no more batches
+    std::function<bool(size_t)> calibration_batch;
+};
+
+struct InferenceOptions
+{
+    // Emits the values of weights and folded constants into the generated code, so the C
+    // compiler can specialize kernels for them. Weights must not change after compiling.
+    bool embed_weights = true;
+
+    // Rewrites chains of constant scales and shifts, like an inference batchnorm written as
+    // ((x % w + b) - mean) / sqrt(var + eps) * gamma + beta, into the preceding matmul weights
+    // and bias, and evaluates every node that only depends on weights once at compile time.
+    bool fold_constants = true;
+
+    // Stores the constant operand of every summing reduction with the reduced dimensions
+    // innermost, so the reduction loop reads it contiguously
+    bool prepack_weights = false;
+
+    // Stores both operands of every summing reduction of an activation and a weight as int8,
+    // and multiplies and accumulates them as integers. Weights get one scale per output
+    // channel, activations one scale from the largest magnitude seen while calibrating.
+    // Reduced values are scaled back to floats, and requantized wherever they feed another
+    // quantized reduction. With prepack_weights, the reductions are dot products that use
+    // VNNI instructions where the C compiler targets them.
+    std::optional<QuantizeInt8> quantize;
+};
+
+// Compiles the forward pass of network for serving. Weights are read at compile time and must
+// have data. Intermediate buffers share memory as soon as their lifetimes allow, and
+// elementwise kernels write over the input they read last.
+CompiledTensor CompileInference(
+    nn::Module &network,
+    GraphNodeHandle output,
+    std::unique_ptr<codegen::Backend> backend,
+    InferenceOptions options = {});
+
+template <typename TBackend>
+CompiledTensor CompileInference(nn::Module &network, GraphNodeHandle output, InferenceOptions options = {})
+{
+    return CompileInference(network, output, std::make_unique<TBackend>(), options);
+}
+
+// Writes a model compiled with BackendScalarC to directory as a standalone C library, see
+// BackendScalarC::Export(). Compile with embed_weights so the library carries its weights.
+void ExportInference(const CompiledTensor &model, const std::string &directory, const std::string &name);
+
+}
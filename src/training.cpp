@@ -1,6 +1,10 @@
 #include "training.h"
 #include "codegen.h"
 
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+
 using namespace gigagrad;
 
 struct Gradient
@@ -19,16 +23,31 @@ struct BackpropContext
 
 void Differentiate(BackpropContext &ctx, GraphNodeHandle node, GraphNodeHandle seed);
 
-void Differentiate(BackpropContext &ctx, GraphNodeHandle node, const Tensor &t, GraphNodeHandle seed)
+// Sums seed over the dimensions along which a node of the given shape was broadcast
+static GraphNodeHandle ReduceToShape(GraphNodeHandle seed, const Shape &shape)
 {
     // If we're performing batched training
-    if(seed.shape().size() > node.shape().size())
+    if(seed.shape().size() > shape.size())
     {
-        Dims dims(seed.shape().size() - node.shape().size());
+        Dims dims(seed.shape().size() - shape.size());
         std::iota(dims.begin(), dims.end(), 0);
         seed = seed.sum(std::move(dims));
     }
-    ctx.gradients.push_back({ node, seed });
+
+    Dims broadcast_dims;
+    for(size_t i = 0; i < shape.size(); i++)
+    {
+        if(shape[i] == 1 && seed.shape()[i] != 1)
+            broadcast_dims.push_back(static_cast<dim_t>(i));
+    }
+    if(!broadcast_dims.empty())
+        seed = seed.sum(std::move(broadcast_dims), true /* keepdim */);
+    return seed;
+}
+
+void Differentiate(BackpropContext &ctx, GraphNodeHandle node, const Tensor &t, GraphNodeHandle seed)
+{
+    ctx.gradients.push_back({ node, ReduceToShape(seed, node.shape()) });
 }
 
 void Differentiate(BackpropContext &ctx, GraphNodeHandle, const Immediate &i, const GraphNodeHandle seed)
@@ -57,6 +76,10 @@ void Differentiate(BackpropContext &ctx, GraphNodeHandle node, const UnaryOp &u,
         // ∇(sqrt(x)) = { s * 1/(2 * sqrt(x)) * ∂x }
         Differentiate(ctx, u.x, seed / (2.0f * node));
         break;
+    case UnaryOpType::CAST:
+        // Rounding passes the gradient straight through
+        Differentiate(ctx, u.x, seed);
+        break;
     default:
         throw std::runtime_error("Unimplemented operation");
     }
@@ -64,42 +87,55 @@ void Differentiate(BackpropContext &ctx, GraphNodeHandle node, const UnaryOp &u,
 
 void Differentiate(BackpropContext &ctx, GraphNodeHandle, const BinaryOp &b, GraphNodeHandle seed)
 {
+    // Operands that were broadcast receive the sum of the seed over the broadcast dimensions
+    auto differentiate = [&](GraphNodeHandle operand, GraphNodeHandle operand_seed)
+    {
+        if(operand->needs_gradient)
+            Differentiate(ctx, operand, ReduceToShape(operand_seed, operand.shape()));
+    };
+
     switch(b.type)
     {
     case BinaryOpType::ADD:
         // ∇(x + y) = { s * ∂x, s * ∂y }
-        Differentiate(ctx, b.x, seed);
-        Differentiate(ctx, b.y, seed);
+        differentiate(b.x, seed);
+        differentiate(b.y, seed);
         break;
     case BinaryOpType::SUB:
         // ∇(x - y) = { s * ∂x, s * -1 * ∂y }
-        Differentiate(ctx, b.x, seed);
-        Differentiate(ctx, b.y, -seed);
+        differentiate(b.x, seed);
+        differentiate(b.y, -seed);
         break;
     case BinaryOpType::MUL:
+        // ∇(x * x) = { 2sx * ∂x }, as a single gradient rather than two
+        if(b.x.node_idx == b.y.node_idx)
+        {
+            differentiate(b.x, 2.0f * seed * b.x);
+            break;
+        }
         // ∇(x * y) = { s * y * ∂x, s * x * ∂y }
-        Differentiate(ctx, b.x, seed * b.y);
-        Differentiate(ctx, b.y, seed * b.x);
+        differentiate(b.x, seed * b.y);
+        differentiate(b.y, seed * b.x);
         break;
     case BinaryOpType::DIV:
         // ∇(x / y) = { s/y * ∂x, -s*x/y^2 * ∂y }
-        Differentiate(ctx, b.x, seed / b.y);
-        Differentiate(ctx, b.y, -seed * b.x / (b.y * b.y));
+        differentiate(b.x, seed / b.y);
+        differentiate(b.y, -seed * b.x / (b.y * b.y));
         break;
     case BinaryOpType::POW:
         // ∇(x^y) = { syx^(y - 1) * ∂x, s * log(x) * x^y * ∂y }
-        Differentiate(ctx, b.x, seed * b.y * pow(b.x, b.y - 1));
-        Differentiate(ctx, b.y, seed * log(b.x) * pow(b.x, b.y));
+        differentiate(b.x, seed * b.y * pow(b.x, b.y - 1));
+        differentiate(b.y, seed * log(b.x) * pow(b.x, b.y));
         break;
     case BinaryOpType::CMP:
         // ∇(x == y) = { s * (x == y ? 1 : 0), s * (a == b ? 1 : 0) }
-        Differentiate(ctx, b.x, seed * (b.x == b.y));
-        Differentiate(ctx, b.y, seed * (b.x == b.y));
+        differentiate(b.x, seed * (b.x == b.y));
+        differentiate(b.y, seed * (b.x == b.y));
         break;
     case BinaryOpType::MAX:
         // ∇(max(x, y)) = { s * (x > y), s * (y >= x) }
-        Differentiate(ctx, b.x, seed * (b.x > b.y));
-        Differentiate(ctx, b.y, seed * (b.y >= b.x));
+        differentiate(b.x, seed * (b.x > b.y));
+        differentiate(b.y, seed * (b.y >= b.x));
         break;
     }
 }
@@ -155,61 +191,926 @@ void Differentiate(BackpropContext &ctx, GraphNodeHandle node, GraphNodeHandle s
     node->Visit([&](auto &&x) { Differentiate(ctx, node, x, seed); });
 }
 
-namespace gigagrad
+// Builds the fused update kernels. Every Flush() emits one elementwise function that stores
+// each pending value into its target tensor.
+struct UpdateBuilder
 {
+    // State is named after its weight in snapshots, as <weight name>.<name>
+    GraphNodeHandle AddState(Shape shape, float initial_value, std::string name)
+    {
+        GraphNodeHandle state = network.AddInput(std::move(shape));
+        state_names.push_back({ std::move(name), state });
+        size_t size_elts = std::accumulate(
+            state.shape().begin(),
+            state.shape().end(),
+            dim_t{1},
+            std::multiplies{});
+        auto &storage = optimizer_state.emplace_back(new float[size_elts]);
+        std::fill(storage.get(), storage.get() + size_elts, initial_value);
+        state.data() = storage.get();
+        return state;
+    }
 
-TrainingContext CompileTrainingGraph(
+    std::string WeightName(GraphNodeHandle weight)
+    {
+        for(size_t i = 0; i < network.weights.size(); i++)
+        {
+            if(network.graph.inputs[network.weights[i]] == weight.node_idx)
+                return network.weight_names[i];
+        }
+        throw std::logic_error("Not a weight");
+    }
+
+    void Store(GraphNodeHandle target, GraphNodeHandle value)
+    {
+        size_t size_elts = std::accumulate(
+            target.shape().begin(),
+            target.shape().end(),
+            dim_t{1},
+            std::multiplies{});
+        values.push_back(value);
+        output_buffers.push_back(program.AddBuffer(target, size_elts));
+    }
+
+    void Flush()
+    {
+        codegen::CodegenElementwise(program, values, output_buffers);
+        values.clear();
+        output_buffers.clear();
+    }
+
+    // Like Flush(), but if the gradient was scheduled for fusion, the stores become the
+    // epilogue of the kernel that reduces the gradient.
+    void Flush(GraphNodeHandle gradient)
+    {
+        if(accumulators.contains(gradient.node_idx))
+        {
+            Shape zero_strides(gradient.shape().size(), 0);
+            Store(gradient, gradient.graph->Immediate(0.0f).as_strided(gradient.shape(), zero_strides, 0));
+        }
+        auto fused = fused_gradients.find(gradient.node_idx);
+        if(fused == fused_gradients.end())
+            return Flush();
+        codegen::CodegenReduceEpilogue(program, fused->second, values, output_buffers);
+        values.clear();
+        output_buffers.clear();
+    }
+
+    nn::Module &network;
+    codegen::Program &program;
+    std::vector<std::unique_ptr<float[]>> &optimizer_state;
+    std::vector<std::pair<std::string, GraphNodeHandle>> &state_names;
+    GraphNodeHandle learning_rate;
+    GraphNodeHandle loss_scale;
+    std::unordered_map<size_t, GraphNodeHandle> fused_gradients; // Gradient -> reduction that carries its update
+    std::unordered_set<size_t> accumulators; // Gradients that are reset to zero by their update
+    std::vector<GraphNodeHandle> values;
+    std::vector<size_t> output_buffers;
+};
+
+static GraphNodeHandle PreprocessGradient(
+    UpdateBuilder &u,
+    GraphNodeHandle weight,
+    GraphNodeHandle gradient,
+    float weight_decay,
+    float clip)
+{
+    gradient = gradient / u.loss_scale;
+    if(clip > 0.0f)
+        gradient = min(max(gradient, -clip), clip);
+    if(weight_decay != 0.0f)
+        gradient = gradient + weight_decay * weight;
+    return gradient;
+}
+
+// Collects the tensors that are read when node is generated inline, stopping at nodes that
+// already have their own function and at reductions, which get their own function.
+static void CollectInlineReads(
+    const codegen::Program &prog,
+    GraphNodeHandle node,
+    std::unordered_set<size_t> &visited,
+    std::unordered_set<size_t> &tensors,
+    std::vector<GraphNodeHandle> &reductions)
+{
+    if(!visited.insert(node.node_idx).second || prog.node_function_cache.contains(node.node_idx))
+        return;
+
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::Tensor:
+        tensors.insert(node.node_idx);
+        break;
+    case GraphNode::Kind::Immediate:
+        break;
+    case GraphNode::Kind::UnaryOp:
+        CollectInlineReads(prog, node->u.u.unary_op.x, visited, tensors, reductions);
+        break;
+    case GraphNode::Kind::BinaryOp:
+        CollectInlineReads(prog, node->u.b.binary_op.x, visited, tensors, reductions);
+        CollectInlineReads(prog, node->u.b.binary_op.y, visited, tensors, reductions);
+        break;
+    case GraphNode::Kind::ReduceOp:
+        reductions.push_back(node);
+        break;
+    case GraphNode::Kind::ViewOp:
+        CollectInlineReads(prog, node->u.v.view_op.x, visited, tensors, reductions);
+        break;
+    }
+}
+
+// Whether gradient is a reduction that can store an epilogue instead of its own values
+static bool IsFusableReduction(const codegen::Program &prog, GraphNodeHandle gradient)
+{
+    std::optional<GraphNodeHandle> reduction = codegen::FusableReduction(gradient);
+    return reduction && !prog.node_function_cache.contains(reduction->node_idx);
+}
+
+// Decides which of the candidate weight updates get fused into the kernel that reduces the
+// candidate's gradient contribution, and returns them in an order where each one comes before
+// the update of any weight it reads. Also returns the reductions those kernels read, which
+// must be materialized before the first update.
+static std::vector<size_t> ScheduleFusedUpdates(
+    const codegen::Program &prog,
+    const std::vector<Gradient> &candidates,
+    std::vector<GraphNodeHandle> &reductions)
+{
+    struct Reads
+    {
+        size_t candidate;
+        std::unordered_set<size_t> tensors;
+        std::vector<GraphNodeHandle> reductions;
+    };
+    std::vector<Reads> remaining;
+    for(size_t i = 0; i < candidates.size(); i++)
+    {
+        auto [weight, gradient] = candidates[i];
+        GraphNodeHandle reduction = *codegen::FusableReduction(gradient);
+
+        // A kernel that reads the weight it updates could see elements it has already updated
+        Reads reads = { i };
+        std::unordered_set<size_t> visited;
+        CollectInlineReads(prog, reduction->u.r.reduce_op.x, visited, reads.tensors, reads.reductions);
+        if(!reads.tensors.contains(weight.node_idx))
+            remaining.push_back(std::move(reads));
+    }
+
+    // A weight can only be updated once every other fused kernel that reads it has run. If
+    // the kernels read each other's weights in a cycle, update one of them separately.
+    std::vector<size_t> order;
+    while(!remaining.empty())
+    {
+        auto ready = std::find_if(remaining.begin(), remaining.end(), [&](const Reads &r)
+        {
+            size_t weight = candidates[r.candidate].input.node_idx;
+            return std::none_of(remaining.begin(), remaining.end(), [&](const Reads &other)
+            {
+                return other.candidate != r.candidate && other.tensors.contains(weight);
+            });
+        });
+        if(ready != remaining.end())
+        {
+            order.push_back(ready->candidate);
+            reductions.insert(reductions.end(), ready->reductions.begin(), ready->reductions.end());
+        }
+        else
+        {
+            ready = remaining.begin();
+        }
+        remaining.erase(ready);
+    }
+    return order;
+}
+
+// Materializes the sum of the contributions into a single buffer. The first two are summed
+// into a new buffer and every further one is added to that buffer in place, inside the
+// kernel that reduces it when possible.
+static GraphNodeHandle AccumulateGradient(
+    codegen::Program &prog,
+    const std::vector<GraphNodeHandle> &contributions)
+{
+    GraphNodeHandle sum = contributions[0];
+    if(contributions.size() == 1)
+    {
+        // Store a reduction seen through views directly rather than copying it through them
+        if(IsFusableReduction(prog, sum))
+            codegen::CodegenReduceEpilogue(prog, sum, { sum }, {});
+        else
+            CodegenNode(prog, sum);
+    }
+    for(size_t i = 1; i < contributions.size(); i++)
+    {
+        GraphNodeHandle contribution = contributions[i];
+        std::vector<size_t> accumulator;
+        if(i > 1)
+            accumulator.push_back(prog.GetOutputBufferForNodeIdx(sum.node_idx));
+        GraphNodeHandle partial_sum = sum + contribution;
+        if(IsFusableReduction(prog, contribution))
+            codegen::CodegenReduceEpilogue(prog, contribution, { partial_sum }, accumulator);
+        else if(i > 1)
+            CodegenNode(prog, partial_sum, accumulator[0]);
+        else
+            CodegenNode(prog, partial_sum);
+        sum = partial_sum;
+    }
+    return sum;
+}
+
+static void EmitUpdates(UpdateBuilder &u, const std::vector<Gradient> &weight_gradients, const Sgd &sgd)
+{
+    for(auto [weight, raw_gradient] : weight_gradients)
+    {
+        GraphNodeHandle gradient = PreprocessGradient(u, weight, raw_gradient, sgd.weight_decay, sgd.clip);
+        if(sgd.momentum == 0.0f)
+        {
+            u.Store(weight, weight - u.learning_rate * gradient);
+        }
+        else
+        {
+            // v = μv + g, w = w - αv
+            GraphNodeHandle velocity = u.AddState(weight.shape(), 0.0f, u.WeightName(weight) + ".velocity");
+            GraphNodeHandle new_velocity = sgd.momentum * velocity + gradient;
+            u.Store(weight, weight - u.learning_rate * new_velocity);
+            u.Store(velocity, new_velocity);
+        }
+        u.Flush(raw_gradient);
+    }
+}
+
+static void EmitUpdates(UpdateBuilder &u, const std::vector<Gradient> &weight_gradients, const Adam &adam)
+{
+    // β1^t and β2^t for bias correction, advanced once per step before the weight updates
+    GraphNodeHandle beta1_power = u.AddState({}, 1.0f, "adam.beta1_power");
+    GraphNodeHandle beta2_power = u.AddState({}, 1.0f, "adam.beta2_power");
+    u.Store(beta1_power, beta1_power * adam.beta1);
+    u.Store(beta2_power, beta2_power * adam.beta2);
+    u.Flush();
+
+    for(auto [weight, raw_gradient] : weight_gradients)
+    {
+        GraphNodeHandle gradient = PreprocessGradient(u, weight, raw_gradient, adam.weight_decay, adam.clip);
+        GraphNodeHandle m = u.AddState(weight.shape(), 0.0f, u.WeightName(weight) + ".adam_m");
+        GraphNodeHandle v = u.AddState(weight.shape(), 0.0f, u.WeightName(weight) + ".adam_v");
+        GraphNodeHandle new_m = adam.beta1 * m + (1.0f - adam.beta1) * gradient;
+        GraphNodeHandle new_v = adam.beta2 * v + (1.0f - adam.beta2) * (gradient * gradient);
+        GraphNodeHandle m_hat = new_m / (1.0f - beta1_power);
+        GraphNodeHandle v_hat = new_v / (1.0f - beta2_power);
+        u.Store(weight, weight - u.learning_rate * m_hat / (sqrt(v_hat) + adam.epsilon));
+        u.Store(m, new_m);
+        u.Store(v, new_v);
+        u.Flush(raw_gradient);
+    }
+}
+
+// Adds the contributions to the accumulator tensor in place, inside the kernel that reduces
+// each of them when possible
+static void AccumulateInto(
+    codegen::Program &prog,
+    GraphNodeHandle accumulator,
+    const std::vector<GraphNodeHandle> &contributions)
+{
+    size_t size_elts = std::accumulate(
+        accumulator.shape().begin(),
+        accumulator.shape().end(),
+        dim_t{1},
+        std::multiplies{});
+    size_t buffer = prog.AddBuffer(accumulator, size_elts);
+    GraphNodeHandle sum = accumulator;
+    for(GraphNodeHandle contribution : contributions)
+    {
+        GraphNodeHandle partial_sum = sum + contribution;
+        if(IsFusableReduction(prog, contribution))
+            codegen::CodegenReduceEpilogue(prog, contribution, { partial_sum }, { buffer });
+        else
+            CodegenNode(prog, partial_sum, buffer);
+        sum = partial_sum;
+    }
+}
+
+// Where the gradients end up when the update is compiled as its own entry point instead of
+// being fused into the gradient kernels
+struct SeparateUpdate
+{
+    // Add the gradients of every step to persistent accumulators, which the update resets
+    bool accumulate = false;
+
+    size_t loss_buffer;
+    std::vector<std::pair<size_t, size_t>> gradient_buffers; // (buffer, size_elts)
+    size_t gradient_entry_point;
+    size_t update_entry_point;
+};
+
+// Materializes the model output, the checkpoints of the policy and the loss, then drops every
+// other forward reduction from the cache so that the backward pass recomputes it where it's
+// needed. Returns the dropped reductions.
+static std::unordered_set<size_t> CodegenForward(
+    codegen::Program &prog,
+    GraphNodeHandle model_output,
+    GraphNodeHandle loss,
+    const CheckpointPolicy &checkpoint,
+    DataType activation_dtype)
+{
+    if(const CheckpointNodes *nodes = std::get_if<CheckpointNodes>(&checkpoint))
+    {
+        for(GraphNodeHandle node : nodes->nodes)
+            CodegenNode(prog, node);
+    }
+    CodegenNode(prog, loss);
+    if(std::holds_alternative<KeepActivations>(checkpoint))
+        return {};
+
+    std::unordered_set<size_t> keep = { model_output.node_idx, loss.node_idx };
+    if(const CheckpointNodes *nodes = std::get_if<CheckpointNodes>(&checkpoint))
+    {
+        for(GraphNodeHandle node : nodes->nodes)
+            keep.insert(node.node_idx);
+    }
+    else if(const CheckpointBudget *budget = std::get_if<CheckpointBudget>(&checkpoint))
+    {
+        // Activations are only stored as activation_dtype once the whole program is generated,
+        // see StoreActivationsAs, so size them as they will be stored
+        std::vector<std::pair<size_t, size_t>> activations; // (size_bytes, node_idx)
+        for(auto [node_idx, function_id] : prog.node_function_cache)
+        {
+            codegen::BufferDescriptor desc = prog.buffers[prog.functions[function_id].output_buffer];
+            desc.dtype = activation_dtype;
+            activations.push_back({ desc.SizeBytes(), node_idx });
+        }
+        std::sort(activations.begin(), activations.end());
+        size_t kept_bytes = 0;
+        for(auto [size_bytes, node_idx] : activations)
+        {
+            if(kept_bytes + size_bytes > budget->budget_bytes)
+                break;
+            kept_bytes += size_bytes;
+            keep.insert(node_idx);
+        }
+    }
+    std::unordered_set<size_t> dropped;
+    for(auto [node_idx, function_id] : prog.node_function_cache)
+    {
+        if(!keep.contains(node_idx))
+            dropped.insert(node_idx);
+    }
+    for(size_t node_idx : dropped)
+        prog.node_function_cache.erase(node_idx);
+    return dropped;
+}
+
+// Stores the forward activations of the program, including those that the backward pass reads,
+// as dtype. Everything else, like gradients, stays F32, and kernels compute in F32.
+static void StoreActivationsAs(
+    codegen::Program &prog,
+    GraphNodeHandle loss,
+    DataType dtype,
+    const std::unordered_set<size_t> &keep_f32)
+{
+    std::unordered_set<size_t> forward;
+    std::vector<GraphNodeHandle> to_visit = { loss };
+    while(!to_visit.empty())
+    {
+        GraphNodeHandle node = to_visit.back();
+        to_visit.pop_back();
+        if(!forward.insert(node.node_idx).second)
+            continue;
+        node->Visit([&](auto &&op)
+        {
+            using T = std::decay_t<decltype(op)>;
+            if constexpr(std::is_same_v<T, BinaryOp>)
+            {
+                to_visit.push_back(op.x);
+                to_visit.push_back(op.y);
+            }
+            else if constexpr(!std::is_same_v<T, Tensor> && !std::is_same_v<T, Immediate>)
+            {
+                to_visit.push_back(op.x);
+            }
+        });
+    }
+    for(const codegen::FunctionBuilder &fn : prog.functions)
+    {
+        codegen::BufferDescriptor &desc = prog.buffers[fn.output_buffer];
+        if(forward.contains(fn.node.node_idx)
+           && std::holds_alternative<size_t>(desc.id)
+           && !keep_f32.contains(fn.output_buffer))
+            desc.dtype = dtype;
+    }
+}
+
+static TrainingContext CompileTrainingProgram(
     nn::Module &network,
     GraphNodeHandle model_output,
     std::unique_ptr<codegen::Backend> backend,
-    float learning_rate)
+    Optimizer optimizer,
+    CheckpointPolicy checkpoint,
+    DataType activation_dtype,
+    SeparateUpdate *separate_update)
 {
-    GraphNodeHandle training_example = network.AddInput(model_output.shape()); 
+    const Shape &output_shape = model_output.shape();
+    GraphNodeHandle training_example = model_output->batched
+        ? network.AddInput(BatchDim{ output_shape[0] }, Shape(output_shape.begin() + 1, output_shape.end()))
+        : network.AddInput(output_shape);
     GraphNodeHandle error = model_output - training_example;
     GraphNodeHandle loss = sum(error * error);
-    GraphNodeHandle seed = network.Immediate(learning_rate);
+    GraphNodeHandle learning_rate = network.AddParameter(
+        std::visit([](auto &&opt) { return opt.learning_rate; }, optimizer));
+    GraphNodeHandle loss_scale = network.AddParameter(1.0f);
     BackpropContext ctx;
-    Differentiate(ctx, loss, seed);
-    CodegenNode(ctx.program, loss);
-    size_t loss_buffer_id = ctx.program.buffers.size() - 1;
+    Differentiate(ctx, loss, loss_scale);
+
+    // Evaluate() runs the functions of the training step that compute the model output, so
+    // it comes first, with its own buffer even where it could be fused into the loss
+    size_t first_forward_function = ctx.program.functions.size();
+    CodegenNode(ctx.program, model_output);
+    size_t output_buffer_id = ctx.program.GetOutputBufferForNodeIdx(model_output.node_idx);
+    size_t evaluate_entry_point = ctx.program.AddEntryPoint(first_forward_function, ctx.program.functions.size());
+    std::unordered_set<size_t> recomputed = CodegenForward(ctx.program, model_output, loss, checkpoint, activation_dtype);
+    size_t loss_buffer_id = ctx.program.GetOutputBufferForNodeIdx(loss.node_idx);
 
-    std::unordered_map<size_t, size_t> weights_to_buffers;
+    std::unordered_set<size_t> weights;
     for(size_t weight : network.weights)
+        weights.insert(network.graph.inputs[weight]);
+
+    // Group the gradient contributions of each weight
+    std::vector<GraphNodeHandle> weight_inputs;
+    std::vector<std::vector<GraphNodeHandle>> contributions;
+    std::unordered_map<size_t, size_t> weight_gradient_idx;
+    for(auto [input, gradient] : ctx.gradients)
     {
-        size_t node_idx = network.graph.inputs[weight];
-        weights_to_buffers[node_idx] = -1;
+        if(!weights.contains(input.node_idx))
+            continue;
+        auto [it, inserted] = weight_gradient_idx.try_emplace(input.node_idx, weight_inputs.size());
+        if(inserted)
+        {
+            weight_inputs.push_back(input);
+            contributions.emplace_back();
+        }
+        contributions[it->second].push_back(gradient);
     }
-    for(size_t ibuffer = 0; ibuffer < ctx.program.buffers.size(); ibuffer++)
+
+    // The update of a weight can be fused into the kernel reducing one of its contributions,
+    // which then adds in the sum of all the others. Fused updates run after every gradient, so
+    // the activations they read would stay alive until the end of the step, which is what
+    // checkpointing avoids.
+    std::vector<Gradient> candidates;
+    std::vector<size_t> candidate_weights;
+    bool fuse_updates = !separate_update && recomputed.empty();
+    for(size_t i = 0; i < weight_inputs.size() && fuse_updates; i++)
     {
-        const codegen::BufferDescriptor &id = ctx.program.buffers[ibuffer];
-        if(std::holds_alternative<GraphNodeHandle>(id.id))
+        auto fusable = std::find_if(contributions[i].rbegin(), contributions[i].rend(), [&](GraphNodeHandle c)
         {
-            GraphNodeHandle tensor = std::get<GraphNodeHandle>(id.id);
-            if(weights_to_buffers.contains(tensor.node_idx))
-                weights_to_buffers[tensor.node_idx] = ibuffer;
+            return c.shape() == weight_inputs[i].shape() && IsFusableReduction(ctx.program, c);
+        });
+        if(fusable == contributions[i].rend())
+            continue;
+        std::rotate(fusable.base() - 1, fusable.base(), contributions[i].end());
+        candidates.push_back({ weight_inputs[i], contributions[i].back() });
+        candidate_weights.push_back(i);
+    }
+    std::vector<GraphNodeHandle> fused_reductions;
+    std::vector<size_t> fused_order = ScheduleFusedUpdates(ctx.program, candidates, fused_reductions);
+    std::vector<bool> is_fused(weight_inputs.size(), false);
+    for(size_t icandidate : fused_order)
+        is_fused[candidate_weights[icandidate]] = true;
+
+    // Fused updates write their weight as soon as its gradient is reduced, so everything that
+    // reads weights must be computed before the first of them. Fused updates come first, and
+    // every other gradient is materialized up front.
+    std::vector<std::unique_ptr<float[]>> optimizer_state;
+    std::vector<std::pair<std::string, GraphNodeHandle>> snapshot_tensors;
+    for(size_t i = 0; i < network.weights.size(); i++)
+        snapshot_tensors.push_back({ network.weight_names[i], { &network.graph, network.graph.inputs[network.weights[i]] } });
+    UpdateBuilder update_builder = { network, ctx.program, optimizer_state, snapshot_tensors, learning_rate, loss_scale };
+    std::vector<Gradient> weight_gradients(weight_inputs.size());
+    for(size_t i = 0; i < weight_inputs.size(); i++)
+    {
+        std::vector<GraphNodeHandle> &c = contributions[i];
+        if(separate_update && separate_update->accumulate)
+        {
+            GraphNodeHandle accumulator = update_builder.AddState(
+                weight_inputs[i].shape(),
+                0.0f,
+                update_builder.WeightName(weight_inputs[i]) + ".accumulator");
+            AccumulateInto(ctx.program, accumulator, c);
+            weight_gradients[i] = { weight_inputs[i], accumulator };
+            update_builder.accumulators.insert(accumulator.node_idx);
+            continue;
         }
+        if(!is_fused[i])
+        {
+            weight_gradients[i] = { weight_inputs[i], AccumulateGradient(ctx.program, c) };
+
+            // Recompute activations again for the next gradient rather than keeping them alive
+            for(size_t node_idx : recomputed)
+                ctx.program.node_function_cache.erase(node_idx);
+            continue;
+        }
+        GraphNodeHandle gradient = c.back();
+        if(c.size() > 1)
+            gradient = AccumulateGradient(ctx.program, { c.begin(), c.end() - 1 }) + gradient;
+        weight_gradients[i] = { weight_inputs[i], gradient };
+        update_builder.fused_gradients.emplace(gradient.node_idx, c.back());
     }
+    for(GraphNodeHandle reduction : fused_reductions)
+        CodegenNode(ctx.program, reduction);
+    size_t first_update_function = ctx.program.functions.size();
 
-    for(size_t i = 0; i < ctx.gradients.size(); i++)
+    std::vector<Gradient> ordered_gradients;
+    for(size_t icandidate : fused_order)
+        ordered_gradients.push_back(weight_gradients[candidate_weights[icandidate]]);
+    for(size_t i = 0; i < weight_inputs.size(); i++)
     {
-        size_t weight_idx = ctx.gradients[i].input.node_idx;
-        if(weights_to_buffers.contains(weight_idx))
-            CodegenNode(ctx.program, ctx.gradients[i].gradient);
+        if(!is_fused[i])
+            ordered_gradients.push_back(weight_gradients[i]);
     }
-    for(size_t i = 0; i < ctx.gradients.size(); i++)
+
+    std::visit([&](auto &&opt) { EmitUpdates(update_builder, ordered_gradients, opt); }, optimizer);
+
+    if(separate_update)
     {
-        size_t weight_idx = ctx.gradients[i].input.node_idx;
-        if(weights_to_buffers.contains(weight_idx))
+        separate_update->loss_buffer = loss_buffer_id;
+        for(auto [input, gradient] : ordered_gradients)
         {
-            size_t gradient_buffer_idx = weights_to_buffers[weight_idx];
-            auto [weight, gradient] = ctx.gradients[i];
-            CodegenNode(ctx.program, (weight - gradient), gradient_buffer_idx);
+            size_t buffer = gradient->Kind() == GraphNode::Kind::Tensor
+                ? *ctx.program.FindBuffer(gradient)
+                : ctx.program.GetOutputBufferForNodeIdx(gradient.node_idx);
+            separate_update->gradient_buffers.push_back({ buffer, ctx.program.buffers[buffer].size_elts });
         }
+        separate_update->gradient_entry_point = ctx.program.AddEntryPoint(0, first_update_function);
+        separate_update->update_entry_point = ctx.program.AddEntryPoint(
+            first_update_function,
+            ctx.program.functions.size());
     }
+    std::optional<size_t> accumulate_entry_point;
+    std::optional<size_t> update_entry_point;
+    if(separate_update && separate_update->accumulate)
+    {
+        accumulate_entry_point = separate_update->gradient_entry_point;
+        update_entry_point = separate_update->update_entry_point;
+    }
+
+    // The loss, the model output and the gradients are read between entry points and after
+    // the step
+    std::vector<size_t> live_out = { loss_buffer_id, output_buffer_id };
+    if(separate_update)
+    {
+        for(auto [buffer, size_elts] : separate_update->gradient_buffers)
+            live_out.push_back(buffer);
+    }
+    if(activation_dtype != DataType::F32)
+        StoreActivationsAs(ctx.program, loss, activation_dtype, { loss_buffer_id, output_buffer_id });
+    ctx.program.PlanMemory(live_out);
+    size_t intermediate_bytes = ctx.program.IntermediateBytes();
+
     backend->LowerProgram(std::move(ctx.program));
     backend->InitBuffers();
 
     float *loss_buffer = static_cast<float *>(backend->GetBuffer(loss_buffer_id));
-    return { loss_buffer, training_example.data(), std::move(backend) };
+    float *output_buffer = static_cast<float *>(backend->GetBuffer(output_buffer_id));
+    return
+    {
+        loss_buffer,
+        output_buffer,
+        training_example.data(),
+        *learning_rate.data(),
+        *loss_scale.data(),
+        training_example,
+        std::move(backend),
+        std::move(optimizer_state),
+        std::move(snapshot_tensors),
+        accumulate_entry_point,
+        update_entry_point,
+        evaluate_entry_point,
+        intermediate_bytes,
+    };
+}
+
+namespace gigagrad
+{
+
+TrainingContext CompileTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    Optimizer optimizer,
+    CheckpointPolicy checkpoint,
+    DataType activation_dtype)
+{
+    return CompileTrainingProgram(
+        network,
+        model_output,
+        std::move(backend),
+        std::move(optimizer),
+        std::move(checkpoint),
+        activation_dtype,
+        nullptr);
+}
+
+TrainingContext CompileTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    float learning_rate)
+{
+    return CompileTrainingGraph(network, model_output, std::move(backend), Sgd{ .learning_rate = learning_rate });
+}
+
+TrainingContext CompileAccumulatingTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    Optimizer optimizer)
+{
+    SeparateUpdate separate_update = { .accumulate = true };
+    return CompileTrainingProgram(
+        network,
+        model_output,
+        std::move(backend),
+        std::move(optimizer),
+        KeepActivations{},
+        DataType::F32,
+        &separate_update);
+}
+
+void TrainingContext::Accumulate()
+{
+    if(!this->accumulate_entry_point)
+        throw std::logic_error("Accumulate() needs a graph compiled with CompileAccumulatingTrainingGraph");
+    this->backend->ExecuteEntryPoint(*this->accumulate_entry_point);
+}
+
+void TrainingContext::Update()
+{
+    if(!this->update_entry_point)
+        throw std::logic_error("Update() needs a graph compiled with CompileAccumulatingTrainingGraph");
+    this->backend->ExecuteEntryPoint(*this->update_entry_point);
+}
+
+void TrainingContext::ExecuteSteps(
+    size_t num_steps,
+    GraphNodeHandle input,
+    void *input_base,
+    float *label_base,
+    float *losses,
+    std::optional<size_t> input_stride_elts,
+    std::optional<size_t> label_stride_elts)
+{
+    auto num_elements = [](GraphNodeHandle t)
+    {
+        return static_cast<size_t>(std::accumulate(
+            t.shape().begin(),
+            t.shape().end(),
+            dim_t{1},
+            std::multiplies{}));
+    };
+    std::vector<codegen::SteppedInput> inputs =
+    {
+        { input, input_base, input_stride_elts.value_or(num_elements(input)) },
+        { this->training_example_tensor, label_base, label_stride_elts.value_or(num_elements(this->training_example_tensor)) },
+    };
+    this->backend->ExecuteSteps(num_steps, inputs, this->loss, losses);
+}
+
+void TrainingContext::Snapshot(std::string path)
+{
+    // Async steps update the weights and optimizer state on the backend's worker thread
+    this->backend->WaitForAsync();
+    this->WaitForSnapshot();
+    std::vector<CheckpointTensor> tensors;
+    for(auto &[name, tensor] : this->snapshot_tensors)
+        tensors.push_back({ name, tensor->dtype, tensor.shape(), tensor.data() });
+    StageCheckpoint(tensors, this->snapshot_image);
+    this->snapshot_write = std::async(
+        std::launch::async,
+        [image = std::move(this->snapshot_image), path = std::move(path)]() mutable
+        {
+            WriteCheckpointImage(image, path);
+            return std::move(image);
+        });
+}
+
+void TrainingContext::WaitForSnapshot()
+{
+    if(this->snapshot_write.valid())
+        this->snapshot_image = this->snapshot_write.get();
+}
+
+void TrainingContext::Restore(const Checkpoint &checkpoint)
+{
+    this->backend->WaitForAsync();
+    for(auto &[name, tensor] : this->snapshot_tensors)
+    {
+        if(checkpoint.Find(name).dtype != tensor->dtype || checkpoint.Find(name).shape != tensor.shape())
+            throw std::domain_error("Tensor " + name + " has a different type or shape in the checkpoint");
+    }
+    for(auto &[name, tensor] : this->snapshot_tensors)
+    {
+        const Checkpoint::Entry &entry = checkpoint.Find(name);
+        size_t size_bytes = std::accumulate(entry.shape.begin(), entry.shape.end(), dim_t{1}, std::multiplies{}) * SizeOf(entry.dtype);
+        // Weights loaded from this checkpoint already point at its values
+        std::memmove(tensor.data(), checkpoint.Data(entry), size_bytes);
+    }
+}
+
+DataParallelTrainingContext::Workers::Workers(size_t num_threads)
+{
+    for(size_t ithread = 0; ithread < num_threads; ithread++)
+    {
+        this->threads.emplace_back([this, ithread]()
+        {
+            size_t seen_generation = 0;
+            std::unique_lock<std::mutex> lock(this->mutex);
+            for(;;)
+            {
+                this->cv.wait(lock, [&] { return this->stop || this->generation != seen_generation; });
+                if(this->stop)
+                    return;
+                seen_generation = this->generation;
+                lock.unlock();
+                this->task(ithread + 1);
+                lock.lock();
+                if(--this->num_pending == 0)
+                    this->cv.notify_all();
+            }
+        });
+    }
+}
+
+DataParallelTrainingContext::Workers::~Workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stop = true;
+    }
+    this->cv.notify_all();
+    for(std::thread &thread : this->threads)
+        thread.join();
+}
+
+void DataParallelTrainingContext::Workers::Run(std::function<void(size_t)> fn)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->task = std::move(fn);
+        this->num_pending = this->threads.size();
+        this->generation++;
+    }
+    this->cv.notify_all();
+    this->task(0);
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->cv.wait(lock, [&] { return this->num_pending == 0; });
+}
+
+void DataParallelTrainingContext::Execute()
+{
+    size_t num_replicas = this->replicas.size() + 1;
+    auto replica = [&](size_t ireplica) -> codegen::Backend &
+    {
+        return ireplica == 0 ? *this->context.backend : *this->replicas[ireplica - 1];
+    };
+
+    this->workers->Run([&](size_t ireplica)
+    {
+        // Replica 0 trains on the first slice, which is the input data itself. Binding it
+        // would pin the input to this step's pointer for later runs of the context.
+        codegen::Backend &backend = replica(ireplica);
+        for(GraphNodeHandle input : this->batched_inputs)
+        {
+            size_t slice_elts = std::accumulate(input.shape().begin(), input.shape().end(), dim_t{1}, std::multiplies{});
+            char *data = reinterpret_cast<char *>(input.data());
+            if(ireplica != 0)
+                backend.BindInput(input, data + ireplica * slice_elts * SizeOf(input->dtype));
+        }
+        backend.ExecuteEntryPoint(this->gradient_entry_point);
+    });
+
+    // Every thread sums its own chunk of each gradient over all replicas into replica 0, so
+    // no two threads touch the same cache lines except at chunk boundaries
+    this->workers->Run([&](size_t ithread)
+    {
+        for(auto [buffer, size_elts] : this->gradient_buffers)
+        {
+            size_t chunk_elts = (size_elts + num_replicas - 1) / num_replicas;
+            size_t begin = std::min(size_elts, ithread * chunk_elts);
+            size_t end = std::min(size_elts, begin + chunk_elts);
+            float *sum = static_cast<float *>(this->context.backend->GetBuffer(buffer));
+            for(size_t ireplica = 1; ireplica < num_replicas; ireplica++)
+            {
+                const float *gradient = static_cast<const float *>(replica(ireplica).GetBuffer(buffer));
+                for(size_t i = begin; i < end; i++)
+                    sum[i] += gradient[i];
+            }
+        }
+    });
+    this->context.backend->ExecuteEntryPoint(this->update_entry_point);
+
+    this->loss = 0.0f;
+    for(size_t ireplica = 0; ireplica < num_replicas; ireplica++)
+        this->loss += *static_cast<const float *>(replica(ireplica).GetBuffer(this->loss_buffer));
 }
+
+DataParallelTrainingContext CompileDataParallelTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    size_t num_replicas,
+    std::vector<GraphNodeHandle> batched_inputs,
+    Optimizer optimizer)
+{
+    if(num_replicas == 0)
+        throw std::domain_error("Data parallel training needs at least one replica");
+
+    SeparateUpdate separate_update;
+    TrainingContext context = CompileTrainingProgram(
+        network,
+        model_output,
+        std::move(backend),
+        std::move(optimizer),
+        KeepActivations{},
+        DataType::F32,
+        &separate_update);
+    batched_inputs.push_back(context.training_example_tensor);
+
+    std::vector<std::unique_ptr<codegen::Backend>> replicas;
+    for(size_t ireplica = 1; ireplica < num_replicas; ireplica++)
+        replicas.push_back(context.backend->CreateReplica());
+
+    return
+    {
+        0.0f,
+        context.training_example,
+        context.learning_rate,
+        context.loss_scale,
+        std::move(context),
+        std::move(replicas),
+        std::move(batched_inputs),
+        separate_update.loss_buffer,
+        std::move(separate_update.gradient_buffers),
+        separate_update.gradient_entry_point,
+        separate_update.update_entry_point,
+        std::make_unique<DataParallelTrainingContext::Workers>(num_replicas - 1),
+    };
+}
+
+void DistributedTrainingContext::Execute()
+{
+    codegen::Backend &backend = *this->context.backend;
+    backend.ExecuteEntryPoint(this->gradient_entry_point);
+
+    float *flat = this->reduce_buffer.data();
+    for(auto [buffer, size_elts] : this->gradient_buffers)
+    {
+        const float *gradient = static_cast<const float *>(backend.GetBuffer(buffer));
+        flat = std::copy(gradient, gradient + size_elts, flat);
+    }
+    *flat = *static_cast<const float *>(backend.GetBuffer(this->loss_buffer));
+
+    RingAllReduce(*this->transport, this->reduce_buffer.data(), this->reduce_buffer.size());
+
+    flat = this->reduce_buffer.data();
+    for(auto [buffer, size_elts] : this->gradient_buffers)
+    {
+        std::copy(flat, flat + size_elts, static_cast<float *>(backend.GetBuffer(buffer)));
+        flat += size_elts;
+    }
+    this->loss = *flat;
+    backend.ExecuteEntryPoint(this->update_entry_point);
+}
+
+DistributedTrainingContext CompileDistributedTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    std::unique_ptr<Transport> transport,
+    Optimizer optimizer)
+{
+    SeparateUpdate separate_update;
+    TrainingContext context = CompileTrainingProgram(
+        network,
+        model_output,
+        std::move(backend),
+        std::move(optimizer),
+        KeepActivations{},
+        DataType::F32,
+        &separate_update);
+
+    size_t reduce_elts = 1;
+    for(auto [buffer, size_elts] : separate_update.gradient_buffers)
+        reduce_elts += size_elts;
+
+    return
+    {
+        0.0f,
+        context.training_example,
+        context.learning_rate,
+        context.loss_scale,
+        std::move(context),
+        std::move(transport),
+        separate_update.loss_buffer,
+        std::move(separate_update.gradient_buffers),
+        separate_update.gradient_entry_point,
+        separate_update.update_entry_point,
+        std::vector<float>(reduce_elts),
+    };
+}
+
 }
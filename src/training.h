@@ -2,30 +2,295 @@
 
 #include "graph.h"
 #include "codegen.h"
+#include "allreduce.h"
+#include "checkpoint.h"
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
 
 namespace gigagrad
 {
 
+// Stochastic gradient descent, optionally with momentum. The learning rate is only the initial
+// value of TrainingContext::learning_rate.
+struct Sgd
+{
+    float learning_rate = 0.1f;
+    float momentum = 0.0f;
+    float weight_decay = 0.0f;
+    float clip = 0.0f; // If positive, gradients are clipped to [-clip, clip]
+};
+
+struct Adam
+{
+    float learning_rate = 0.001f;
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    float weight_decay = 0.0f;
+    float clip = 0.0f; // If positive, gradients are clipped to [-clip, clip]
+};
+
+using Optimizer = std::variant<Sgd, Adam>;
+
+// Activation checkpointing policies: which forward activations stay materialized until the
+// backward pass reads them. Activations that are not kept are recomputed right before the
+// backward kernels that read them, so their memory can be reused in between.
+struct KeepActivations
+{
+};
+
+// Keeps only the given forward nodes, plus whatever the loss needs
+struct CheckpointNodes
+{
+    std::vector<GraphNodeHandle> nodes;
+};
+
+// Keeps as many forward activations as fit in budget_bytes, smallest first
+struct CheckpointBudget
+{
+    size_t budget_bytes;
+};
+
+using CheckpointPolicy = std::variant<KeepActivations, CheckpointNodes, CheckpointBudget>;
+
 struct TrainingContext
 {
     float *loss;
+    float *output; // Model output of the last step or Evaluate()
     float *&training_example;
+    // Scalar parameters read by the kernels on every step, so they can follow a schedule
+    // without recompiling. The loss is multiplied by loss_scale before backpropagation and
+    // gradients are divided by it before the update.
+    float &learning_rate;
+    float &loss_scale;
+    GraphNodeHandle training_example_tensor;
     std::unique_ptr<codegen::Backend> backend;
+    std::vector<std::unique_ptr<float[]>> optimizer_state; // Backing memory of optimizer state tensors
+    // Weights and optimizer state by name, as Snapshot() writes them
+    std::vector<std::pair<std::string, GraphNodeHandle>> snapshot_tensors;
+
+    // Only set by CompileAccumulatingTrainingGraph, see Accumulate() and Update()
+    std::optional<size_t> accumulate_entry_point;
+    std::optional<size_t> update_entry_point;
+    size_t evaluate_entry_point;
+
+    // Peak memory taken by intermediate buffers, which share memory when their lifetimes don't
+    // overlap. Does not include weights, inputs and optimizer state.
+    size_t intermediate_bytes;
 
     void Execute() { backend->Execute(); }
+
+    // Runs only the part of the training step that computes the model output from the current
+    // inputs and weights, writing it to output. Doesn't read the training example and leaves
+    // the weights unchanged.
+    void Evaluate() { backend->ExecuteEntryPoint(evaluate_entry_point); }
+
+    // Trains on the first batch_size examples of the next batches, if the network has a BatchDim
+    void SetBatchSize(size_t batch_size) { backend->SetBatchSize(batch_size); }
+
+    // Adds the gradients of the current batch to the accumulators, without updating weights
+    void Accumulate();
+
+    // Updates the weights with the accumulated gradients and resets the accumulators to zero
+    void Update();
+
+    // Queues a training step on the backend's worker thread, see Backend::ExecuteAsync. The
+    // step's loss is written to *loss, if given, before the future is ready, since loss is
+    // overwritten by the steps queued after it.
+    std::future<void> ExecuteAsync(float *loss = nullptr) { return backend->ExecuteAsync(this->loss, loss); }
+
+    // Runs num_steps training steps inside the generated code. Step i trains on the batches at
+    // input_base and label_base advanced i times by their strides, in elements, and its loss
+    // is written to losses[i]. Strides default to the size of the tensor, i.e. batches stored
+    // back to back.
+    void ExecuteSteps(
+        size_t num_steps,
+        GraphNodeHandle input,
+        void *input_base,
+        float *label_base,
+        float *losses,
+        std::optional<size_t> input_stride_elts = std::nullopt,
+        std::optional<size_t> label_stride_elts = std::nullopt);
+
+    // Copies the weights and optimizer state into a staging buffer and writes it as a
+    // checkpoint to path on a background thread, so training only waits for the copy. Call
+    // it between steps. Waits for steps queued with ExecuteAsync() and for the previous
+    // snapshot to be written first.
+    void Snapshot(std::string path);
+
+    // Waits for the last snapshot to be written, and rethrows the error if writing it failed
+    void WaitForSnapshot();
+
+    // Copies the weights and optimizer state of a snapshot into the current buffers, to
+    // resume training where the snapshot was taken
+    void Restore(const Checkpoint &checkpoint);
+
+    std::vector<uint8_t> snapshot_image;
+    std::future<std::vector<uint8_t>> snapshot_write; // Returns snapshot_image once written
+};
+
+// Trains num_replicas copies of a network on consecutive slices of each batch, one replica per
+// thread. The network is built for the batch of a single replica, and batched inputs and the
+// training example point at num_replicas of those batches. Replicas share one compiled program
+// and the weights; their gradients are summed and the weights are updated once per step.
+struct DataParallelTrainingContext
+{
+    float loss; // Summed over all replicas by Execute()
+    float *&training_example;
+    float &learning_rate;
+    float &loss_scale;
+    TrainingContext context; // Runs replica 0 and the update
+    std::vector<std::unique_ptr<codegen::Backend>> replicas; // Replicas 1 and up
+    std::vector<GraphNodeHandle> batched_inputs; // Includes the training example
+    size_t loss_buffer;
+    std::vector<std::pair<size_t, size_t>> gradient_buffers; // (buffer, size_elts)
+    size_t gradient_entry_point;
+    size_t update_entry_point;
+
+    // Threads that stay alive between steps. Run(fn) calls fn(i) for every thread i, with
+    // i = 0 on the calling thread, and returns once all calls are done.
+    struct Workers
+    {
+        Workers(size_t num_threads);
+        ~Workers();
+        void Run(std::function<void(size_t)> fn);
+
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::function<void(size_t)> task;
+        size_t generation = 0;
+        size_t num_pending = 0;
+        bool stop = false;
+    };
+    std::unique_ptr<Workers> workers;
+
+    void Execute();
+};
+
+// Trains one replica of a network per process. Every process computes the gradients of its own
+// batch, sums them with all other processes over the transport and applies the same update, so
+// the weights stay identical as long as all processes start from the same weights.
+struct DistributedTrainingContext
+{
+    float loss; // Summed over all processes by Execute()
+    float *&training_example;
+    float &learning_rate;
+    float &loss_scale;
+    TrainingContext context;
+    std::unique_ptr<Transport> transport;
+    size_t loss_buffer;
+    std::vector<std::pair<size_t, size_t>> gradient_buffers; // (buffer, size_elts)
+    size_t gradient_entry_point;
+    size_t update_entry_point;
+    std::vector<float> reduce_buffer; // All gradients and the loss, reduced in one all-reduce
+
+    void Execute();
 };
 
-// TODO: Allow dynamic learning rate
+// Forward activations, including the ones the backward pass reads, are stored as
+// activation_dtype. Weights, gradients, the optimizer state and the loss stay F32, and
+// reductions accumulate in F32.
+TrainingContext CompileTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    Optimizer optimizer,
+    CheckpointPolicy checkpoint = KeepActivations{},
+    DataType activation_dtype = DataType::F32);
+
 TrainingContext CompileTrainingGraph(
     nn::Module &network,
     GraphNodeHandle model_output,
     std::unique_ptr<codegen::Backend> backend,
     float learning_rate = 0.1f);
 
+// Compiles a training graph whose gradients accumulate over any number of Accumulate() calls,
+// e.g. over micro-batches, until Update() applies them. Execute() does both for a single batch.
+TrainingContext CompileAccumulatingTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    Optimizer optimizer);
+
+template <typename TBackend>
+TrainingContext CompileTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    Optimizer optimizer,
+    CheckpointPolicy checkpoint = KeepActivations{},
+    DataType activation_dtype = DataType::F32)
+{
+    return CompileTrainingGraph(
+        network,
+        model_output,
+        std::make_unique<TBackend>(),
+        std::move(optimizer),
+        std::move(checkpoint),
+        activation_dtype);
+}
+
 template <typename TBackend>
 TrainingContext CompileTrainingGraph(nn::Module &network, GraphNodeHandle model_output, float learning_rate = 0.1f)
 {
     return CompileTrainingGraph(network, model_output, std::make_unique<TBackend>(), learning_rate);
 }
 
+template <typename TBackend>
+TrainingContext CompileAccumulatingTrainingGraph(nn::Module &network, GraphNodeHandle model_output, Optimizer optimizer)
+{
+    return CompileAccumulatingTrainingGraph(network, model_output, std::make_unique<TBackend>(), std::move(optimizer));
+}
+
+DataParallelTrainingContext CompileDataParallelTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    size_t num_replicas,
+    std::vector<GraphNodeHandle> batched_inputs,
+    Optimizer optimizer);
+
+DistributedTrainingContext CompileDistributedTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    std::unique_ptr<Transport> transport,
+    Optimizer optimizer);
+
+template <typename TBackend>
+DistributedTrainingContext CompileDistributedTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<Transport> transport,
+    Optimizer optimizer)
+{
+    return CompileDistributedTrainingGraph(
+        network,
+        model_output,
+        std::make_unique<TBackend>(),
+        std::move(transport),
+        std::move(optimizer));
+}
+
+template <typename TBackend>
+DataParallelTrainingContext CompileDataParallelTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    size_t num_replicas,
+    std::vector<GraphNodeHandle> batched_inputs,
+    Optimizer optimizer)
+{
+    return CompileDataParallelTrainingGraph(
+        network,
+        model_output,
+        std::make_unique<TBackend>(),
+        num_replicas,
+        std::move(batched_inputs),
+        std::move(optimizer));
+}
+
 }
@@ -3,12 +3,283 @@
 #include "src/codegen.h"
 #include "src/backend_scalar_c.h"
 #include "src/training.h"
+#include "src/inference.h"
+#include "src/dataloader.h"
+#include "src/checkpoint.h"
+#include "src/fixed.h"
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstdio>
+#include <filesystem>
 #include <random>
+#include <thread>
+
+#include <unistd.h>
 
 namespace gg = gigagrad;
 
+static std::default_random_engine Gen(0);
+
+void RandomMatrix(float *m, size_t size_elts)
+{
+    std::uniform_real_distribution<float> dist(-2.0f, 2.0f);
+    for(size_t i = 0; i < size_elts; i++)
+        m[i] = dist(Gen);
+}
+
+void NaiveMatmul(float *x, float *y, size_t A, size_t B, size_t C, float *result)
+{
+    for(size_t irow = 0; irow < A; irow++)
+    {
+        float *row = x + B * irow;
+        for(size_t icol = 0; icol < C; icol++)
+        {
+            float res = 0.0f;
+
+            float *col = y + icol;
+            for(size_t i = 0; i < B; i++)
+            {
+                res += row[i] * col[C * i];
+            }
+            result[C * irow + icol] = res;
+        }
+    }
+}
+
+// Periodic inputs, labels and initial weights for the networks the training tests build, so
+// that a failing step can be worked out by hand. Inputs and weights are offset from symmetric
+// so that sums don't cancel to zero, where relu's gradient would hinge on rounding.
+void FillInputs(float *x, size_t size_elts)
+{
+    for(size_t i = 0; i < size_elts; i++)
+        x[i] = 0.1f * static_cast<float>(i % 11) - 0.43f;
+}
+
+void FillLabels(float *y, size_t size_elts)
+{
+    for(size_t i = 0; i < size_elts; i++)
+        y[i] = 0.02f * static_cast<float>(i % 13);
+}
+
+void FillWeights(float *w, size_t size_elts)
+{
+    for(size_t i = 0; i < size_elts; i++)
+        w[i] = 0.05f * static_cast<float>((i * 7) % 17) - 0.37f;
+}
+
+// Weights after training and the loss of every step
+struct TrainingRun
+{
+    std::vector<float> weights;
+    std::vector<float> losses;
+};
+
+void RequireClose(const TrainingRun &run, const TrainingRun &expected, float tolerance)
+{
+    REQUIRE(run.weights.size() == expected.weights.size());
+    REQUIRE(run.losses.size() == expected.losses.size());
+    for(size_t i = 0; i < run.weights.size(); i++)
+        REQUIRE(std::abs(run.weights[i] - expected.weights[i]) <= tolerance * std::max(1.0f, std::abs(expected.weights[i])));
+    for(size_t i = 0; i < run.losses.size(); i++)
+        REQUIRE(std::abs(run.losses[i] - expected.losses[i]) <= tolerance * std::max(1.0f, std::abs(expected.losses[i])));
+}
+
+// w * x / input_scale, with a weight of Cols elements broadcast over the Rows rows of x,
+// trained with SGD
+struct ScaleNetwork
+{
+    static constexpr gg::dim_t Rows = 2, Cols = 4;
+    static constexpr float LearningRate = 0.01f;
+    static constexpr std::array<float, Cols> InitialWeights = { -0.1f, 0.1f, -0.001f, 0.0001f };
+
+    gg::nn::Module network;
+    gg::GraphNodeHandle x;
+    gg::GraphNodeHandle w;
+    TrainingRun run = { { InitialWeights.begin(), InitialWeights.end() }, {} };
+    gg::TrainingContext ctx;
+
+    explicit ScaleNetwork(gg::DataType dtype = gg::DataType::F32, float input_scale = 1.0f)
+        : x(network.AddInput({ Rows, Cols }, dtype)),
+          w(network.AddWeight(Cols)),
+          ctx(gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, w * x / input_scale, LearningRate))
+    {
+        w.data() = run.weights.data();
+    }
+};
+
+// The steps of ScaleNetwork on consecutive batches of x and y, computed on the CPU
+TrainingRun ReferenceScaleSteps(size_t num_steps, const float *x, const float *y, float input_scale = 1.0f)
+{
+    constexpr gg::dim_t Rows = ScaleNetwork::Rows, Cols = ScaleNetwork::Cols;
+    TrainingRun run = { { ScaleNetwork::InitialWeights.begin(), ScaleNetwork::InitialWeights.end() }, {} };
+    for(size_t step = 0; step < num_steps; step++)
+    {
+        float loss = 0.0f, gradient[Cols] = {};
+        for(gg::dim_t i = 0; i < Rows * Cols; i++)
+        {
+            float xi = x[step * Rows * Cols + i] / input_scale;
+            float error = run.weights[i % Cols] * xi - y[step * Rows * Cols + i];
+            loss += error * error;
+            gradient[i % Cols] += 2.0f * error * xi;
+        }
+        for(gg::dim_t i = 0; i < Cols; i++)
+            run.weights[i] -= ScaleNetwork::LearningRate * gradient[i];
+        run.losses.push_back(loss);
+    }
+    return run;
+}
+
+// Initial weights of fully connected layers of the given sizes, stored back to back. Each
+// layer's are scaled by its number of inputs, so that deep stacks neither blow up nor vanish.
+std::vector<float> MlpWeights(const std::vector<gg::dim_t> &sizes)
+{
+    std::vector<float> weights;
+    for(size_t l = 0; l + 1 < sizes.size(); l++)
+    {
+        std::vector<float> layer(sizes[l + 1] * sizes[l]);
+        FillWeights(layer.data(), layer.size());
+        for(float &w : layer)
+            w *= 3.0f / std::sqrt(static_cast<float>(sizes[l]));
+        weights.insert(weights.end(), layer.begin(), layer.end());
+    }
+    return weights;
+}
+
+// Fully connected layers relu(w % h), the last one without the relu. Layer l has a weight of
+// shape { sizes[l + 1], sizes[l] }, and the weights are stored back to back in run.weights.
+struct Mlp
+{
+    gg::nn::Module network;
+    gg::GraphNodeHandle x;
+    std::vector<gg::GraphNodeHandle> layers;
+    std::vector<gg::GraphNodeHandle> activations; // Output of every layer, the last is the result
+    std::vector<float> x_data, y_data;
+    TrainingRun run;
+
+    // With batch_dim, the batch dimension of x is a BatchDim of size batch
+    Mlp(gg::dim_t batch, const std::vector<gg::dim_t> &sizes, bool batch_dim = false)
+        : x(batch_dim
+            ? network.AddInput(gg::BatchDim{ batch }, { sizes.front(), 1 })
+            : network.AddInput({ batch, sizes.front(), 1 })),
+          x_data(batch * sizes.front()),
+          y_data(batch * sizes.back()),
+          run{ MlpWeights(sizes), {} }
+    {
+        gg::GraphNodeHandle h = x;
+        for(size_t l = 0; l + 1 < sizes.size(); l++)
+        {
+            layers.push_back(network.AddWeight({ sizes[l + 1], sizes[l] }));
+            h = layers.back() % h;
+            if(l + 2 < sizes.size())
+                h = h.relu();
+            activations.push_back(h);
+        }
+        FillInputs(x_data.data(), x_data.size());
+        FillLabels(y_data.data(), y_data.size());
+    }
+
+    gg::GraphNodeHandle result() const { return activations.back(); }
+
+    // Points the input and the weights at their data, and the context at the labels
+    void Bind(gg::TrainingContext &ctx)
+    {
+        x.data() = x_data.data();
+        float *weights = run.weights.data();
+        for(gg::GraphNodeHandle w : layers)
+        {
+            w.data() = weights;
+            weights += w.shape()[0] * w.shape()[1];
+        }
+        ctx.training_example = y_data.data();
+    }
+
+    // Runs num_steps steps, recording their losses
+    void Train(gg::TrainingContext &ctx, size_t num_steps)
+    {
+        Bind(ctx);
+        for(size_t step = 0; step < num_steps; step++)
+        {
+            ctx.Execute();
+            run.losses.push_back(*ctx.loss);
+        }
+    }
+};
+
+// The steps of SGD on Mlp(batch, sizes), computed on the CPU
+TrainingRun ReferenceMlpSteps(gg::dim_t batch, const std::vector<gg::dim_t> &sizes, size_t num_steps, float learning_rate)
+{
+    std::vector<float> x(batch * sizes.front()), y(batch * sizes.back());
+    FillInputs(x.data(), x.size());
+    FillLabels(y.data(), y.size());
+    TrainingRun run = { MlpWeights(sizes), {} };
+    std::vector<size_t> offsets = { 0 }; // Of every layer's weight in run.weights
+    for(size_t l = 0; l + 1 < sizes.size(); l++)
+        offsets.push_back(offsets.back() + sizes[l + 1] * sizes[l]);
+
+    for(size_t step = 0; step < num_steps; step++)
+    {
+        // activations[l] is the input of layer l, { batch, sizes[l] }
+        std::vector<std::vector<float>> activations = { x };
+        for(size_t l = 0; l + 1 < sizes.size(); l++)
+        {
+            const float *w = run.weights.data() + offsets[l];
+            std::vector<float> h(batch * sizes[l + 1], 0.0f);
+            for(gg::dim_t b = 0; b < batch; b++)
+            {
+                for(gg::dim_t o = 0; o < sizes[l + 1]; o++)
+                {
+                    for(gg::dim_t i = 0; i < sizes[l]; i++)
+                        h[b * sizes[l + 1] + o] += w[o * sizes[l] + i] * activations[l][b * sizes[l] + i];
+                    if(l + 2 < sizes.size())
+                        h[b * sizes[l + 1] + o] = std::max(h[b * sizes[l + 1] + o], 0.0f);
+                }
+            }
+            activations.push_back(std::move(h));
+        }
+
+        float loss = 0.0f;
+        std::vector<float> error(y.size());
+        for(size_t i = 0; i < y.size(); i++)
+        {
+            float diff = activations.back()[i] - y[i];
+            loss += diff * diff;
+            error[i] = 2.0f * diff;
+        }
+        run.losses.push_back(loss);
+
+        // Gradients are taken with the weights of this step, which are updated after
+        std::vector<float> gradient(run.weights.size(), 0.0f);
+        for(ssize_t l = std::ssize(sizes) - 2; l >= 0; l--)
+        {
+            const float *w = run.weights.data() + offsets[l];
+            std::vector<float> input_error(batch * sizes[l], 0.0f);
+            for(gg::dim_t b = 0; b < batch; b++)
+            {
+                for(gg::dim_t o = 0; o < sizes[l + 1]; o++)
+                {
+                    for(gg::dim_t i = 0; i < sizes[l]; i++)
+                    {
+                        gradient[offsets[l] + o * sizes[l] + i] += error[b * sizes[l + 1] + o] * activations[l][b * sizes[l] + i];
+                        input_error[b * sizes[l] + i] += error[b * sizes[l + 1] + o] * w[o * sizes[l] + i];
+                    }
+                }
+            }
+            // The input of every layer but the first went through a relu
+            for(size_t i = 0; i < input_error.size(); i++)
+            {
+                if(activations[l][i] <= 0.0f)
+                    input_error[i] = 0.0f;
+            }
+            error = std::move(input_error);
+        }
+        for(size_t i = 0; i < run.weights.size(); i++)
+            run.weights[i] -= learning_rate * gradient[i];
+    }
+    return run;
+}
+
 void TestGradient(
     gg::nn::Module &network,
     gg::GraphNodeHandle w,
@@ -133,6 +404,854 @@ TEST_CASE("TestTrainSimple", "[Train]")
     }
 }
 
+TEST_CASE("TestExecuteAsync", "[Train]")
+{
+    constexpr size_t NumSteps = 20, BatchElts = ScaleNetwork::Rows * ScaleNetwork::Cols;
+    float x_data[NumSteps * BatchElts], label_data[NumSteps * BatchElts];
+    FillInputs(x_data, NumSteps * BatchElts);
+    FillLabels(label_data, NumSteps * BatchElts);
+
+    ScaleNetwork async, sync;
+    std::vector<std::future<void>> steps;
+    async.run.losses.resize(NumSteps);
+    for(size_t i = 0; i < NumSteps; i++)
+    {
+        // Rebinding the input while the previous step may still be running
+        async.x.data() = &x_data[i * BatchElts];
+        async.ctx.training_example = &label_data[i * BatchElts];
+        steps.push_back(async.ctx.ExecuteAsync(&async.run.losses[i]));
+
+        sync.x.data() = &x_data[i * BatchElts];
+        sync.ctx.training_example = &label_data[i * BatchElts];
+        sync.ctx.Execute();
+        sync.run.losses.push_back(*sync.ctx.loss);
+    }
+    for(auto &step : steps)
+        step.get();
+    REQUIRE(async.run.weights == sync.run.weights);
+    REQUIRE(async.run.losses == sync.run.losses);
+    RequireClose(sync.run, ReferenceScaleSteps(NumSteps, x_data, label_data), 1e-5f);
+}
+
+TEST_CASE("TestExecuteSteps", "[Train]")
+{
+    constexpr size_t NumSteps = 3, BatchElts = ScaleNetwork::Rows * ScaleNetwork::Cols;
+    float x_data[NumSteps * BatchElts], label_data[NumSteps * BatchElts];
+    FillInputs(x_data, NumSteps * BatchElts);
+    FillLabels(label_data, NumSteps * BatchElts);
+
+    ScaleNetwork stepped, looped;
+    stepped.run.losses.resize(NumSteps);
+    stepped.ctx.ExecuteSteps(NumSteps, stepped.x, x_data, label_data, stepped.run.losses.data());
+    for(size_t i = 0; i < NumSteps; i++)
+    {
+        looped.x.data() = &x_data[i * BatchElts];
+        looped.ctx.training_example = &label_data[i * BatchElts];
+        looped.ctx.Execute();
+        looped.run.losses.push_back(*looped.ctx.loss);
+    }
+    REQUIRE(stepped.run.weights == looped.run.weights);
+    REQUIRE(stepped.run.losses == looped.run.losses);
+    RequireClose(stepped.run, ReferenceScaleSteps(NumSteps, x_data, label_data), 1e-5f);
+}
+
+TEST_CASE("TestExecuteStepsStride", "[Train]")
+{
+    // Batches with padding between them train like batches stored back to back
+    constexpr size_t NumSteps = 3, BatchElts = ScaleNetwork::Rows * ScaleNetwork::Cols, Stride = BatchElts + 3;
+    float x_data[NumSteps * BatchElts], x_padded[NumSteps * Stride];
+    float label_data[NumSteps * BatchElts], label_padded[NumSteps * Stride];
+    FillInputs(x_data, NumSteps * BatchElts);
+    FillLabels(label_data, NumSteps * BatchElts);
+    std::fill(std::begin(x_padded), std::end(x_padded), NAN);
+    std::fill(std::begin(label_padded), std::end(label_padded), NAN);
+    for(size_t i = 0; i < NumSteps * BatchElts; i++)
+    {
+        x_padded[i / BatchElts * Stride + i % BatchElts] = x_data[i];
+        label_padded[i / BatchElts * Stride + i % BatchElts] = label_data[i];
+    }
+
+    ScaleNetwork padded, packed;
+    padded.run.losses.resize(NumSteps);
+    packed.run.losses.resize(NumSteps);
+    padded.ctx.ExecuteSteps(NumSteps, padded.x, x_padded, label_padded, padded.run.losses.data(), Stride, Stride);
+    packed.ctx.ExecuteSteps(NumSteps, packed.x, x_data, label_data, packed.run.losses.data());
+    REQUIRE(padded.run.weights == packed.run.weights);
+    REQUIRE(padded.run.losses == packed.run.losses);
+    RequireClose(padded.run, ReferenceScaleSteps(NumSteps, x_data, label_data), 1e-5f);
+}
+
+TEST_CASE("TestTypedInputs", "[Codegen]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 2, 3 }, gg::DataType::U8);
+    auto s = graph.AddInput({ 3 }, gg::DataType::I16);
+    auto scaled = x.cast(gg::DataType::F32) / 255.0f + s;
+    auto rounded = (x * 0.3f).cast(gg::DataType::I8) + 0.0f;
+
+    uint8_t x_data[] = { 0, 1, 10, 128, 254, 255 };
+    int16_t s_data[] = { -300, 0, 300 };
+    x.data() = reinterpret_cast<float *>(x_data);
+    s.data() = reinterpret_cast<float *>(s_data);
+    auto scaled_result = scaled.Compile<gg::codegen::BackendScalarC>();
+    auto rounded_result = rounded.Compile<gg::codegen::BackendScalarC>();
+    scaled_result.Execute();
+    rounded_result.Execute();
+    for(size_t i = 0; i < 6; i++)
+    {
+        REQUIRE(scaled_result.data[i] == Approx(x_data[i] / 255.0f + s_data[i % 3]));
+        REQUIRE(rounded_result.data[i] == std::min(127.0f, std::nearbyint(x_data[i] * 0.3f)));
+    }
+}
+
+TEST_CASE("TestExecuteStepsTypedInput", "[Train]")
+{
+    // Stepping through raw bytes trains like stepping through the same values as floats
+    constexpr size_t NumSteps = 3, BatchElts = ScaleNetwork::Rows * ScaleNetwork::Cols;
+    uint8_t x_bytes[NumSteps * BatchElts];
+    float x_data[NumSteps * BatchElts], label_data[NumSteps * BatchElts];
+    for(size_t i = 0; i < NumSteps * BatchElts; i++)
+    {
+        x_bytes[i] = static_cast<uint8_t>(7 * i);
+        x_data[i] = static_cast<float>(x_bytes[i]);
+    }
+    FillLabels(label_data, NumSteps * BatchElts);
+
+    ScaleNetwork bytes(gg::DataType::U8, 255.0f), floats(gg::DataType::F32, 255.0f);
+    bytes.run.losses.resize(NumSteps);
+    floats.run.losses.resize(NumSteps);
+    bytes.ctx.ExecuteSteps(NumSteps, bytes.x, x_bytes, label_data, bytes.run.losses.data());
+    floats.ctx.ExecuteSteps(NumSteps, floats.x, x_data, label_data, floats.run.losses.data());
+    RequireClose(bytes.run, floats.run, 1e-5f);
+    RequireClose(floats.run, ReferenceScaleSteps(NumSteps, x_data, label_data, 255.0f), 1e-5f);
+}
+
+template <typename TOptimizer, typename TReferenceStep>
+void TestOptimizer(TOptimizer optimizer, TReferenceStep reference_step)
+{
+    constexpr int NumSteps = 4;
+    gg::nn::Module network;
+    auto w = network.AddWeight(2);
+    auto result = w * 1.0f;
+    float w_data[] = { 1.0f, -0.5f };
+    float example[] = { 0.0f, 0.0f };
+    w.data() = w_data;
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, result, optimizer);
+    ctx.training_example = example;
+
+    float expected[] = { 1.0f, -0.5f };
+    for(int istep = 1; istep <= NumSteps; istep++)
+    {
+        ctx.Execute();
+        for(int i = 0; i < 2; i++)
+        {
+            // ∂/∂w (w - 0)^2 = 2w
+            reference_step(i, istep, expected[i], 2.0f * expected[i]);
+            REQUIRE(std::abs(w_data[i] - expected[i]) < 1e-4f);
+        }
+    }
+}
+
+TEST_CASE("TestIdxBatchLoader", "[Data]")
+{
+    // 10 examples of 2 x 3 big-endian int16s, and one uint8 label each
+    constexpr size_t N = 10, B = 4, C = 4;
+    std::string prefix = "/tmp/gg-idx-test-" + std::to_string(getpid());
+    auto write = [](const std::string &path, std::vector<uint8_t> bytes)
+    {
+        FILE *file = std::fopen(path.c_str(), "wb");
+        std::fwrite(bytes.data(), 1, bytes.size(), file);
+        std::fclose(file);
+    };
+    std::vector<uint8_t> inputs = { 0, 0, 0x0B, 3, 0, 0, 0, N, 0, 0, 0, 2, 0, 0, 0, 3 };
+    std::vector<uint8_t> labels = { 0, 0, 0x08, 1, 0, 0, 0, N };
+    for(size_t i = 0; i < N; i++)
+    {
+        for(size_t j = 0; j < 6; j++)
+        {
+            int16_t value = static_cast<int16_t>(i * 100 + j) - 500;
+            inputs.push_back(static_cast<uint8_t>(static_cast<uint16_t>(value) >> 8));
+            inputs.push_back(static_cast<uint8_t>(value));
+        }
+        labels.push_back(static_cast<uint8_t>(i % C));
+    }
+    write(prefix + "-inputs", inputs);
+    write(prefix + "-labels", labels);
+
+    {
+        gg::IdxBatchLoader loader(prefix + "-inputs", prefix + "-labels", { .batch_size = B, .num_classes = C, .num_buffers = 2 });
+        REQUIRE(loader.InputType() == gg::DataType::I16);
+        REQUIRE(loader.ExampleShape() == gg::Shape{ 2, 3 });
+        REQUIRE(loader.NumBatches() == 3);
+        for(size_t epoch = 0; epoch < 3; epoch++)
+        {
+            std::vector<bool> seen(N, false);
+            for(size_t ibatch = 0; ibatch < loader.NumBatches(); ibatch++)
+            {
+                gg::IdxBatchLoader::Batch batch = loader.Next();
+                REQUIRE(batch.epoch == epoch);
+                REQUIRE(batch.size == (ibatch == 2 ? N % B : B));
+                const int16_t *values = static_cast<const int16_t *>(batch.inputs);
+                for(size_t i = 0; i < batch.size; i++)
+                {
+                    size_t example = static_cast<size_t>(values[i * 6] + 500) / 100;
+                    REQUIRE(example < N);
+                    REQUIRE(!seen[example]);
+                    seen[example] = true;
+                    for(size_t j = 0; j < 6; j++)
+                        REQUIRE(values[i * 6 + j] == static_cast<int16_t>(example * 100 + j) - 500);
+                    for(size_t c = 0; c < C; c++)
+                        REQUIRE(batch.labels[i * C + c] == (c == example % C ? 1.0f : 0.0f));
+                }
+            }
+            REQUIRE(std::count(seen.begin(), seen.end(), true) == N);
+        }
+    }
+    std::remove((prefix + "-inputs").c_str());
+    std::remove((prefix + "-labels").c_str());
+}
+
+TEST_CASE("TestCheckpoint", "[Data]")
+{
+    std::string path = "/tmp/gg-checkpoint-test-" + std::to_string(getpid());
+    float w_data[3 * 5], b_data[5];
+    for(size_t i = 0; i < 3 * 5; i++)
+        w_data[i] = 0.25f * i - 1.0f;
+    for(size_t i = 0; i < 5; i++)
+        b_data[i] = -0.5f * i;
+    {
+        gg::nn::Module network;
+        auto w = network.AddWeight({ 3, 5 }, "fc.weight");
+        auto b = network.AddWeight(5);
+        REQUIRE(network.weight_names == std::vector<std::string>{ "fc.weight", "weight1" });
+        REQUIRE_THROWS(network.AddWeight(5, "fc.weight"));
+        w.data() = w_data;
+        b.data() = b_data;
+        gg::SaveCheckpoint(network, path);
+    }
+
+    gg::Checkpoint checkpoint(path);
+    REQUIRE(checkpoint.tensors.size() == 2);
+    REQUIRE(checkpoint.tensors[0].name == "fc.weight");
+    REQUIRE(checkpoint.tensors[0].shape == gg::Shape{ 3, 5 });
+
+    // Loaded weights point into the mapping and can be trained without changing the file
+    gg::nn::Module network;
+    auto x = network.AddInput({ 1, 3 });
+    auto w = network.AddWeight({ 3, 5 }, "fc.weight");
+    auto b = network.AddWeight(5);
+    checkpoint.Load(network);
+    for(gg::GraphNodeHandle weight : { w, b })
+    {
+        char *data = reinterpret_cast<char *>(weight.data());
+        REQUIRE(data > static_cast<char *>(checkpoint.mapping));
+        REQUIRE(data < static_cast<char *>(checkpoint.mapping) + checkpoint.mapping_bytes);
+        REQUIRE(reinterpret_cast<uintptr_t>(data) % gg::CheckpointAlignment == 0);
+    }
+    REQUIRE(std::equal(w_data, w_data + 3 * 5, w.data()));
+    REQUIRE(std::equal(b_data, b_data + 5, b.data()));
+
+    float x_data[3] = { 1.0f, 2.0f, -1.0f };
+    float example[5] = {};
+    x.data() = x_data;
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, x % w + b, 0.1f);
+    ctx.training_example = example;
+    ctx.Execute();
+    REQUIRE(!std::equal(w_data, w_data + 3 * 5, w.data()));
+    {
+        gg::nn::Module reloaded;
+        auto reloaded_w = reloaded.AddWeight({ 3, 5 }, "fc.weight");
+        reloaded.AddWeight(5);
+        gg::Checkpoint fresh(path);
+        fresh.Load(reloaded);
+        REQUIRE(std::equal(w_data, w_data + 3 * 5, reloaded_w.data()));
+    }
+
+    gg::nn::Module mismatched;
+    mismatched.AddWeight({ 5, 3 }, "fc.weight");
+    REQUIRE_THROWS(checkpoint.Load(mismatched));
+    gg::nn::Module missing;
+    missing.AddWeight(5, "bias");
+    REQUIRE_THROWS(checkpoint.Load(missing));
+    std::remove(path.c_str());
+}
+
+TEST_CASE("TestTrainingSnapshot", "[Train]")
+{
+    // Resuming from a snapshot continues exactly like the run it was taken from, including the
+    // Adam moments and bias correction
+    std::string path = "/tmp/gg-snapshot-test-" + std::to_string(getpid());
+    float x_data[2 * 3] = { 1.0f, -2.0f, 0.5f, 0.25f, 1.5f, -1.0f };
+    float example[2 * 2] = { 1.0f, 0.0f, -1.0f, 0.5f };
+    auto train = [&](float *w_data, float *b_data, const std::string *resume_from, size_t steps_before_snapshot)
+    {
+        gg::nn::Module network;
+        auto x = network.AddInput({ 2, 3 });
+        auto w = network.AddWeight({ 3, 2 }, "w");
+        auto b = network.AddWeight(2, "b");
+        gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, x % w + b, gg::Adam{ .learning_rate = 0.05f });
+        x.data() = x_data;
+        w.data() = w_data;
+        b.data() = b_data;
+        ctx.training_example = example;
+        if(resume_from)
+            ctx.Restore(gg::Checkpoint(*resume_from));
+        // The snapshot must include steps that are still queued
+        for(size_t step = 0; step < steps_before_snapshot; step++)
+            ctx.ExecuteAsync();
+        if(!resume_from)
+            ctx.Snapshot(path);
+        for(size_t step = 0; step < 2; step++)
+            ctx.Execute();
+        ctx.WaitForSnapshot();
+    };
+
+    float w_data[3 * 2] = { 0.1f, -0.2f, 0.3f, -0.4f, 0.5f, -0.6f }, b_data[2] = { 0.0f, 0.1f };
+    train(w_data, b_data, nullptr, 3);
+    gg::Checkpoint snapshot(path);
+    REQUIRE(snapshot.Find("w.adam_m").shape == gg::Shape{ 3, 2 });
+    REQUIRE(*static_cast<float *>(snapshot.Data(snapshot.Find("adam.beta1_power"))) == Approx(0.9f * 0.9f * 0.9f));
+
+    float resumed_w[3 * 2] = {}, resumed_b[2] = {};
+    train(resumed_w, resumed_b, &path, 0);
+    REQUIRE(std::equal(w_data, w_data + 3 * 2, resumed_w));
+    REQUIRE(std::equal(b_data, b_data + 2, resumed_b));
+    std::remove(path.c_str());
+}
+
+TEST_CASE("TestOptimizer_Momentum", "[Train]")
+{
+    gg::Sgd sgd = { .learning_rate = 0.1f, .momentum = 0.9f, .clip = 1.5f };
+    float velocity[2] = {};
+    TestOptimizer(sgd, [&](int i, int, float &w, float g)
+    {
+        g = std::clamp(g, -sgd.clip, sgd.clip);
+        velocity[i] = sgd.momentum * velocity[i] + g;
+        w -= sgd.learning_rate * velocity[i];
+    });
+}
+
+TEST_CASE("TestOptimizer_Adam", "[Train]")
+{
+    gg::Adam adam = { .learning_rate = 0.1f, .weight_decay = 0.01f };
+    float m[2] = {};
+    float v[2] = {};
+    TestOptimizer(adam, [&](int i, int t, float &w, float g)
+    {
+        g += adam.weight_decay * w;
+        m[i] = adam.beta1 * m[i] + (1.0f - adam.beta1) * g;
+        v[i] = adam.beta2 * v[i] + (1.0f - adam.beta2) * g * g;
+        float m_hat = m[i] / (1.0f - std::pow(adam.beta1, t));
+        float v_hat = v[i] / (1.0f - std::pow(adam.beta2, t));
+        w -= adam.learning_rate * m_hat / (std::sqrt(v_hat) + adam.epsilon);
+    });
+}
+
+TEST_CASE("TestDynamicLearningRate", "[Train]")
+{
+    gg::nn::Module network;
+    auto w = network.AddWeight(1);
+    auto result = w * 1.0f;
+    float w_data = 1.0f;
+    float example = 0.0f;
+    w.data() = &w_data;
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, result, 0.1f);
+    ctx.training_example = &example;
+    REQUIRE(ctx.learning_rate == 0.1f);
+
+    float expected = 1.0f;
+    float schedule[] = { 0.1f, 0.0f, 0.5f, 0.25f };
+    float loss_scales[] = { 1.0f, 1024.0f, 0.5f, 8.0f };
+    for(int i = 0; i < 4; i++)
+    {
+        ctx.learning_rate = schedule[i];
+        ctx.loss_scale = loss_scales[i];
+        ctx.Execute();
+        // ∂/∂w (w - 0)^2 = 2w, loss scaling must not change the update
+        expected -= schedule[i] * 2.0f * expected;
+        REQUIRE(std::abs(w_data - expected) < 1e-5f);
+    }
+}
+
+TEST_CASE("TestFusedUpdate", "[Train]")
+{
+    // Two batched linear layers: both weight updates are fused into the kernels that reduce
+    // their gradients, and w1's gradient reads w2, so it has to be reduced before w2 changes.
+    constexpr int B = 4, I = 3, H = 2, O = 2, N = 5;
+    gg::nn::Module network;
+    auto x = network.AddInput({ B, I, 1 });
+    auto w1 = network.AddWeight({ H, I });
+    auto w2 = network.AddWeight({ O, H });
+    auto result = w2 % (w1 % x);
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, result, 0.01f);
+
+    float x_data[B * I], y_data[B * O], w1_data[H * I], w2_data[O * H];
+    for(int i = 0; i < B * I; i++)
+        x_data[i] = 0.1f * (i % 7) - 0.2f;
+    for(int i = 0; i < B * O; i++)
+        y_data[i] = 0.05f * i;
+    for(int i = 0; i < H * I; i++)
+        w1_data[i] = 0.1f * i - 0.3f;
+    for(int i = 0; i < O * H; i++)
+        w2_data[i] = 0.2f * i - 0.1f;
+    float w1_ref[H * I], w2_ref[O * H];
+    std::copy(std::begin(w1_data), std::end(w1_data), w1_ref);
+    std::copy(std::begin(w2_data), std::end(w2_data), w2_ref);
+    x.data() = x_data;
+    w1.data() = w1_data;
+    w2.data() = w2_data;
+    ctx.training_example = y_data;
+
+    for(int step = 0; step < N; step++)
+    {
+        ctx.Execute();
+
+        float g1[H * I] = {}, g2[O * H] = {};
+        for(int b = 0; b < B; b++)
+        {
+            float h[H] = {};
+            for(int j = 0; j < H; j++)
+                for(int i = 0; i < I; i++)
+                    h[j] += w1_ref[j * I + i] * x_data[b * I + i];
+            for(int o = 0; o < O; o++)
+            {
+                float out = 0.0f;
+                for(int j = 0; j < H; j++)
+                    out += w2_ref[o * H + j] * h[j];
+                float e = 2.0f * (out - y_data[b * O + o]);
+                for(int j = 0; j < H; j++)
+                {
+                    g2[o * H + j] += e * h[j];
+                    for(int i = 0; i < I; i++)
+                        g1[j * I + i] += e * w2_ref[o * H + j] * x_data[b * I + i];
+                }
+            }
+        }
+        for(int i = 0; i < H * I; i++)
+            w1_ref[i] -= 0.01f * g1[i];
+        for(int i = 0; i < O * H; i++)
+            w2_ref[i] -= 0.01f * g2[i];
+
+        for(int i = 0; i < H * I; i++)
+            REQUIRE(std::abs(w1_data[i] - w1_ref[i]) < 1e-5f);
+        for(int i = 0; i < O * H; i++)
+            REQUIRE(std::abs(w2_data[i] - w2_ref[i]) < 1e-5f);
+    }
+}
+
+TEST_CASE("TestTiedWeights", "[Train]")
+{
+    // w is used by both layers. Its two gradient contributions are summed into one update,
+    // which is fused into the kernel reducing the second contribution.
+    constexpr int B = 4, H = 2, N = 5;
+    gg::nn::Module network;
+    auto x = network.AddInput({ B, H, 1 });
+    auto w = network.AddWeight({ H, H });
+    auto result = w % (w % x);
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, result, 0.01f);
+
+    // Forward: w % x, w % (w % x), the loss. Backward: the reduction that backpropagates
+    // through the outer layer, the first contribution, and the second with the update.
+    // Evaluate() runs the first two.
+    auto &backend = static_cast<gg::codegen::BackendScalarC &>(*ctx.backend);
+    REQUIRE(backend.program.functions.size() == 6);
+    const gg::codegen::EntryPoint &evaluate = backend.program.entry_points[ctx.evaluate_entry_point];
+    REQUIRE(evaluate.first_function == 0);
+    REQUIRE(evaluate.end_function == 2);
+
+    float x_data[B * H], y_data[B * H], w_data[H * H], w_ref[H * H];
+    for(int i = 0; i < B * H; i++)
+    {
+        x_data[i] = 0.1f * (i % 5) - 0.2f;
+        y_data[i] = 0.05f * i;
+    }
+    for(int i = 0; i < H * H; i++)
+        w_data[i] = w_ref[i] = 0.2f * i - 0.3f;
+    x.data() = x_data;
+    w.data() = w_data;
+    ctx.training_example = y_data;
+
+    for(int step = 0; step < N; step++)
+    {
+        ctx.Execute();
+
+        float g[H * H] = {};
+        for(int b = 0; b < B; b++)
+        {
+            float h[H] = {}, out[H] = {}, e[H], g_h[H] = {};
+            for(int j = 0; j < H; j++)
+                for(int i = 0; i < H; i++)
+                    h[j] += w_ref[j * H + i] * x_data[b * H + i];
+            for(int o = 0; o < H; o++)
+            {
+                for(int j = 0; j < H; j++)
+                    out[o] += w_ref[o * H + j] * h[j];
+                e[o] = 2.0f * (out[o] - y_data[b * H + o]);
+            }
+            for(int o = 0; o < H; o++)
+                for(int j = 0; j < H; j++)
+                {
+                    g[o * H + j] += e[o] * h[j];
+                    g_h[j] += e[o] * w_ref[o * H + j];
+                }
+            for(int j = 0; j < H; j++)
+                for(int i = 0; i < H; i++)
+                    g[j * H + i] += g_h[j] * x_data[b * H + i];
+        }
+        for(int i = 0; i < H * H; i++)
+        {
+            w_ref[i] -= 0.01f * g[i];
+            REQUIRE(std::abs(w_data[i] - w_ref[i]) < 1e-5f);
+        }
+    }
+}
+
+TEST_CASE("TestDataParallel", "[Train]")
+{
+    // Three replicas training on slices of 2 examples must match one network trained on all 6
+    constexpr int R = 3, B = 2, I = 3, O = 2, N = 4;
+    auto build = [](gg::nn::Module &network, gg::dim_t batch)
+    {
+        auto x = network.AddInput({ batch, I, 1 });
+        auto w = network.AddWeight({ O, I });
+        auto b = network.AddWeight({ O, 1 });
+        return std::make_tuple(x, w, b, ((w % x) + b).relu());
+    };
+
+    float x_data[R * B * I], y_data[R * B * O];
+    for(int i = 0; i < R * B * I; i++)
+        x_data[i] = 0.1f * (i % 7) - 0.2f;
+    for(int i = 0; i < R * B * O; i++)
+        y_data[i] = 0.05f * i;
+    float w_data[O * I], b_data[O] = { 0.1f, 0.2f };
+    for(int i = 0; i < O * I; i++)
+        w_data[i] = 0.1f * i - 0.1f;
+    float w_ref[O * I], b_ref[O];
+    std::copy(std::begin(w_data), std::end(w_data), w_ref);
+    std::copy(std::begin(b_data), std::end(b_data), b_ref);
+
+    gg::nn::Module reference;
+    auto [x1, w1, b1, result1] = build(reference, R * B);
+    gg::TrainingContext ctx1 = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+        reference, result1, gg::Sgd{ .learning_rate = 0.05f, .momentum = 0.5f });
+    x1.data() = x_data;
+    w1.data() = w_ref;
+    b1.data() = b_ref;
+    ctx1.training_example = y_data;
+
+    gg::nn::Module network;
+    auto [x, w, b, result] = build(network, B);
+    gg::DataParallelTrainingContext ctx = gg::CompileDataParallelTrainingGraph<gg::codegen::BackendScalarC>(
+        network, result, R, { x }, gg::Sgd{ .learning_rate = 0.05f, .momentum = 0.5f });
+    REQUIRE(ctx.replicas.size() == R - 1);
+    x.data() = x_data;
+    w.data() = w_data;
+    b.data() = b_data;
+    ctx.training_example = y_data;
+
+    for(int step = 0; step < N; step++)
+    {
+        ctx1.Execute();
+        ctx.Execute();
+        REQUIRE(std::abs(ctx.loss - *ctx1.loss) < 1e-5f);
+        for(int i = 0; i < O * I; i++)
+            REQUIRE(std::abs(w_data[i] - w_ref[i]) < 1e-5f);
+        for(int i = 0; i < O; i++)
+            REQUIRE(std::abs(b_data[i] - b_ref[i]) < 1e-5f);
+    }
+
+    // Replica 0 must read inputs rebound after a step, like a single context does
+    float x_next[B * I];
+    for(int i = 0; i < B * I; i++)
+        x_next[i] = 0.3f - 0.05f * i;
+    x.data() = x_next;
+    ctx.context.Evaluate();
+    for(int ib = 0; ib < B; ib++)
+    {
+        for(int o = 0; o < O; o++)
+        {
+            float expected = b_data[o];
+            for(int i = 0; i < I; i++)
+                expected += w_data[o * I + i] * x_next[ib * I + i];
+            REQUIRE(ctx.context.output[ib * O + o] == Approx(std::max(expected, 0.0f)));
+        }
+    }
+}
+
+TEST_CASE("TestRingAllReduce", "[Train]")
+{
+    // The ranks run on threads here, but talk only through their sockets like processes would
+    constexpr size_t R = 3, N = 1001;
+    std::string prefix = "/tmp/gg-allreduce-test-" + std::to_string(getpid());
+    std::array<std::vector<float>, R> data;
+    std::vector<std::thread> ranks;
+    for(size_t rank = 0; rank < R; rank++)
+    {
+        data[rank].resize(N);
+        for(size_t i = 0; i < N; i++)
+            data[rank][i] = static_cast<float>(rank * 1000 + i);
+        ranks.emplace_back([&, rank]()
+        {
+            gg::UnixSocketTransport transport(prefix, rank, R);
+            gg::RingAllReduce(transport, data[rank].data(), N, 64);
+        });
+    }
+    for(std::thread &rank : ranks)
+        rank.join();
+
+    for(size_t rank = 0; rank < R; rank++)
+        for(size_t i = 0; i < N; i++)
+            REQUIRE(data[rank][i] == static_cast<float>(3000 + 3 * i));
+}
+
+TEST_CASE("TestDistributedTraining", "[Train]")
+{
+    // Two ranks training on 2 examples each must match one network trained on all 4
+    constexpr int R = 2, B = 2, I = 3, O = 2, N = 4;
+    auto build = [](gg::nn::Module &network, gg::dim_t batch)
+    {
+        auto x = network.AddInput({ batch, I, 1 });
+        auto w = network.AddWeight({ O, I });
+        return std::make_tuple(x, w, (w % x).relu());
+    };
+
+    float x_data[R * B * I], y_data[R * B * O], w_ref[O * I];
+    for(int i = 0; i < R * B * I; i++)
+        x_data[i] = 0.1f * (i % 7) - 0.2f;
+    for(int i = 0; i < R * B * O; i++)
+        y_data[i] = 0.05f * i;
+    for(int i = 0; i < O * I; i++)
+        w_ref[i] = 0.1f * i - 0.1f;
+    std::array<std::array<float, O * I>, R> w_data;
+    for(int rank = 0; rank < R; rank++)
+        std::copy(std::begin(w_ref), std::end(w_ref), w_data[rank].begin());
+
+    gg::nn::Module reference;
+    auto [x1, w1, result1] = build(reference, R * B);
+    gg::TrainingContext ctx1 = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(reference, result1, gg::Adam{});
+    x1.data() = x_data;
+    w1.data() = w_ref;
+    ctx1.training_example = y_data;
+    std::array<float, N> reference_losses;
+    for(int step = 0; step < N; step++)
+    {
+        ctx1.Execute();
+        reference_losses[step] = *ctx1.loss;
+    }
+
+    std::string prefix = "/tmp/gg-distributed-test-" + std::to_string(getpid());
+    std::array<std::array<float, N>, R> losses;
+    std::vector<std::thread> ranks;
+    for(int rank = 0; rank < R; rank++)
+    {
+        ranks.emplace_back([&, rank]()
+        {
+            gg::nn::Module network;
+            auto [x, w, result] = build(network, B);
+            gg::DistributedTrainingContext ctx = gg::CompileDistributedTrainingGraph<gg::codegen::BackendScalarC>(
+                network, result, std::make_unique<gg::UnixSocketTransport>(prefix, rank, R), gg::Adam{});
+            x.data() = x_data + rank * B * I;
+            w.data() = w_data[rank].data();
+            ctx.training_example = y_data + rank * B * O;
+            for(int step = 0; step < N; step++)
+            {
+                ctx.Execute();
+                losses[rank][step] = ctx.loss;
+            }
+        });
+    }
+    for(std::thread &rank : ranks)
+        rank.join();
+
+    for(int rank = 0; rank < R; rank++)
+    {
+        for(int step = 0; step < N; step++)
+            REQUIRE(std::abs(losses[rank][step] - reference_losses[step]) < 1e-5f);
+        for(int i = 0; i < O * I; i++)
+            REQUIRE(std::abs(w_data[rank][i] - w_ref[i]) < 1e-5f);
+    }
+}
+
+TEST_CASE("TestGradientAccumulation", "[Train]")
+{
+    // Accumulating three micro-batches of 2 examples must match one step on all 6 examples
+    constexpr int M = 3, B = 2, I = 3, O = 2, N = 4;
+    auto build = [](gg::nn::Module &network, gg::dim_t batch)
+    {
+        auto x = network.AddInput({ batch, I, 1 });
+        auto w = network.AddWeight({ O, I });
+        auto b = network.AddWeight({ O, 1 });
+        return std::make_tuple(x, w, b, ((w % x) + b).relu());
+    };
+
+    float x_data[M * B * I], y_data[M * B * O];
+    for(int i = 0; i < M * B * I; i++)
+        x_data[i] = 0.1f * (i % 7) - 0.2f;
+    for(int i = 0; i < M * B * O; i++)
+        y_data[i] = 0.05f * i;
+    float w_data[O * I], b_data[O] = { 0.1f, 0.2f };
+    for(int i = 0; i < O * I; i++)
+        w_data[i] = 0.1f * i - 0.1f;
+    float w_ref[O * I], b_ref[O];
+    std::copy(std::begin(w_data), std::end(w_data), w_ref);
+    std::copy(std::begin(b_data), std::end(b_data), b_ref);
+
+    gg::nn::Module reference;
+    auto [x1, w1, b1, result1] = build(reference, M * B);
+    gg::TrainingContext ctx1 = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+        reference, result1, gg::Sgd{ .learning_rate = 0.05f, .momentum = 0.5f });
+    x1.data() = x_data;
+    w1.data() = w_ref;
+    b1.data() = b_ref;
+    ctx1.training_example = y_data;
+
+    gg::nn::Module network;
+    auto [x, w, b, result] = build(network, B);
+    gg::TrainingContext ctx = gg::CompileAccumulatingTrainingGraph<gg::codegen::BackendScalarC>(
+        network, result, gg::Sgd{ .learning_rate = 0.05f, .momentum = 0.5f });
+    w.data() = w_data;
+    b.data() = b_data;
+
+    for(int step = 0; step < N; step++)
+    {
+        ctx1.Execute();
+        for(int micro_batch = 0; micro_batch < M; micro_batch++)
+        {
+            x.data() = x_data + micro_batch * B * I;
+            ctx.training_example = y_data + micro_batch * B * O;
+            ctx.Accumulate();
+        }
+        ctx.Update();
+        for(int i = 0; i < O * I; i++)
+            REQUIRE(std::abs(w_data[i] - w_ref[i]) < 1e-5f);
+        for(int i = 0; i < O; i++)
+            REQUIRE(std::abs(b_data[i] - b_ref[i]) < 1e-5f);
+    }
+}
+
+TEST_CASE("TestProfileGuidedRecompile", "[Train]")
+{
+    // Training switches to the code compiled with the profile of its first steps and goes on
+    // like training without a profile
+    constexpr size_t ProfileRuns = 3;
+    constexpr gg::dim_t B = 4;
+    const std::vector<gg::dim_t> sizes = { 3, 2 };
+    auto train = [&](size_t profile_runs)
+    {
+        Mlp mlp(B, sizes);
+        auto backend = std::make_unique<gg::codegen::BackendScalarC>();
+        backend->profile_runs = profile_runs;
+        gg::codegen::BackendScalarC *scalar_c = backend.get();
+        gg::TrainingContext ctx = gg::CompileTrainingGraph(mlp.network, mlp.result(), std::move(backend), gg::Sgd{ .learning_rate = 0.01f });
+
+        void *instrumented = scalar_c->handle;
+        mlp.Train(ctx, ProfileRuns + 1);
+        if(profile_runs != 0)
+        {
+            REQUIRE(scalar_c->optimized_handle.valid());
+            scalar_c->optimized_handle.wait();
+        }
+        mlp.Train(ctx, 1);
+        ctx.Evaluate();
+        if(profile_runs != 0)
+        {
+            REQUIRE(scalar_c->handle != instrumented);
+            REQUIRE(scalar_c->profile_runs == 0);
+        }
+        return mlp.run;
+    };
+    TrainingRun profiled = train(ProfileRuns);
+    RequireClose(profiled, train(0), 1e-5f);
+    RequireClose(profiled, ReferenceMlpSteps(B, sizes, ProfileRuns + 2, 0.01f), 1e-4f);
+}
+
+TEST_CASE("TestParallelCompile", "[Train]")
+{
+    // A deep MLP split across files compiled in parallel must train like one compiled as a
+    // single file
+    constexpr gg::dim_t B = 8, W = 16, Depth = 24;
+    const std::vector<gg::dim_t> sizes(Depth + 1, W);
+    auto train = [&](size_t max_compile_units)
+    {
+        Mlp mlp(B, sizes);
+        auto backend = std::make_unique<gg::codegen::BackendScalarC>();
+        backend->max_compile_units = max_compile_units;
+        gg::codegen::BackendScalarC *scalar_c = backend.get();
+        gg::TrainingContext ctx = gg::CompileTrainingGraph(mlp.network, mlp.result(), std::move(backend), gg::Sgd{ .learning_rate = 0.01f });
+        REQUIRE(scalar_c->compile_times.compile > 0.0);
+        if(max_compile_units > 1)
+            REQUIRE(scalar_c->source_paths.size() > 1);
+        else
+            REQUIRE(scalar_c->source_paths.size() == 1);
+        mlp.Train(ctx, 3);
+        return mlp.run;
+    };
+    TrainingRun split = train(4);
+    RequireClose(split, train(1), 1e-5f);
+    RequireClose(split, ReferenceMlpSteps(B, sizes, 3, 0.01f), 1e-4f);
+}
+
+TEST_CASE("TestActivationCheckpointing", "[Train]")
+{
+    // Recomputing activations must train the same weights as keeping them, in less memory
+    constexpr gg::dim_t B = 64, I = 8, H = 16, O = 4, N = 3;
+    const std::vector<gg::dim_t> sizes = { I, H, H, H, O };
+    auto train = [&](auto make_policy, size_t &intermediate_bytes)
+    {
+        Mlp mlp(B, sizes);
+        gg::GraphNodeHandle h2 = mlp.activations[1];
+        gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+            mlp.network, mlp.result(), gg::Sgd{ .learning_rate = 0.01f }, make_policy(h2));
+        mlp.Train(ctx, N);
+        intermediate_bytes = ctx.intermediate_bytes;
+        return mlp.run;
+    };
+
+    size_t keep_bytes, marked_bytes, budget_bytes;
+    TrainingRun keep = train([](auto) { return gg::KeepActivations{}; }, keep_bytes);
+    TrainingRun marked = train([](auto h2) { return gg::CheckpointNodes{ { h2 } }; }, marked_bytes);
+    TrainingRun budget = train([](auto) { return gg::CheckpointBudget{ 0 }; }, budget_bytes);
+    INFO("keep " << keep_bytes << ", marked " << marked_bytes << ", budget " << budget_bytes);
+    REQUIRE(marked_bytes < keep_bytes);
+    REQUIRE(budget_bytes < keep_bytes);
+    RequireClose(marked, keep, 1e-5f);
+    RequireClose(budget, keep, 1e-5f);
+    RequireClose(keep, ReferenceMlpSteps(B, sizes, N, 0.01f), 1e-4f);
+}
+
+TEST_CASE("TestMixedPrecision", "[Train]")
+{
+    // Storing activations in 16 bits trains nearly the same weights as F32, in less memory
+    constexpr gg::dim_t B = 32, I = 8, H = 16, O = 4, N = 10;
+    const std::vector<gg::dim_t> sizes = { I, H, O };
+    auto train = [&](gg::DataType dtype, size_t &intermediate_bytes)
+    {
+        Mlp mlp(B, sizes);
+        gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+            mlp.network, mlp.result(), gg::Sgd{ .learning_rate = 0.01f }, gg::KeepActivations{}, dtype);
+        mlp.Train(ctx, N);
+        intermediate_bytes = ctx.intermediate_bytes;
+        return mlp.run;
+    };
+
+    size_t f32_bytes;
+    TrainingRun f32 = train(gg::DataType::F32, f32_bytes);
+    REQUIRE(f32.losses.back() < f32.losses.front());
+    RequireClose(f32, ReferenceMlpSteps(B, sizes, N, 0.01f), 1e-4f);
+    for(gg::DataType dtype : { gg::DataType::F16, gg::DataType::BF16 })
+    {
+        size_t bytes;
+        TrainingRun run = train(dtype, bytes);
+        INFO("F32 " << f32_bytes << ", 16 bit " << bytes);
+        REQUIRE(bytes < f32_bytes);
+        REQUIRE(run.losses.back() < run.losses.front());
+        for(int step = 0; step < N; step++)
+            REQUIRE(std::abs(run.losses[step] - f32.losses[step]) <= 0.02f * f32.losses[step]);
+        for(size_t i = 0; i < run.weights.size(); i++)
+            REQUIRE(std::abs(run.weights[i] - f32.weights[i]) < 1e-2f);
+    }
+}
+
 TEST_CASE("TestXor", "[Codegen]")
 {
     gg::Graph graph;
@@ -170,32 +1289,220 @@ TEST_CASE("TestXor", "[Codegen]")
     }
 }
 
-static std::default_random_engine Gen(0);
+TEST_CASE("TestBatchDim", "[Codegen]")
+{
+    // One program serves every batch size up to the maximum, and means over the batch divide
+    // by the batch size that was run
+    constexpr gg::dim_t MaxBatch = 4, I = 3, O = 2;
+    gg::Graph graph;
+    auto x = graph.AddInput(gg::BatchDim{ MaxBatch }, { I, 1 });
+    auto w = graph.AddInput({ O, I });
+    auto y = (w % x).relu() - x.mean(0).sum();
+    REQUIRE(x->batched);
+    REQUIRE(y->batched);
+    REQUIRE(y.shape() == gg::Shape{ MaxBatch, O, 1 });
+    auto result = y.Compile<gg::codegen::BackendScalarC>();
 
-void RandomMatrix(float *m, size_t size_elts)
+    float x_data[MaxBatch * I], w_data[O * I] = { 1.0f, -1.0f, 0.5f, 0.25f, 2.0f, -0.5f };
+    for(int i = 0; i < MaxBatch * I; i++)
+        x_data[i] = 0.5f * (i % 5) - 0.75f;
+    x.data() = x_data;
+    w.data() = w_data;
+    for(gg::dim_t batch = 1; batch <= MaxBatch; batch++)
+    {
+        std::fill(result.data, result.data + MaxBatch * O, -100.0f);
+        result.SetBatchSize(batch);
+        result.Execute();
+
+        float mean_sum = 0.0f;
+        for(int i = 0; i < batch * I; i++)
+            mean_sum += x_data[i] / batch;
+        for(int b = 0; b < MaxBatch; b++)
+        {
+            for(int o = 0; o < O; o++)
+            {
+                float dot = 0.0f;
+                for(int i = 0; i < I; i++)
+                    dot += w_data[o * I + i] * x_data[b * I + i];
+                float expected = b < batch ? std::max(dot, 0.0f) - mean_sum : -100.0f;
+                REQUIRE(std::abs(result.data[b * O + o] - expected) < 1e-5f);
+            }
+        }
+    }
+    REQUIRE_THROWS(result.SetBatchSize(MaxBatch + 1));
+    REQUIRE_THROWS(x.transpose());
+}
+
+TEST_CASE("TestTrainBatchDim", "[Train]")
 {
-    std::uniform_real_distribution<float> dist(-2.0f, 2.0f);
-    for(size_t i = 0; i < size_elts; i++)
-        m[i] = dist(Gen);
+    // Training on a partial batch matches a network built for exactly that batch size
+    constexpr gg::dim_t MaxBatch = 5, Batch = 3, N = 3;
+    const std::vector<gg::dim_t> sizes = { 3, 4, 2 };
+    auto train = [&](gg::dim_t batch, bool batch_dim)
+    {
+        Mlp mlp(batch, sizes, batch_dim);
+        gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+            mlp.network, mlp.result(), gg::Sgd{ .learning_rate = 0.1f });
+        if(batch_dim)
+            ctx.SetBatchSize(Batch);
+        mlp.Train(ctx, N);
+        return mlp.run;
+    };
+    TrainingRun partial = train(MaxBatch, true);
+    RequireClose(partial, train(Batch, false), 1e-5f);
+    RequireClose(partial, ReferenceMlpSteps(Batch, sizes, N, 0.1f), 1e-4f);
 }
 
-void NaiveMatmul(float *x, float *y, size_t A, size_t B, size_t C, float *result)
+TEST_CASE("TestRaggedInput", "[Codegen]")
 {
-    for(size_t irow = 0; irow < A; irow++)
+    // Rows of lengths 2, 0 and 3 of 2-element vectors, packed without padding
+    constexpr gg::dim_t Rows = 3, MaxLength = 4, D = 2;
+    int64_t offsets[Rows + 1] = { 0, 2, 2, 5 };
+    float values[5 * D] = { 1, 2, 3, 4, 5, -6, 7, 8, -9, 10 };
+
+    gg::Graph graph;
+    gg::RaggedInput x = graph.AddRaggedInput(Rows, MaxLength, { D });
+    auto w = graph.AddInput({ D });
+    auto scaled = x.values * w;
+    auto row_sums = scaled.sum(gg::dim_t{ 1 });
+    auto row_max = x.values.max(gg::dim_t{ 1 });
+    REQUIRE(x.offsets->dtype == gg::DataType::I64);
+    REQUIRE(scaled->ragged);
+    REQUIRE(!row_sums->ragged);
+    REQUIRE(row_sums.shape() == gg::Shape{ Rows, D });
+    REQUIRE_THROWS(x.values.sum(gg::dim_t{ 0 }));
+
+    auto scaled_result = scaled.Compile<gg::codegen::BackendScalarC>();
+    auto sums_result = row_sums.Compile<gg::codegen::BackendScalarC>();
+    auto max_result = row_max.Compile<gg::codegen::BackendScalarC>();
+    float w_data[D] = { 0.5f, -1.0f };
+    x.SetData(values, offsets);
+    w.data() = w_data;
+
+    std::fill(scaled_result.data, scaled_result.data + Rows * MaxLength * D, 100.0f);
+    scaled_result.Execute();
+    sums_result.Execute();
+    max_result.Execute();
+    for(gg::dim_t r = 0; r < Rows; r++)
     {
-        float *row = x + B * irow;
-        for(size_t icol = 0; icol < C; icol++)
+        for(gg::dim_t d = 0; d < D; d++)
         {
-            float res = 0.0f;
-
-            float *col = y + icol;
-            for(size_t i = 0; i < B; i++)
+            float sum = 0.0f, max = -INFINITY;
+            for(gg::dim_t j = 0; j < MaxLength; j++)
             {
-                res += row[i] * col[C * i];
+                // Padding is never written
+                float *scaled_elt = scaled_result.data + (r * MaxLength + j) * D + d;
+                if(offsets[r] + j >= offsets[r + 1])
+                {
+                    REQUIRE(*scaled_elt == 100.0f);
+                    continue;
+                }
+                float value = values[(offsets[r] + j) * D + d];
+                REQUIRE(*scaled_elt == value * w_data[d]);
+                sum += value * w_data[d];
+                max = std::max(max, value);
             }
-            result[C * irow + icol] = res;
+            REQUIRE(sums_result.data[r * D + d] == sum);
+            if(offsets[r + 1] > offsets[r])
+                REQUIRE(max_result.data[r * D + d] == max);
+        }
+    }
+}
+
+TEST_CASE("TestIndexedInput", "[Codegen]")
+{
+    // Rows are read from the dataset in the order of the indices, repeats included
+    constexpr gg::dim_t MaxBatch = 4, NumExamples = 10, D = 3;
+    uint8_t dataset[NumExamples * D];
+    for(size_t i = 0; i < NumExamples * D; i++)
+        dataset[i] = static_cast<uint8_t>(11 * i);
+    int64_t indices[MaxBatch] = { 7, 2, 2, 9 };
+
+    gg::Graph graph;
+    gg::IndexedInput x = graph.AddIndexedInput(gg::BatchDim{ MaxBatch }, { D }, gg::DataType::U8);
+    auto w = graph.AddInput({ D });
+    auto y = (x.values.cast(gg::DataType::F32) * w).sum(gg::dim_t{ 1 });
+    REQUIRE(x.values.shape() == gg::Shape{ MaxBatch, D });
+    REQUIRE(x.indices->dtype == gg::DataType::I64);
+    REQUIRE(y->batched);
+    auto result = y.Compile<gg::codegen::BackendScalarC>();
+    float w_data[D] = { 1.0f, -0.5f, 0.25f };
+    x.SetData(dataset, indices);
+    w.data() = w_data;
+
+    std::fill(result.data, result.data + MaxBatch, -100.0f);
+    result.SetBatchSize(3);
+    result.Execute();
+    for(gg::dim_t b = 0; b < MaxBatch; b++)
+    {
+        float expected = 0.0f;
+        for(gg::dim_t d = 0; d < D; d++)
+            expected += dataset[indices[b] * D + d] * w_data[d];
+        REQUIRE(result.data[b] == (b < 3 ? expected : -100.0f));
+    }
+
+    // Stepping through shuffled indices trains like stepping through copies of the rows
+    constexpr size_t NumSteps = 3;
+    int64_t step_indices[NumSteps * MaxBatch];
+    float copies[NumSteps * MaxBatch * D];
+    float label_data[NumSteps * MaxBatch];
+    for(size_t i = 0; i < NumSteps * MaxBatch; i++)
+    {
+        step_indices[i] = static_cast<int64_t>((7 * i + 3) % NumExamples);
+        for(gg::dim_t d = 0; d < D; d++)
+            copies[i * D + d] = dataset[step_indices[i] * D + d];
+        label_data[i] = 0.1f * (i % 4);
+    }
+    auto train = [&](bool indexed)
+    {
+        gg::nn::Module network;
+        gg::IndexedInput xi = network.AddIndexedInput(gg::BatchDim{ MaxBatch }, { D }, gg::DataType::U8);
+        auto xc = network.AddInput(gg::BatchDim{ MaxBatch }, { D });
+        auto features = indexed ? xi.values.cast(gg::DataType::F32) : xc;
+        auto wt = network.AddWeight(D);
+        gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+            network,
+            (features * wt / 255.0f).sum(gg::dim_t{ 1 }),
+            0.01f);
+        std::array<float, D> wt_data = { 0.1f, -0.2f, 0.3f };
+        wt.data() = wt_data.data();
+        xi.SetData(dataset, step_indices);
+        xc.data() = copies;
+
+        std::array<float, NumSteps> losses;
+        if(indexed)
+            ctx.ExecuteSteps(NumSteps, xi.indices, step_indices, label_data, losses.data());
+        else
+            ctx.ExecuteSteps(NumSteps, xc, copies, label_data, losses.data());
+        return std::make_pair(wt_data, losses);
+    };
+    auto [indexed_weights, indexed_losses] = train(true);
+    auto [copied_weights, copied_losses] = train(false);
+    for(gg::dim_t d = 0; d < D; d++)
+        REQUIRE(indexed_weights[d] == Approx(copied_weights[d]));
+    for(size_t i = 0; i < NumSteps; i++)
+        REQUIRE(indexed_losses[i] == Approx(copied_losses[i]));
+
+    float expected_weights[D] = { 0.1f, -0.2f, 0.3f };
+    for(size_t step = 0; step < NumSteps; step++)
+    {
+        float loss = 0.0f, gradient[D] = {};
+        for(gg::dim_t b = 0; b < MaxBatch; b++)
+        {
+            const float *row = &copies[(step * MaxBatch + b) * D];
+            float error = -label_data[step * MaxBatch + b];
+            for(gg::dim_t d = 0; d < D; d++)
+                error += row[d] * expected_weights[d] / 255.0f;
+            loss += error * error;
+            for(gg::dim_t d = 0; d < D; d++)
+                gradient[d] += 2.0f * error * row[d] / 255.0f;
         }
+        REQUIRE(indexed_losses[step] == Approx(loss));
+        for(gg::dim_t d = 0; d < D; d++)
+            expected_weights[d] -= 0.01f * gradient[d];
     }
+    for(gg::dim_t d = 0; d < D; d++)
+        REQUIRE(indexed_weights[d] == Approx(expected_weights[d]));
 }
 
 TEST_CASE("TestMatmul", "[Codegen]")
@@ -234,6 +1541,279 @@ TEST_CASE("TestMatmul", "[Codegen]")
     }
 }
 
+TEST_CASE("TestEvaluate", "[Train]")
+{
+    // Evaluate runs the forward pass of the training module on new inputs with the trained
+    // weights, without training on them
+    constexpr gg::dim_t B = 4, I = 3, O = 2;
+    gg::nn::Module network;
+    auto x = network.AddInput({ B, I, 1 });
+    auto w = network.AddWeight({ O, I });
+    auto y = (w % x).relu();
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, y, 0.01f);
+
+    float x_data[B * I], test_x_data[B * I], w_data[O * I], training_example_data[B * O];
+    RandomMatrix(x_data, B * I);
+    RandomMatrix(test_x_data, B * I);
+    RandomMatrix(w_data, O * I);
+    RandomMatrix(training_example_data, B * O);
+    x.data() = x_data;
+    w.data() = w_data;
+    ctx.training_example = training_example_data;
+    for(int i = 0; i < 5; i++)
+        ctx.Execute();
+    float loss = *ctx.loss;
+
+    x.data() = test_x_data;
+    std::array<float, O * I> trained_w;
+    std::copy(w_data, w_data + O * I, trained_w.begin());
+    ctx.Evaluate();
+    REQUIRE(std::equal(trained_w.begin(), trained_w.end(), w_data));
+    REQUIRE(*ctx.loss == loss);
+    for(gg::dim_t b = 0; b < B; b++)
+    {
+        for(gg::dim_t o = 0; o < O; o++)
+        {
+            float dot = 0.0f;
+            for(gg::dim_t i = 0; i < I; i++)
+                dot += w_data[o * I + i] * test_x_data[b * I + i];
+            REQUIRE(std::abs(ctx.output[b * O + o] - std::max(dot, 0.0f)) < 1e-5f);
+        }
+    }
+
+    // The training step writes its model output to the same buffer, computed with the weights
+    // from before its update
+    x.data() = x_data;
+    std::copy(w_data, w_data + O * I, trained_w.begin());
+    ctx.Execute();
+    for(gg::dim_t b = 0; b < B; b++)
+    {
+        for(gg::dim_t o = 0; o < O; o++)
+        {
+            float dot = 0.0f;
+            for(gg::dim_t i = 0; i < I; i++)
+                dot += trained_w[o * I + i] * x_data[b * I + i];
+            REQUIRE(std::abs(ctx.output[b * O + o] - std::max(dot, 0.0f)) < 1e-5f);
+        }
+    }
+}
+
+TEST_CASE("TestFixedShapeExpressions", "[Codegen]")
+{
+    // The same network written with fixed shapes computes what BackendScalarC does
+    constexpr gg::dim_t B = 4, I = 5, H = 6, O = 3;
+    float x_data[B * I], w1_data[I * H], b1_data[H], w2_data[H * O];
+    RandomMatrix(x_data, B * I);
+    RandomMatrix(w1_data, I * H);
+    RandomMatrix(b1_data, H);
+    RandomMatrix(w2_data, H * O);
+
+    gg::Graph graph;
+    auto x = graph.AddInput({ B, I });
+    auto w1 = graph.AddInput({ I, H });
+    auto b1 = graph.AddInput(H);
+    auto w2 = graph.AddInput({ H, O });
+    auto logits = (x % w1 + b1).relu() % w2;
+    auto y = gg::exp(logits - logits.max(gg::dim_t{ 1 }, true)) / 2.0f + gg::sigmoid(logits).sum(gg::dim_t{ 0 }, true);
+    x.data() = x_data;
+    w1.data() = w1_data;
+    b1.data() = b1_data;
+    w2.data() = w2_data;
+    auto reference = y.Compile<gg::codegen::BackendScalarC>();
+    reference.Execute();
+
+    namespace gf = gg::fixed;
+    gf::Input<B, I> fx = { {}, x_data };
+    gf::Input<I, H> fw1 = { {}, w1_data };
+    gf::Input<H> fb1 = { {}, b1_data };
+    gf::Input<H, O> fw2 = { {}, w2_data };
+    gf::Array<B, H> hidden = gf::relu(fx % fw1 + fb1);
+    gf::Array<B, O> flogits = hidden % fw2;
+    auto fy = gf::exp(flogits - gf::reshape<B, 1>(gf::max<1>(flogits))) / 2.0f
+        + gf::reshape<1, O>(gf::sum<0>(gf::sigmoid(flogits)));
+    static_assert(std::is_same_v<decltype(fy)::extents, gf::Extents<B, O>>);
+    float result[B * O];
+    gf::Evaluate(fy, result);
+    for(gg::dim_t i = 0; i < B * O; i++)
+        REQUIRE(result[i] == Approx(reference.data[i]).epsilon(1e-5));
+}
+
+TEST_CASE("TestCompileInference", "[Codegen]")
+{
+    // An inference batchnorm after an affine layer folds into its weights and bias, so none of
+    // its statistics are read by the compiled program. The final relu is stored in place over
+    // the matmul it reads.
+    constexpr gg::dim_t B = 6, I = 5, H = 7, O = 3;
+    gg::nn::Module network;
+    auto x = network.AddInput(gg::BatchDim{ B }, { I });
+    auto w1 = network.AddWeight({ I, H });
+    auto b1 = network.AddWeight(H);
+    auto mean = network.AddWeight(H);
+    auto var = network.AddWeight(H);
+    auto gamma = network.AddWeight(H);
+    auto beta = network.AddWeight(H);
+    auto w2 = network.AddWeight({ H, O });
+    auto h = x % w1 + b1;
+    auto normalized = (h - mean) / gg::sqrt(var + 0.001f) * gamma + beta;
+    auto y = (normalized.relu() % w2).relu();
+
+    std::vector<float> x_data(B * I), w1_data(I * H), b1_data(H), mean_data(H), var_data(H), gamma_data(H), beta_data(H), w2_data(H * O);
+    RandomMatrix(x_data.data(), x_data.size());
+    RandomMatrix(w1_data.data(), w1_data.size());
+    RandomMatrix(b1_data.data(), b1_data.size());
+    RandomMatrix(mean_data.data(), mean_data.size());
+    RandomMatrix(gamma_data.data(), gamma_data.size());
+    RandomMatrix(beta_data.data(), beta_data.size());
+    RandomMatrix(w2_data.data(), w2_data.size());
+    for(gg::dim_t i = 0; i < H; i++)
+        var_data[i] = 0.5f + 0.25f * i;
+    x.data() = x_data.data();
+    w1.data() = w1_data.data();
+    b1.data() = b1_data.data();
+    mean.data() = mean_data.data();
+    var.data() = var_data.data();
+    gamma.data() = gamma_data.data();
+    beta.data() = beta_data.data();
+    w2.data() = w2_data.data();
+
+    auto reference = y.Compile<gg::codegen::BackendScalarC>();
+    reference.SetBatchSize(B - 2);
+    reference.Execute();
+
+    for(bool prepack : { false, true })
+    {
+        auto inference = gg::CompileInference<gg::codegen::BackendScalarC>(network, y, { .prepack_weights = prepack });
+        auto &program = static_cast<gg::codegen::BackendScalarC &>(*inference.backend).program;
+        for(auto statistic : { b1, mean, var, gamma, beta })
+            REQUIRE(!program.FindBuffer(statistic));
+        REQUIRE(program.FindBuffer(x));
+        REQUIRE(program.memory_plan);
+        REQUIRE(inference.shape == y.shape());
+
+        const gg::codegen::FunctionBuilder &relu = program.functions.back();
+        REQUIRE(relu.inputs.size() == 1);
+        REQUIRE(program.memory_plan->offsets_bytes[relu.output_buffer] == program.memory_plan->offsets_bytes[relu.inputs[0]]);
+
+        inference.SetBatchSize(B - 2);
+        inference.Execute();
+        for(gg::dim_t i = 0; i < (B - 2) * O; i++)
+            REQUIRE(std::abs(inference.data[i] - reference.data[i]) <= 1e-4f * std::max(1.0f, std::abs(reference.data[i])));
+    }
+}
+
+TEST_CASE("TestExportInference", "[Codegen]")
+{
+    // The exported library runs on its own and computes what the compiled model does
+    constexpr gg::dim_t B = 4, I = 3, O = 2;
+    gg::nn::Module network;
+    auto x = network.AddInput(gg::BatchDim{ B }, { I });
+    auto w = network.AddWeight({ I, O });
+    auto b = network.AddWeight(O);
+    auto y = (x % w + b).relu() - x.mean(0).sum();
+    float x_data[B * I], w_data[I * O], b_data[O];
+    RandomMatrix(x_data, B * I);
+    RandomMatrix(w_data, I * O);
+    RandomMatrix(b_data, O);
+    x.data() = x_data;
+    w.data() = w_data;
+    b.data() = b_data;
+    auto model = gg::CompileInference<gg::codegen::BackendScalarC>(network, y);
+    model.SetBatchSize(B - 1);
+    model.Execute();
+
+    std::string dir = "/tmp/gg-export-test-" + std::to_string(getpid());
+    gg::ExportInference(model, dir, "tiny");
+    REQUIRE_THROWS(gg::ExportInference(model, dir, "not a name"));
+    FILE *driver = std::fopen((dir + "/driver.c").c_str(), "w");
+    std::fprintf(driver, "#include <stdio.h>\n#include \"tiny.h\"\n\nint main(void)\n{\n");
+    std::fprintf(driver, "    float x[TINY_MAX_BATCH * %d] = {", static_cast<int>(I));
+    for(float v : x_data)
+        std::fprintf(driver, " %af,", static_cast<double>(v));
+    std::fprintf(driver, " };\n    float y[TINY_MAX_BATCH * %d];\n", static_cast<int>(O));
+    std::fprintf(driver, "    tiny_model *model = tiny_init();\n");
+    std::fprintf(driver, "    tiny_run(model, x, y, %d);\n", static_cast<int>(B - 1));
+    std::fprintf(driver, "    for(int i = 0; i < %d; i++)\n        printf(\"%%a\\n\", y[i]);\n", static_cast<int>((B - 1) * O));
+    std::fprintf(driver, "    tiny_free(model);\n    return 0;\n}\n");
+    std::fclose(driver);
+    std::string build = "cc -O2 " + dir + "/driver.c " + dir + "/tiny.c -o " + dir + "/driver -lm";
+    REQUIRE(std::system(build.c_str()) == 0);
+
+    FILE *output = popen((dir + "/driver").c_str(), "r");
+    for(gg::dim_t i = 0; i < (B - 1) * O; i++)
+    {
+        char line[64];
+        REQUIRE(std::fgets(line, sizeof(line), output));
+        REQUIRE(std::strtof(line, nullptr) == Approx(model.data[i]).margin(1e-6f));
+    }
+    pclose(output);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("TestQuantizeInt8", "[Codegen]")
+{
+    // I spans whole vectors of the dot product and a remainder
+    constexpr gg::dim_t B = 8, I = 80, H = 16, O = 4;
+    gg::nn::Module network;
+    auto x = network.AddInput(gg::BatchDim{ B }, { I });
+    auto w1 = network.AddWeight({ I, H });
+    auto b1 = network.AddWeight(H);
+    auto w2 = network.AddWeight({ H, O });
+    auto y = (x % w1 + b1).relu() % w2;
+
+    std::vector<float> calibration_data(2 * B * I), x_data(B * I), w1_data(I * H), b1_data(H), w2_data(H * O);
+    RandomMatrix(calibration_data.data(), calibration_data.size());
+    RandomMatrix(x_data.data(), x_data.size());
+    RandomMatrix(w1_data.data(), w1_data.size());
+    RandomMatrix(b1_data.data(), b1_data.size());
+    RandomMatrix(w2_data.data(), w2_data.size());
+    w1.data() = w1_data.data();
+    b1.data() = b1_data.data();
+    w2.data() = w2_data.data();
+
+    x.data() = x_data.data();
+    auto reference = y.Compile<gg::codegen::BackendScalarC>();
+    reference.Execute();
+    float max_output = 0.0f;
+    for(gg::dim_t i = 0; i < B * O; i++)
+        max_output = std::max(max_output, std::abs(reference.data[i]));
+
+    for(bool prepack : { false, true })
+    {
+        gg::QuantizeInt8 quantize = { [&](size_t ibatch)
+        {
+            x.data() = calibration_data.data() + ibatch * B * I;
+            return ibatch < 2;
+        } };
+        auto inference = gg::CompileInference<gg::codegen::BackendScalarC>(
+            network, y, { .prepack_weights = prepack, .quantize = quantize });
+        auto &program = static_cast<gg::codegen::BackendScalarC &>(*inference.backend).program;
+        REQUIRE(!program.FindBuffer(w1));
+        REQUIRE(!program.FindBuffer(w2));
+        size_t int8_bytes = 0;
+        for(const gg::codegen::BufferDescriptor &desc : program.buffers)
+            if(desc.dtype == gg::DataType::I8)
+                int8_bytes += desc.SizeBytes();
+        REQUIRE(int8_bytes == I * H + H * O + B * I + B * H);
+
+        // Prepacked weights are contiguous along the reduction like the activations, so both
+        // matmuls are dot products
+        size_t num_dot_products = 0;
+        for(const gg::codegen::FunctionBuilder &fn : program.functions)
+        {
+            num_dot_products += std::count_if(fn.insns.begin(), fn.insns.end(), [](const gg::codegen::Instruction &insn)
+            {
+                return std::holds_alternative<gg::codegen::DotInt8Insn>(insn);
+            });
+        }
+        REQUIRE(num_dot_products == (prepack ? 2 : 0));
+
+        x.data() = x_data.data();
+        inference.Execute();
+        for(gg::dim_t i = 0; i < B * O; i++)
+            REQUIRE(std::abs(inference.data[i] - reference.data[i]) <= 0.05f * max_output);
+    }
+}
+
 TEST_CASE("TestLogisticRegressionShape", "[Graph]")
 {
     gg::Graph graph;